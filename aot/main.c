@@ -0,0 +1,125 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <core/core.h>
+
+/***********************************************************************************************************/
+
+/* Display how to use the program, and return the exit code for having been used wrong. */
+static int usage (const char *name)
+{
+    fprintf (stderr, "Usage: %s [-c compiler] [-s] image module\n\n", name);
+    fprintf (stderr, "  image   The bytecode image file of the program to compile (such as one written by vm -w)\n");
+    fprintf (stderr, "  module  The shared object to compile it into, which vm -a (or ctx_aot()) can run\n");
+    fprintf (stderr, "  -c      The C compiler to use; the default is $CC, or cc if that isn't set\n");
+    fprintf (stderr, "  -s      Write the C source of the module to module instead of compiling it\n\n");
+    fprintf (stderr, "The module only runs the program that it was compiled from.\n");
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Compile the C source file given into a shared object, returning 1 if the compiler succeeded. */
+static int compile (const char *compiler, const char *source, const char *module)
+{
+    int status;
+    pid_t pid = fork ();
+
+    if (pid == -1)
+        return 0;
+
+    if (pid == 0)
+    {
+        execlp (compiler, compiler, "-O2", "-shared", "-fPIC", "-o", module, source, (char *) NULL);
+        fprintf (stderr, ">> *** << Unable to run %s\n", compiler);
+        _exit (127);
+    }
+
+    return waitpid (pid, &status, 0) == pid && WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+/***********************************************************************************************************/
+
+/* Entry point. */
+int main (int argc, char **argv)
+{
+    const char *compiler = getenv ("CC");
+    VMImage image;
+    ImageError imageError;
+    VerifyError error;
+    char *source;
+    FILE *file;
+    int sourceOnly = 0, option, result;
+
+    if (compiler == NULL || *compiler == '\0')
+        compiler = "cc";
+
+    while ((option = getopt (argc, argv, "c:s")) != -1)
+    {
+        switch (option)
+        {
+            case 'c': compiler = optarg; break;
+            case 's': sourceOnly = 1; break;
+            default:  return usage (argv[0]);
+        }
+    }
+
+    if (argc - optind != 2)
+        return usage (argv[0]);
+
+    if (image_open (argv[optind], &image, &imageError) == 0 || image_check (&image, &imageError) == 0)
+    {
+        fprintf (stderr, ">> *** << Unable to load %s\n", argv[optind]);
+        fprintf (stderr, ">> *** << %s\n", image_error_reason (imageError));
+        image_close (&image);
+        return 1;
+    }
+
+    /* The compiled program doesn't check anything that the verifier would have caught either. */
+    if (image.verified == 0 && verify_program (image.program, image.programLength, &error) == 0)
+    {
+        fprintf (stderr, ">> *** << Program failed verification at IP %d (%s)\n", error.ip, opcode_name (error.opcode));
+        fprintf (stderr, ">> *** << %s\n", ihalt_error_reason (error.reason, error.opcode));
+        image_close (&image);
+        return 1;
+    }
+
+    /* The source goes next to the module while it's compiled. */
+    source = malloc (strlen (argv[optind + 1]) + 3);
+    if (source == NULL)
+    {
+        image_close (&image);
+        return 1;
+    }
+
+    if (sourceOnly)
+        strcpy (source, argv[optind + 1]);
+    else
+        sprintf (source, "%s.c", argv[optind + 1]);
+
+    file = fopen (source, "w");
+    result = file != NULL && aot_generate (image.program, image.programLength, file);
+    if (file != NULL && fclose (file) != 0)
+        result = 0;
+
+    if (result == 0)
+        fprintf (stderr, ">> *** << Unable to write the program out to %s\n", source);
+    else if (sourceOnly == 0)
+    {
+        result = compile (compiler, source, argv[optind + 1]);
+        if (result == 0)
+            fprintf (stderr, ">> *** << Unable to compile %s with %s\n", source, compiler);
+    }
+
+    if (sourceOnly == 0)
+        remove (source);
+
+    free (source);
+    image_close (&image);
+
+    return result ? 0 : 1;
+}
+
+/***********************************************************************************************************/
@@ -0,0 +1,488 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <core/core.h>
+
+/***********************************************************************************************************/
+
+/* How many instructions each run of a workload executes by default, how many runs are timed, and the
+ * largest loop body that a workload can have. */
+#define BENCH_INSTRUCTIONS 20000000LL
+#define BENCH_REPETITIONS  10
+#define BENCH_BODY_MAX     1024
+
+/* Every workload is a loop around a body of code, counted down in REG_F against the 0 that is left at the
+ * top of the stack. The body has to leave the stack the way that it found it, and leave REG_F alone. The
+ * prologue and epilogue execute 4 instructions between them, and the loop itself adds 2 to every pass. */
+#define BENCH_OVERHEAD 4
+#define BENCH_LOOP     2
+
+/* The engines that a workload can be run on. The compact engine runs the compact encoding of the program
+ * directly (see compact.h) and ignores the engine in the context. */
+typedef enum
+{
+    BENCH_SWITCH,
+    BENCH_THREADED,
+    BENCH_JIT,
+    BENCH_COMPACT,
+    BENCH_ENGINE_COUNT,
+} BenchEngine;
+
+static const char *engine_names[BENCH_ENGINE_COUNT] = { "switch", "threaded", "jit", "compact" };
+
+/* A benchmark workload. The build function stores the loop body in the buffer provided and returns its
+ * length, storing the number of instructions that it executes in instructions. */
+typedef struct
+{
+    const char *name;
+    const char *kind;
+    const char *description;
+    int (*build) (int *body, int *instructions);
+} Workload;
+
+/***********************************************************************************************************/
+
+/* Append the code provided to the end of a body times times, returning the new length of the body. */
+static int emit (int *body, int length, const int *code, int codeLength, int times)
+{
+    while (times-- > 0)
+    {
+        memcpy (body + length, code, sizeof (int) * codeLength);
+        length += codeLength;
+    }
+
+    return length;
+}
+
+/***********************************************************************************************************/
+
+/* The microbenchmarks. Each of these repeats a single opcode (or the smallest group of them that leaves the
+ * stack balanced) 32 times, so that it is what the loop spends most of its time on. Where the decoder would
+ * fuse the group into a superinstruction, that is what gets measured, since that's what programs get. */
+
+static int build_loop (int *body, int *instructions)
+{
+    *instructions = 0;
+    return 0;
+}
+
+static int build_nop (int *body, int *instructions)
+{
+    static const int code[] = { NOP };
+
+    *instructions = 32;
+    return emit (body, 0, code, 1, 32);
+}
+
+static int build_push_pop (int *body, int *instructions)
+{
+    static const int code[] = { PUSH, 1, POP };
+
+    *instructions = 64;
+    return emit (body, 0, code, 3, 32);
+}
+
+static int build_push_set (int *body, int *instructions)
+{
+    static const int code[] = { PUSH, 1, SET, REG_A };
+
+    *instructions = 64;
+    return emit (body, 0, code, 4, 32);
+}
+
+static int build_push_add (int *body, int *instructions)
+{
+    static const int code[] = { PUSH, 1, ADD };
+
+    /* This adds to the 0 that the loop compares against, so take it back off at the end. */
+    static const int fixup[] = { PUSH, -32, ADD };
+
+    *instructions = 66;
+    return emit (body, emit (body, 0, code, 3, 32), fixup, 3, 1);
+}
+
+static int build_radd_pop (int *body, int *instructions)
+{
+    static const int code[] = { RADD, REG_A, REG_B, POP };
+
+    *instructions = 64;
+    return emit (body, 0, code, 4, 32);
+}
+
+static int build_radd_set (int *body, int *instructions)
+{
+    static const int code[] = { RADD, REG_A, REG_B, SET, REG_C };
+
+    *instructions = 64;
+    return emit (body, 0, code, 5, 32);
+}
+
+static int build_rdec (int *body, int *instructions)
+{
+    static const int code[] = { RDEC, REG_A };
+
+    *instructions = 32;
+    return emit (body, 0, code, 2, 32);
+}
+
+static int build_rjne (int *body, int *instructions)
+{
+    /* REG_E is never touched, so it always matches the 0 on the stack and the jump is never taken; the
+     * offset is the next instruction anyway. */
+    static const int code[] = { RJNE, REG_E, 3 };
+
+    *instructions = 32;
+    return emit (body, 0, code, 3, 32);
+}
+
+static int build_raddi (int *body, int *instructions)
+{
+    static const int code[] = { RADDI, REG_A, REG_A, 1 };
+
+    *instructions = 32;
+    return emit (body, 0, code, 4, 32);
+}
+
+static int build_rjnei (int *body, int *instructions)
+{
+    /* REG_E is never touched, so it always matches the 0 and the jump is never taken; the offset is the
+     * next instruction anyway. */
+    static const int code[] = { RJNEI, REG_E, 0, 4 };
+
+    *instructions = 32;
+    return emit (body, 0, code, 4, 32);
+}
+
+/***********************************************************************************************************/
+
+/* The macro benchmarks, which look more like real programs. */
+
+/* The loop from the built in program in vm, with a little more in it; nearly all of the time goes to the
+ * loop itself. */
+static int build_countdown (int *body, int *instructions)
+{
+    static const int code[] = { RADD, REG_A, REG_B, POP, RDEC, REG_A };
+
+    *instructions = 3;
+    return emit (body, 0, code, 6, 1);
+}
+
+/* Push the stack 128 items deep, then add it all back up and throw the result away. */
+static int build_stack_churn (int *body, int *instructions)
+{
+    static const int push[] = { PUSH, 1 };
+    static const int add[] = { ADD };
+    static const int pop[] = { POP };
+    int length;
+
+    length = emit (body, 0, push, 2, 128);
+    length = emit (body, length, add, 1, 127);
+    length = emit (body, length, pop, 1, 1);
+
+    *instructions = 256;
+    return length;
+}
+
+/* Step a Fibonacci sequence along in the registers, which is nothing but register arithmetic going through
+ * the stack. It wraps around long before the loop ends, which is fine. */
+static int build_fibonacci (int *body, int *instructions)
+{
+    static const int code[] = {
+        RADD, REG_A, REG_B,
+        SET, REG_C,
+        RADD, REG_B, REG_E,
+        SET, REG_A,
+        RADD, REG_C, REG_E,
+        SET, REG_B,
+    };
+
+    *instructions = 6 * 8;
+    return emit (body, 0, code, sizeof (code) / sizeof (int), 8);
+}
+
+/* The same Fibonacci sequence using the register forms, which takes half as many instructions and never
+ * touches the stack. */
+static int build_fibonacci_registers (int *body, int *instructions)
+{
+    static const int code[] = {
+        RADDR, REG_C, REG_A, REG_B,
+        RMOV, REG_A, REG_B,
+        RMOV, REG_B, REG_C,
+    };
+
+    *instructions = 3 * 8;
+    return emit (body, 0, code, sizeof (code) / sizeof (int), 8);
+}
+
+/* Sum a run of register pairs into a value on the stack, using the fused RADD/ADD. */
+static int build_accumulate (int *body, int *instructions)
+{
+    static const int code[] = { RADD, REG_A, REG_B, ADD, RADD, REG_C, REG_D, ADD };
+    static const int start[] = { PUSH, 0 };
+    static const int end[] = { POP };
+    int length;
+
+    length = emit (body, 0, start, 2, 1);
+    length = emit (body, length, code, 8, 16);
+    length = emit (body, length, end, 1, 1);
+
+    *instructions = 2 + 64;
+    return length;
+}
+
+/***********************************************************************************************************/
+
+/* All of the workloads. */
+static const Workload workloads[] = {
+    { "loop",          "micro", "An empty loop (closed form, except on the JIT)",    build_loop },
+    { "nop",           "micro", "NOP, which is nothing but dispatch",               build_nop },
+    { "push_pop",      "micro", "PUSH followed by POP",                             build_push_pop },
+    { "push_set",      "micro", "PUSH followed by SET (fused)",                     build_push_set },
+    { "push_add",      "micro", "PUSH followed by ADD",                             build_push_add },
+    { "radd_pop",      "micro", "RADD followed by POP",                             build_radd_pop },
+    { "radd_set",      "micro", "RADD followed by SET",                             build_radd_set },
+    { "rdec",          "micro", "RDEC",                                             build_rdec },
+    { "rjne",          "micro", "RJNE that is never taken",                         build_rjne },
+    { "raddi",         "micro", "RADDI",                                            build_raddi },
+    { "rjnei",         "micro", "RJNEI that is never taken",                        build_rjnei },
+    { "countdown",     "macro", "A long counted loop with a small body",            build_countdown },
+    { "stack_churn",   "macro", "Filling the stack 128 deep and adding it back up", build_stack_churn },
+    { "fibonacci",     "macro", "Register arithmetic through the stack",            build_fibonacci },
+    { "fibonacci_reg", "macro", "The same arithmetic with the register forms",      build_fibonacci_registers },
+    { "accumulate",    "macro", "Summing registers on the stack (fused RADD/ADD)",  build_accumulate },
+};
+
+#define WORKLOAD_COUNT ((int) (sizeof (workloads) / sizeof (Workload)))
+
+/***********************************************************************************************************/
+
+/* Build the program for a workload, running it for as many passes as it takes to execute about the number
+ * of instructions given. The number of instructions that the program actually executes is stored in
+ * executed. Returns the length of the program. */
+static int build_program (const Workload *workload, int *program, long long instructions, long long *executed)
+{
+    int body[BENCH_BODY_MAX];
+    int bodyLength, bodyInstructions, passes, length = 0;
+
+    bodyLength = workload->build (body, &bodyInstructions);
+
+    passes = (int) (instructions / (bodyInstructions + BENCH_LOOP));
+    if (passes < 1)
+        passes = 1;
+
+    /* The 0 that the loop counter is compared against, and the loop counter. */
+    program[length++] = PUSH;
+    program[length++] = 0;
+    program[length++] = PUSH;
+    program[length++] = passes;
+    program[length++] = SET;
+    program[length++] = REG_F;
+
+    memcpy (program + length, body, sizeof (int) * bodyLength);
+    length += bodyLength;
+
+    program[length++] = RDEC;
+    program[length++] = REG_F;
+    program[length++] = RJNE;
+    program[length++] = REG_F;
+    program[length] = -(bodyLength + 2);
+    length++;
+
+    program[length++] = HALT;
+
+    *executed = BENCH_OVERHEAD + (long long) passes * (bodyInstructions + BENCH_LOOP);
+    return length;
+}
+
+/***********************************************************************************************************/
+
+/* Run a program once on the engine given, returning how long it took in nanoseconds, or -1 if it didn't
+ * halt cleanly. The time includes decoding the program, which is nothing next to running it. */
+static double run_once (int *program, int programLength, const unsigned char *compact, int compactSize,
+                        BenchEngine engine)
+{
+    struct timespec start, end;
+    VMContext context;
+
+    if (engine == BENCH_COMPACT)
+        ctx_init_compact (&context, compact, compactSize);
+    else
+    {
+        ctx_init (&context, program, programLength);
+        context.engine = engine == BENCH_SWITCH ? VM_ENGINE_SWITCH :
+                         engine == BENCH_THREADED ? VM_ENGINE_THREADED : VM_ENGINE_JIT;
+    }
+
+    context.traceLevel = VM_TRACE_ERRORS;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    vm_interpret (&context);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    ctx_release (&context);
+
+    if (context.error)
+        return -1;
+
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+/***********************************************************************************************************/
+
+/* Time a workload on an engine, and output the result as a JSON object. Returns 0 if the workload didn't
+ * run properly. */
+static int bench (const Workload *workload, BenchEngine engine, long long instructions, int repetitions,
+                  int first)
+{
+    static int program[BENCH_BODY_MAX + 16];
+    unsigned char *compact = NULL;
+    int programLength, compactSize = 0, i;
+    double sum = 0, sumSquares = 0, best = 0, worst = 0, mean, variance;
+    long long executed;
+
+    programLength = build_program (workload, program, instructions, &executed);
+
+    if (engine == BENCH_COMPACT)
+    {
+        compact = compact_encode (program, programLength, &compactSize);
+        if (compact == NULL)
+            return 0;
+    }
+
+    /* One run that isn't counted, to warm up the caches and the branch predictor. */
+    if (run_once (program, programLength, compact, compactSize, engine) < 0)
+    {
+        free (compact);
+        return 0;
+    }
+
+    for (i = 0 ; i < repetitions ; i++)
+    {
+        double ns = run_once (program, programLength, compact, compactSize, engine) / executed;
+
+        sum += ns;
+        sumSquares += ns * ns;
+
+        if (i == 0 || ns < best)
+            best = ns;
+        if (i == 0 || ns > worst)
+            worst = ns;
+    }
+
+    free (compact);
+
+    mean = sum / repetitions;
+    variance = repetitions > 1 ? (sumSquares - sum * mean) / (repetitions - 1) : 0;
+    if (variance < 0)
+        variance = 0;
+
+    printf ("%s    {\"name\": \"%s\", \"kind\": \"%s\", \"engine\": \"%s\", \"instructions\": %lld, "
+            "\"repetitions\": %d, \"ns_per_instruction\": %.4f, \"min_ns_per_instruction\": %.4f, "
+            "\"max_ns_per_instruction\": %.4f, \"variance\": %.6f, \"stddev\": %.4f, "
+            "\"instructions_per_second\": %.0f}",
+            first ? "" : ",\n", workload->name, workload->kind, engine_names[engine], executed, repetitions,
+            mean, best, worst, variance, sqrt (variance), mean > 0 ? 1e9 / mean : 0);
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Display how to use the program, and return the exit code for having been used wrong. */
+static int usage (const char *name)
+{
+    int i;
+
+    fprintf (stderr, "Usage: %s [-e engine] [-w workload] [-n instructions] [-r repetitions]\n", name);
+    fprintf (stderr, "       %s -l\n\n", name);
+    fprintf (stderr, "  -e      Only run on the engine given (switch, threaded, jit or compact)\n");
+    fprintf (stderr, "  -w      Only run the workload given\n");
+    fprintf (stderr, "  -n      Execute about this many instructions in each run (default %lld)\n",
+             BENCH_INSTRUCTIONS);
+    fprintf (stderr, "  -r      Time this many runs of each workload (default %d)\n", BENCH_REPETITIONS);
+    fprintf (stderr, "  -l      List the workloads, and exit\n\n");
+    fprintf (stderr, "Results are written to standard output as JSON.\n\n");
+
+    fprintf (stderr, "Workloads:\n");
+    for (i = 0 ; i < WORKLOAD_COUNT ; i++)
+        fprintf (stderr, "  %-12s %s\n", workloads[i].name, workloads[i].description);
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Entry point. */
+int main (int argc, char **argv)
+{
+    const char *onlyWorkload = NULL;
+    long long instructions = BENCH_INSTRUCTIONS;
+    int repetitions = BENCH_REPETITIONS, onlyEngine = -1, first = 1, failed = 0, option, i, e;
+
+    fprintf (stderr, "SimpleVM benchmarks - %s (%s)\n\n", VERSION, REVISION);
+
+    while ((option = getopt (argc, argv, "e:w:n:r:l")) != -1)
+    {
+        switch (option)
+        {
+            case 'e':
+                for (onlyEngine = 0 ; onlyEngine < BENCH_ENGINE_COUNT ; onlyEngine++)
+                {
+                    if (strcmp (optarg, engine_names[onlyEngine]) == 0)
+                        break;
+                }
+
+                if (onlyEngine == BENCH_ENGINE_COUNT)
+                    return usage (argv[0]);
+                break;
+
+            case 'w': onlyWorkload = optarg; break;
+            case 'n': instructions = atoll (optarg); break;
+            case 'r': repetitions = atoi (optarg); break;
+
+            case 'l':
+                for (i = 0 ; i < WORKLOAD_COUNT ; i++)
+                    printf ("%s\n", workloads[i].name);
+                return 0;
+
+            default:
+                return usage (argv[0]);
+        }
+    }
+
+    if (optind != argc || instructions < 1 || repetitions < 1)
+        return usage (argv[0]);
+
+    printf ("{\n  \"version\": \"%s\",\n  \"jit\": %s,\n  \"results\": [\n", VERSION,
+            VM_HAVE_JIT ? "true" : "false");
+
+    for (i = 0 ; i < WORKLOAD_COUNT ; i++)
+    {
+        if (onlyWorkload != NULL && strcmp (onlyWorkload, workloads[i].name) != 0)
+            continue;
+
+        for (e = 0 ; e < BENCH_ENGINE_COUNT ; e++)
+        {
+            if (onlyEngine != -1 && onlyEngine != e)
+                continue;
+
+            fprintf (stderr, "%s on %s...\n", workloads[i].name, engine_names[e]);
+            if (bench (&workloads[i], (BenchEngine) e, instructions, repetitions, first) == 0)
+            {
+                fprintf (stderr, ">> *** << %s failed to run on %s\n", workloads[i].name, engine_names[e]);
+                failed = 1;
+                continue;
+            }
+
+            first = 0;
+        }
+    }
+
+    printf ("\n  ]\n}\n");
+
+    return failed;
+}
+
+/***********************************************************************************************************/
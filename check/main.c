@@ -0,0 +1,846 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <core/core.h>
+
+/***********************************************************************************************************/
+
+/* How many programs the checks that make up their own programs try by default, the longest program that they
+ * make, and how many instructions any program gets to run for. A program that is still running after that
+ * isn't compared, since there's no way to tell whether the two versions of it would have ended the same. */
+#define CHECK_PROGRAMS    2000
+#define CHECK_PROGRAM_MAX 256
+#define CHECK_BUDGET      200000
+
+/* The most slices of budget that a program is run for when a check runs it a slice at a time. */
+#define CHECK_SLICES 20
+
+/* How long a program that never ends has to keep running for to pass, in milliseconds. */
+#define CHECK_ENDLESS_WAIT 100
+
+/* A check. The run function checks something about the VM with the number of programs given (for a check
+ * that makes up its own), displays what it finds wrong and returns the number of programs that failed. The
+ * number of programs that it actually compared is stored in compared. */
+typedef struct
+{
+    const char *name;
+    const char *description;
+    int (*run) (int programs, int *compared);
+} Check;
+
+/***********************************************************************************************************/
+
+/* The state of the random number generator. This doesn't use rand(), so that the same seed makes the same
+ * programs everywhere, which is what makes a failure that is found somewhere else possible to look at. */
+static unsigned int check_seed = 1;
+
+/* Get a random number from 0 up to (but not including) the range given. */
+static int check_random (int range)
+{
+    check_seed = check_seed * 1103515245 + 12345;
+    return (int) ((check_seed >> 16) % (unsigned int) range);
+}
+
+/***********************************************************************************************************/
+
+/* Display a program that failed a check, so that it can be looked at. */
+static void show_program (const char *label, const int *program, int length)
+{
+    int i;
+
+    fprintf (stderr, "   %s:", label);
+    for (i = 0 ; i < length ; i++)
+        fprintf (stderr, " %d", program[i]);
+    fprintf (stderr, "\n");
+}
+
+/***********************************************************************************************************/
+
+/* Check if two contexts were left with the same registers and the same stack. */
+static int same_state (const VMContext *first, const VMContext *second)
+{
+    if (memcmp (first->registers, second->registers, sizeof (first->registers)) != 0)
+        return 0;
+
+    return first->sp == second->sp &&
+           (first->sp < 0 || memcmp (first->stack, second->stack, sizeof (int) * (first->sp + 1)) == 0);
+}
+
+/***********************************************************************************************************/
+
+/* Make up a random program that passes verify_program() (most of the time; the ones that don't are of no use
+ * to the checks, which skip them), using every opcode that a program can run without a host. The values are
+ * kept small, so that compares come out both ways and loops end. Returns the length of the program. */
+static int random_program (int *program, int max)
+{
+    static const Opcode immediate[] = { RJNEI, RJEQI, RJLTI };
+    static const Opcode registers[] = { RJNER, RJEQR, RJLTR };
+    int starts[CHECK_PROGRAM_MAX], jumps[CHECK_PROGRAM_MAX];
+    int count = 0, jumpCount = 0, length = 0, i;
+
+    /* The offsets of the jumps are filled in once every instruction is there, so that they can land on any
+     * of them; until then, the operand of each jump holds where its offset is from. */
+    while (length < max - 5)
+    {
+        int at = length;
+
+        starts[count++] = length;
+        switch (check_random (20))
+        {
+            case 0:
+            case 1:
+                program[length++] = PUSH;
+                program[length++] = check_random (9) - 4;
+                break;
+
+            case 2:  program[length++] = POP; break;
+            case 3:  program[length++] = ADD; break;
+            case 4:  program[length++] = NOP; break;
+            case 5:  program[length++] = NOP; break;
+            case 6:  program[length++] = HALT; break;
+
+            case 7:
+                program[length++] = SET;
+                program[length++] = check_random (REGISTER_COUNT);
+                break;
+
+            case 8:
+                program[length++] = check_random (2) ? RDEC : RINC;
+                program[length++] = check_random (REGISTER_COUNT);
+                break;
+
+            case 9:
+                program[length++] = RADD;
+                program[length++] = check_random (REGISTER_COUNT);
+                program[length++] = check_random (REGISTER_COUNT);
+                break;
+
+            case 10:
+                program[length++] = RMOV;
+                program[length++] = check_random (REGISTER_COUNT);
+                program[length++] = check_random (REGISTER_COUNT);
+                break;
+
+            case 11:
+                program[length++] = RMOVI;
+                program[length++] = check_random (REGISTER_COUNT);
+                program[length++] = check_random (9) - 4;
+                break;
+
+            case 12:
+                program[length++] = check_random (2) ? RADDR : RSUBR;
+                program[length++] = check_random (REGISTER_COUNT);
+                program[length++] = check_random (REGISTER_COUNT);
+                program[length++] = check_random (REGISTER_COUNT);
+                break;
+
+            case 13:
+                program[length++] = check_random (2) ? RADDI : RSUBI;
+                program[length++] = check_random (REGISTER_COUNT);
+                program[length++] = check_random (REGISTER_COUNT);
+                program[length++] = check_random (5) - 2;
+                break;
+
+            case 14:
+                program[length++] = RJNE;
+                program[length++] = check_random (REGISTER_COUNT);
+                jumps[jumpCount++] = length;
+                program[length++] = at;
+                break;
+
+            case 15:
+            case 16:
+                program[length++] = immediate[check_random (3)];
+                program[length++] = check_random (REGISTER_COUNT);
+                program[length++] = check_random (9) - 4;
+                jumps[jumpCount++] = length;
+                program[length++] = at;
+                break;
+
+            case 17:
+                program[length++] = registers[check_random (3)];
+                program[length++] = check_random (REGISTER_COUNT);
+                program[length++] = check_random (REGISTER_COUNT);
+                jumps[jumpCount++] = length;
+                program[length++] = at;
+                break;
+
+            case 18:
+                program[length++] = JMP;
+                jumps[jumpCount++] = length;
+                program[length++] = at;
+                break;
+
+            /* Without host functions, this is an error. */
+            default:
+                program[length++] = CALL;
+                program[length++] = 0;
+                break;
+        }
+    }
+
+    if (check_random (4) != 0)
+    {
+        starts[count++] = length;
+        program[length++] = HALT;
+    }
+
+    for (i = 0 ; i < jumpCount ; i++)
+        program[jumps[i]] = starts[check_random (count)] - program[jumps[i]];
+
+    return length;
+}
+
+/***********************************************************************************************************/
+
+/* Run a program and its optimized version from the same registers, and check that they end the same way:
+ * with the same status, registers and stack, and at the same instruction (as the IP map of the optimizer
+ * gives it) if it was an error. Returns 1 if they do, 0 if they don't and -1 if the program wasn't
+ * compared. */
+static int compare_optimized (const int *program, int length, const int *registers)
+{
+    VMContext original, optimized;
+    VMResult before, after;
+    int *code, *map, codeLength, ip, result = -1;
+
+    if (verify_program (program, length, NULL) == 0)
+        return -1;
+
+    code = optimize_program (program, length, CONTEXT_STACK_SIZE, &codeLength, &map);
+    if (code == NULL)
+        return -1;
+
+    ctx_init (&original, (int *) program, length);
+    ctx_init (&optimized, code, codeLength);
+    original.traceLevel = optimized.traceLevel = VM_TRACE_NONE;
+    memcpy (original.registers, registers, sizeof (original.registers));
+    memcpy (optimized.registers, registers, sizeof (optimized.registers));
+
+    /* The optimized program never runs more instructions than the original, so the same budget is enough. */
+    before = vm_run_result (&original, CHECK_BUDGET);
+    if (before.status != VM_STATUS_BUDGET_EXHAUSTED)
+    {
+        after = vm_run_result (&optimized, CHECK_BUDGET);
+        ip = after.ip < codeLength ? map[after.ip] : length;
+        result = before.status == after.status && before.reason == after.reason &&
+                 before.opcode == after.opcode && same_state (&original, &optimized) &&
+                 (before.status != VM_STATUS_ERROR || before.ip == ip);
+
+        if (result == 0)
+        {
+            fprintf (stderr, ">> *** << The optimized program ended differently (status %d/%d, IP %d/%d)\n",
+                     before.status, after.status, before.ip, ip);
+            show_program ("program", program, length);
+            show_program ("optimized", code, codeLength);
+        }
+    }
+
+    ctx_release (&original);
+    ctx_release (&optimized);
+    free (code);
+    free (map);
+
+    return result;
+}
+
+/***********************************************************************************************************/
+
+/* Check that optimized programs end the same way as the programs that they were made from. Besides the
+ * random programs, there are some that have NOPs between a register being written and it being used (or the
+ * program halting), since the NOPs go away before the optimizer works out which registers are used. */
+static int check_optimize (int programs, int *compared)
+{
+    static const int fixed[][12] = {
+        { RINC, REG_A, NOP, HALT },
+        { RMOVI, REG_A, 7, NOP, RADDI, REG_B, REG_A, 1, HALT },
+        { RDEC, REG_F, NOP, ADD, HALT },
+        { RMOVI, REG_A, 3, RDEC, REG_A, NOP, RJNEI, REG_A, 0, -3, NOP, HALT },
+        { RMOVI, REG_C, 2, NOP, NOP, JMP, 2, NOP, HALT },
+    };
+    static const int fixedLengths[] = { 4, 9, 5, 12, 9 };
+    int program[CHECK_PROGRAM_MAX], registers[REGISTER_COUNT];
+    int failed = 0, result, i, r;
+
+    *compared = 0;
+
+    memset (registers, 0, sizeof (registers));
+    for (i = 0 ; i < (int) (sizeof (fixedLengths) / sizeof (int)) ; i++)
+    {
+        result = compare_optimized (fixed[i], fixedLengths[i], registers);
+        if (result != -1)
+            (*compared)++;
+        if (result == 0)
+            failed++;
+    }
+
+    for (i = 0 ; i < programs ; i++)
+    {
+        int length = random_program (program, 8 + check_random (CHECK_PROGRAM_MAX - 8));
+
+        for (r = 0 ; r < REGISTER_COUNT ; r++)
+            registers[r] = check_random (7) - 3;
+
+        result = compare_optimized (program, length, registers);
+        if (result != -1)
+            (*compared)++;
+        if (result == 0)
+            failed++;
+    }
+
+    return failed;
+}
+
+/***********************************************************************************************************/
+
+/* Get a random register value for a counted loop, which is either small or right at one of the edges where
+ * the counter of a loop wraps around. */
+static int loop_value (void)
+{
+    static const int edges[] = { INT_MAX, INT_MAX - 1, INT_MAX - 7, INT_MIN, INT_MIN + 1, INT_MIN + 7, 65536,
+                                 -65536, 1000, -1000 };
+
+    if (check_random (3) != 0)
+        return check_random (9) - 4;
+
+    return edges[check_random ((int) (sizeof (edges) / sizeof (int)))];
+}
+
+/***********************************************************************************************************/
+
+/* Make up a random program that is a loop that analyze_loops() might run in closed form: it sets every
+ * register, pushes a value for RJNE, and then has a short body of register updates before the compare and
+ * branch that closes the loop. Returns the length of the program. */
+static int random_loop (int *program)
+{
+    static const Opcode jumps[] = { RJNE, RJNEI, RJEQI, RJLTI, RJNER, RJEQR, RJLTR };
+    int length = 0, top, body, at, r, i;
+    Opcode jump;
+
+    for (r = 0 ; r < REGISTER_COUNT ; r++)
+    {
+        program[length++] = RMOVI;
+        program[length++] = r;
+        program[length++] = loop_value ();
+    }
+
+    program[length++] = PUSH;
+    program[length++] = loop_value ();
+
+    top = length;
+    body = 1 + check_random (4);
+    for (i = 0 ; i < body ; i++)
+    {
+        int target = check_random (REGISTER_COUNT), source = check_random (REGISTER_COUNT);
+
+        switch (check_random (9))
+        {
+            case 0:
+            case 1:
+                program[length++] = check_random (2) ? RDEC : RINC;
+                program[length++] = target;
+                break;
+
+            case 2:
+            case 3:
+                program[length++] = check_random (2) ? RADDI : RSUBI;
+                program[length++] = target;
+                program[length++] = target;
+                program[length++] = loop_value ();
+                break;
+
+            case 4:
+            case 5:
+                program[length++] = check_random (2) ? RADDR : RSUBR;
+                program[length++] = target;
+                program[length++] = target;
+                program[length++] = source;
+                break;
+
+            case 6:
+                program[length++] = RMOVI;
+                program[length++] = target;
+                program[length++] = loop_value ();
+                break;
+
+            case 7:
+                program[length++] = RMOV;
+                program[length++] = target;
+                program[length++] = source;
+                break;
+
+            default:
+                program[length++] = NOP;
+                break;
+        }
+    }
+
+    at = length;
+    jump = jumps[check_random ((int) (sizeof (jumps) / sizeof (Opcode)))];
+    program[length++] = jump;
+    program[length++] = check_random (REGISTER_COUNT);
+    if (jump == RJNEI || jump == RJEQI || jump == RJLTI)
+        program[length++] = loop_value ();
+    else if (jump != RJNE)
+        program[length++] = check_random (REGISTER_COUNT);
+    program[length++] = top - at;
+
+    program[length++] = POP;
+    program[length++] = HALT;
+
+    return length;
+}
+
+/***********************************************************************************************************/
+
+/* Check if a context has a loop that is run in closed form. */
+static int has_closed_loop (const VMContext *context)
+{
+    int i;
+
+    for (i = 0 ; context->decoded != NULL && i < context->decoded->codeEnd ; i++)
+    {
+        if (context->decoded->code[i].operation == OP_LOOP)
+            return 1;
+    }
+
+    return 0;
+}
+
+/***********************************************************************************************************/
+
+/* Run a program a slice of budget at a time, once as it is and once profiled, which has the engines run its
+ * loops one trip at a time instead of in closed form, and check that every slice ends the same way: with
+ * the same status, at the same IP, with the same registers and stack. Returns 1 if they do, 0 if they don't
+ * and -1 if the program has no loop that is run in closed form, which is a failure if it has to have one. */
+static int compare_loops (const int *program, int length, VMEngine engine, long long slice, int mustClose)
+{
+    VMContext closed, stepped;
+    int result = 1, slices;
+
+    ctx_init (&closed, (int *) program, length);
+    ctx_init (&stepped, (int *) program, length);
+    closed.engine = stepped.engine = engine;
+    closed.traceLevel = stepped.traceLevel = VM_TRACE_NONE;
+    ctx_profile (&stepped, 1);
+
+    for (slices = 0 ; slices < CHECK_SLICES ; slices++)
+    {
+        VMResult first = vm_run_result (&closed, slice), second = vm_run_result (&stepped, slice);
+
+        if (first.status != second.status || first.ip != second.ip || same_state (&closed, &stepped) == 0)
+        {
+            fprintf (stderr, ">> *** << A closed form loop ended slice %d of %lld differently (status %d/%d, "
+                     "IP %d/%d)\n", slices + 1, slice, first.status, second.status, first.ip, second.ip);
+            show_program ("program", program, length);
+            result = 0;
+            break;
+        }
+
+        if (first.status != VM_STATUS_BUDGET_EXHAUSTED)
+            break;
+    }
+
+    if (result == 1 && has_closed_loop (&closed) == 0)
+    {
+        if (mustClose)
+        {
+            fprintf (stderr, ">> *** << A loop was not run in closed form\n");
+            show_program ("program", program, length);
+            result = 0;
+        }
+        else
+            result = -1;
+    }
+
+    ctx_release (&closed);
+    ctx_release (&stepped);
+
+    return result;
+}
+
+/***********************************************************************************************************/
+
+/* Check that loops that are run in closed form leave everything the way that running them one trip at a time
+ * does, including when the budget runs out partway through one. Besides the random loops, there are some with
+ * counters that wrap around before they get to their bound, that wrap around and carry on (including by
+ * stepping past it, thousands of times over, and landing on it after that) and some that never get
+ * there. */
+static int check_loops (int programs, int *compared)
+{
+    static const int fixed[][20] = {
+        { RMOVI, REG_A, INT_MAX - 2, RINC, REG_A, RJNEI, REG_A, INT_MIN + 2, -2, HALT },
+        { RMOVI, REG_A, INT_MIN + 5, RDEC, REG_A, RJLTI, REG_A, 0, -2, HALT },
+        { RMOVI, REG_A, INT_MAX - 10, RMOVI, REG_B, INT_MIN + 3, RMOVI, REG_C, 7,
+          RADDR, REG_A, REG_A, REG_C, RJNER, REG_A, REG_B, -4, HALT },
+        { RMOVI, REG_A, INT_MIN + 4, RSUBI, REG_A, REG_A, 3, RJLTI, REG_A, INT_MAX, -4, HALT },
+        { RMOVI, REG_A, INT_MIN, RMOVI, REG_B, INT_MAX - 4,
+          RADDI, REG_B, REG_B, 3, RJLTR, REG_A, REG_B, -4, HALT },
+        { RMOVI, REG_A, INT_MAX - 7, RADDI, REG_A, REG_A, 5, RJLTI, REG_A, INT_MAX, -4, HALT },
+        { RMOVI, REG_A, INT_MIN + 1, RMOVI, REG_B, INT_MIN + 8,
+          RSUBI, REG_B, REG_B, 5, RJLTR, REG_A, REG_B, -4, HALT },
+        { RMOVI, REG_A, 1, RADDI, REG_A, REG_A, 2, RJNEI, REG_A, 0, -4, HALT },
+        { RMOVI, REG_B, 100, RMOVI, REG_A, 3, RDEC, REG_B, RJLTR, REG_A, REG_B, -2, HALT },
+        { PUSH, 0, RMOVI, REG_A, 50, RSUBI, REG_A, REG_A, 5, RJNE, REG_A, -4, POP, HALT },
+        { RMOVI, REG_A, 1000, RMOVI, REG_C, 0, RADDI, REG_C, REG_C, 3, RMOVI, REG_D, 9,
+          RDEC, REG_A, RJNEI, REG_A, 0, -9, HALT },
+        { RMOVI, REG_A, 0, RADDI, REG_A, REG_A, 1000000007, RJLTI, REG_A, INT_MAX - 90000, -4, HALT },
+        { RMOVI, REG_B, INT_MIN + 90000, RMOVI, REG_A, 0,
+          RSUBI, REG_A, REG_A, 999999937, RJLTR, REG_B, REG_A, -4, HALT },
+        { RMOVI, REG_A, 0, RADDI, REG_A, REG_A, 1000000007, RJLTI, REG_A, 2147426958, -4, HALT },
+        { RMOVI, REG_B, -2147414299, RMOVI, REG_A, 0,
+          RSUBI, REG_A, REG_A, 999999937, RJLTR, REG_B, REG_A, -4, HALT },
+        { RMOVI, REG_A, 0, RADDI, REG_A, REG_A, 2, RJLTI, REG_A, INT_MAX, -4, HALT },
+        { RMOVI, REG_B, INT_MIN, RMOVI, REG_A, 1, RSUBI, REG_A, REG_A, 2, RJLTR, REG_B, REG_A, -4, HALT },
+    };
+    static const int fixedLengths[] = { 10, 10, 18, 12, 15, 12, 15, 12, 13, 14, 20, 12, 15, 12, 15, 12, 15 };
+    static const long long slices[] = { 1, 2, 3, 7, 100, CHECK_BUDGET };
+    static const VMEngine engines[] = { VM_ENGINE_SWITCH, VM_ENGINE_THREADED };
+    int program[CHECK_PROGRAM_MAX];
+    int failed = 0, result, i, s, e;
+
+    *compared = 0;
+
+    /* Each of these is run with every budget and engine, but only counts as one program. */
+    for (i = 0 ; i < (int) (sizeof (fixedLengths) / sizeof (int)) ; i++)
+    {
+        result = 1;
+        for (s = 0 ; s < (int) (sizeof (slices) / sizeof (long long)) && result == 1 ; s++)
+        {
+            for (e = 0 ; e < (int) (sizeof (engines) / sizeof (VMEngine)) && result == 1 ; e++)
+                result = compare_loops (fixed[i], fixedLengths[i], engines[e], slices[s], 1);
+        }
+
+        (*compared)++;
+        if (result == 0)
+            failed++;
+    }
+
+    for (i = 0 ; i < programs ; i++)
+    {
+        int length = random_loop (program);
+        long long slice = 1 + check_random (check_random (2) ? 50 : 5000);
+
+        result = compare_loops (program, length, engines[check_random (2)], slice, 0);
+        if (result != -1)
+            (*compared)++;
+        if (result == 0)
+            failed++;
+    }
+
+    return failed;
+}
+
+/***********************************************************************************************************/
+
+/* Run a program until it halts in a child process, with the engine given or straight out of the compact
+ * encoding, and check that it's still running after a while, which is as close as a check can get to seeing
+ * that it never ends. An engine that runs loops in closed form has to first use up the biggest budget that
+ * isn't unlimited within ten times that while. Returns 1 if the program passes and 0 if it doesn't. */
+static int run_endless (const int *program, int length, VMEngine engine, int compact)
+{
+    struct pollfd used;
+    int ready[2], status, running;
+    char byte = 0;
+    pid_t pid;
+
+    if (pipe (ready) == -1)
+        return 0;
+
+    pid = fork ();
+    if (pid == -1)
+    {
+        close (ready[0]);
+        close (ready[1]);
+        return 0;
+    }
+
+    if (pid == 0)
+    {
+        VMContext context;
+        unsigned char *code;
+        int size;
+
+        if (compact)
+        {
+            code = compact_encode (program, length, &size);
+            if (code == NULL)
+                _exit (1);
+
+            ctx_init_compact (&context, code, size);
+        }
+        else
+            ctx_init (&context, (int *) program, length);
+
+        context.engine = engine;
+        context.traceLevel = VM_TRACE_NONE;
+
+        if (compact == 0 && engine != VM_ENGINE_JIT &&
+            vm_run_for (&context, VM_BUDGET_UNLIMITED - 1) != VM_STATUS_BUDGET_EXHAUSTED)
+            _exit (1);
+
+        if (write (ready[1], &byte, 1) != 1)
+            _exit (1);
+
+        vm_interpret (&context);
+        _exit (0);
+    }
+
+    close (ready[1]);
+    used.fd = ready[0];
+    used.events = POLLIN;
+    running = poll (&used, 1, CHECK_ENDLESS_WAIT * 10) == 1 && read (ready[0], &byte, 1) == 1;
+    close (ready[0]);
+
+    if (running)
+    {
+        usleep (CHECK_ENDLESS_WAIT * 1000);
+        running = waitpid (pid, &status, WNOHANG) == 0;
+    }
+
+    if (waitpid (pid, &status, WNOHANG) == 0)
+    {
+        kill (pid, SIGKILL);
+        waitpid (pid, &status, 0);
+    }
+
+    return running;
+}
+
+/***********************************************************************************************************/
+
+/* Check that counted loops that never end keep running when the budget is unlimited, with every engine, and
+ * out of the compact encoding, which runs them one trip at a time. The engines that run loops in closed form
+ * use up any budget in one go on these, including ones with counters that wrap around past their bound
+ * forever. */
+static int check_endless (int programs, int *compared)
+{
+    static const int fixed[][15] = {
+        { RMOVI, REG_A, 1, PUSH, 0, RADDI, REG_A, REG_A, 2, RJNE, REG_A, -4, HALT },
+        { RMOVI, REG_A, 1, RADDI, REG_A, REG_A, 2, RJNEI, REG_A, 0, -4, HALT },
+        { RMOVI, REG_A, 5, RADDI, REG_A, REG_A, 0, RJLTI, REG_A, 9, -4, HALT },
+        { RMOVI, REG_A, 0, RADDI, REG_A, REG_A, 2, RJLTI, REG_A, INT_MAX, -4, HALT },
+        { RMOVI, REG_B, INT_MIN, RMOVI, REG_A, 1, RSUBI, REG_A, REG_A, 2, RJLTR, REG_B, REG_A, -4, HALT },
+    };
+    static const int fixedLengths[] = { 13, 12, 12, 12, 15 };
+    static const VMEngine engines[] = { VM_ENGINE_SWITCH, VM_ENGINE_THREADED, VM_ENGINE_JIT };
+    static const char *const names[] = { "switch", "threaded", "JIT", "compact" };
+    int failed = 0, i, e;
+
+    *compared = 0;
+
+    /* Each of these is run with every engine and compact, but only counts as one program. */
+    for (i = 0 ; i < (int) (sizeof (fixedLengths) / sizeof (int)) ; i++)
+    {
+        for (e = 0 ; e < 4 ; e++)
+        {
+            if (run_endless (fixed[i], fixedLengths[i], engines[e % 3], e == 3) == 0)
+            {
+                fprintf (stderr, ">> *** << A loop that never ends stopped, or was slow to use up a budget "
+                         "(%s)\n", names[e]);
+                show_program ("program", fixed[i], fixedLengths[i]);
+                failed++;
+                break;
+            }
+        }
+
+        (*compared)++;
+    }
+
+    return failed;
+}
+
+/***********************************************************************************************************/
+
+/* Run a program for a slice of budget, fork a context from a snapshot of it, which has to share its decoded
+ * program, and check that the fork carries on to end the same way that the original does: with the same
+ * status, at the same IP, with the same registers and stack. The fork runs first, with the engine given, and
+ * is profiled if asked to be; either can have it thread or analyze the program differently, which it has to
+ * take a copy of its own to do, leaving the one that the original has as it was. Returns 1 if they end the
+ * same way, 0 if they don't and -1 if the program ended in the first slice. */
+static int compare_fork (const int *program, int length, long long slice, VMEngine engine, int profile)
+{
+    VMContext original, fork;
+    VMSnapshot *snapshot;
+    VMResult first, second;
+    Instruction *code = NULL;
+    size_t size;
+    int result = -1;
+
+    ctx_init (&original, (int *) program, length);
+    original.traceLevel = VM_TRACE_NONE;
+
+    if (vm_run_result (&original, slice).status != VM_STATUS_BUDGET_EXHAUSTED)
+    {
+        ctx_release (&original);
+        return -1;
+    }
+
+    snapshot = ctx_snapshot (&original);
+    if (snapshot == NULL || ctx_fork (&fork, snapshot) == NULL || fork.decoded != original.decoded)
+    {
+        fprintf (stderr, ">> *** << A fork didn't share the decoded program of the original\n");
+        show_program ("program", program, length);
+        result = 0;
+    }
+    else
+    {
+        fork.engine = engine;
+        if (profile)
+            ctx_profile (&fork, 1);
+
+        size = sizeof (Instruction) * original.decoded->codeSize;
+        code = malloc (size);
+        if (code != NULL)
+            memcpy (code, original.decoded->code, size);
+
+        second = vm_run_result (&fork, CHECK_BUDGET);
+        if (code != NULL && memcmp (code, original.decoded->code, size) != 0)
+        {
+            fprintf (stderr, ">> *** << A fork changed the decoded program that it shared\n");
+            show_program ("program", program, length);
+            result = 0;
+        }
+
+        first = vm_run_result (&original, CHECK_BUDGET);
+        if (result == -1)
+        {
+            result = first.status == second.status && first.ip == second.ip && same_state (&original, &fork);
+            if (result == 0)
+            {
+                fprintf (stderr, ">> *** << A fork ended differently (status %d/%d, IP %d/%d)\n",
+                         first.status, second.status, first.ip, second.ip);
+                show_program ("program", program, length);
+            }
+        }
+    }
+
+    if (snapshot != NULL)
+    {
+        ctx_release (&fork);
+        snapshot_release (snapshot);
+    }
+
+    ctx_release (&original);
+    free (code);
+
+    return result;
+}
+
+/***********************************************************************************************************/
+
+/* Check that contexts forked from a snapshot share the decoded program of the context that it was taken of,
+ * and carry on from there the same way that it does. */
+static int check_forks (int programs, int *compared)
+{
+    static const VMEngine engines[] = { VM_ENGINE_SWITCH, VM_ENGINE_THREADED, VM_ENGINE_JIT };
+    int program[CHECK_PROGRAM_MAX];
+    int failed = 0, result, i;
+
+    *compared = 0;
+
+    for (i = 0 ; i < programs ; i++)
+    {
+        int length = random_program (program, 8 + check_random (CHECK_PROGRAM_MAX - 8));
+        long long slice = 1 + check_random (50);
+        VMEngine engine = engines[check_random (3)];
+
+        result = compare_fork (program, length, slice, engine, check_random (4) == 0);
+        if (result != -1)
+            (*compared)++;
+        if (result == 0)
+            failed++;
+    }
+
+    return failed;
+}
+
+/***********************************************************************************************************/
+
+/* All of the checks. */
+static const Check checks[] = {
+    { "optimize", "Optimized programs end the same way as the originals",      check_optimize },
+    { "loops",    "Closed form loops end the same way as running every trip", check_loops },
+    { "endless",  "Loops that never end keep running with no budget limit",   check_endless },
+    { "forks",    "Forks share the decoded program and end like the original", check_forks },
+};
+
+#define CHECK_COUNT ((int) (sizeof (checks) / sizeof (Check)))
+
+/***********************************************************************************************************/
+
+/* Display how to use the program, and return the exit code for having been used wrong. */
+static int usage (const char *name)
+{
+    int i;
+
+    fprintf (stderr, "Usage: %s [-c check] [-n programs] [-s seed]\n", name);
+    fprintf (stderr, "       %s -l\n\n", name);
+    fprintf (stderr, "  -c      Only run the check given\n");
+    fprintf (stderr, "  -n      Try this many random programs in each check (default %d)\n", CHECK_PROGRAMS);
+    fprintf (stderr, "  -s      Seed the random programs with this (default 1)\n");
+    fprintf (stderr, "  -l      List the checks, and exit\n\n");
+    fprintf (stderr, "The exit code is 0 if every check passes, and 1 otherwise.\n\n");
+
+    fprintf (stderr, "Checks:\n");
+    for (i = 0 ; i < CHECK_COUNT ; i++)
+        fprintf (stderr, "  %-10s %s\n", checks[i].name, checks[i].description);
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Entry point. */
+int main (int argc, char **argv)
+{
+    const char *onlyCheck = NULL;
+    int programs = CHECK_PROGRAMS, failed = 0, option, i;
+
+    fprintf (stderr, "SimpleVM checks - %s (%s)\n\n", VERSION, REVISION);
+
+    while ((option = getopt (argc, argv, "c:n:s:l")) != -1)
+    {
+        switch (option)
+        {
+            case 'c': onlyCheck = optarg; break;
+            case 'n': programs = atoi (optarg); break;
+            case 's': check_seed = (unsigned int) strtoul (optarg, NULL, 0); break;
+
+            case 'l':
+                for (i = 0 ; i < CHECK_COUNT ; i++)
+                    printf ("%s\n", checks[i].name);
+                return 0;
+
+            default:
+                return usage (argv[0]);
+        }
+    }
+
+    if (optind != argc || programs < 0)
+        return usage (argv[0]);
+
+    for (i = 0 ; i < CHECK_COUNT ; i++)
+    {
+        int compared, failures;
+
+        if (onlyCheck != NULL && strcmp (onlyCheck, checks[i].name) != 0)
+            continue;
+
+        fprintf (stderr, "%s...\n", checks[i].name);
+        failures = checks[i].run (programs, &compared);
+        if (failures != 0)
+        {
+            fprintf (stderr, ">> *** << %s: %d of %d programs failed\n", checks[i].name, failures, compared);
+            failed = 1;
+        }
+        else
+            fprintf (stderr, "%s: %d programs passed\n", checks[i].name, compared);
+    }
+
+    return failed;
+}
+
+/***********************************************************************************************************/
@@ -0,0 +1,400 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "analyze.h"
+#include "decode.h"
+
+/***********************************************************************************************************/
+
+/* The number of times that the range of depths for an instruction can grow during a single analysis before
+ * it is assumed to keep growing, and is widened out to the edge of the stack. This is what keeps a loop that
+ * grows (or shrinks) the stack on every trip around it from taking forever to analyze. */
+#define WIDEN_AFTER 3
+
+/* The most instructions that the body of a loop can have for analyze_loops() to recognize it. No register
+ * can be written more than once in the body, so anything longer than this would be mostly NOPs. */
+#define LOOP_BODY_MAX 16
+
+/* Registers are kept track of in sets, with one bit for each. */
+#define REGISTER_BIT(reg) (1 << (reg))
+
+/***********************************************************************************************************/
+
+/* Convert an operation into the version of it that does not check the stack. Operations that don't have a
+ * separate unchecked version are returned as is. */
+static Operation unchecked_operation (Operation operation)
+{
+    switch (operation)
+    {
+        case OP_PUSH: return OP_PUSH_UNCHECKED;
+        case OP_POP:  return OP_POP_UNCHECKED;
+        case OP_SET:  return OP_SET_UNCHECKED;
+        case OP_ADD:  return OP_ADD_UNCHECKED;
+        case OP_RADD: return OP_RADD_UNCHECKED;
+        case OP_RJNE: return OP_RJNE_UNCHECKED;
+        default:      return operation;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Describe how the (checked) operation provided uses the stack: the smallest and largest depth that it can
+ * execute with without a stack error, and how much it changes the depth by when it does.
+ *
+ * The return value is 0 for operations that never continue on to another instruction, in which case the
+ * rest of the values are not set. */
+static int stack_effect (Operation operation, int stackSize, int *low, int *high, int *delta)
+{
+    switch (operation)
+    {
+        /* These need room for one more item, and add it. */
+        case OP_PUSH:
+        case OP_RADD:
+            *low = 0;
+            *high = stackSize - 1;
+            *delta = 1;
+            return 1;
+
+        /* These need an item to take away, and take it. */
+        case OP_POP:
+        case OP_SET:
+            *low = 1;
+            *high = stackSize;
+            *delta = -1;
+            return 1;
+
+        /* This needs two items, and replaces them with one. */
+        case OP_ADD:
+            *low = 2;
+            *high = stackSize;
+            *delta = -1;
+            return 1;
+
+        /* This needs an item to look at, but leaves it there. */
+        case OP_RJNE:
+            *low = 1;
+            *high = stackSize;
+            *delta = 0;
+            return 1;
+
+        /* These stop the program. */
+        case OP_HALT:
+        case OP_IHALT:
+            return 0;
+
+        /* Everything else leaves the stack alone. */
+        default:
+            *low = 0;
+            *high = stackSize;
+            *delta = 0;
+            return 1;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* The state of an analysis in progress. */
+typedef struct
+{
+    /* The program being analyzed, and the size of the stack it runs with. */
+    Instruction *code;
+    int stackSize;
+
+    /* The instructions whose range of depths has changed since they were last looked at, and a flag for each
+     * instruction that says if it's in that list. */
+    int *pending;
+    int count;
+    char *queued;
+
+    /* How many times the range for each instruction has grown. */
+    int *grown;
+} Analysis;
+
+/***********************************************************************************************************/
+
+/* Add the range of depths provided to the instruction at the index given, and queue it up to be looked at
+ * again if that changed anything. */
+static void join_depths (Analysis *analysis, int index, int lo, int hi)
+{
+    Instruction *instruction = &analysis->code[index];
+
+    /* Merge with the range that is already there, if any. */
+    if (instruction->depthMin <= instruction->depthMax)
+    {
+        if (lo > instruction->depthMin)
+            lo = instruction->depthMin;
+        if (hi < instruction->depthMax)
+            hi = instruction->depthMax;
+
+        if (lo == instruction->depthMin && hi == instruction->depthMax)
+            return;
+
+        /* This keeps growing, so assume that it goes all the way in whatever direction it's moving in. */
+        if (++analysis->grown[index] > WIDEN_AFTER)
+        {
+            if (lo < instruction->depthMin)
+                lo = 0;
+            if (hi > instruction->depthMax)
+                hi = analysis->stackSize;
+        }
+    }
+
+    instruction->depthMin = lo;
+    instruction->depthMax = hi;
+
+    if (analysis->queued[index] == 0)
+    {
+        analysis->queued[index] = 1;
+        analysis->pending[analysis->count++] = index;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Work out the range of stack depths that every instruction in a decoded program can execute with, and use
+ * it to decide which instructions can skip their stack checks. */
+int analyze_stack (Instruction *code, int codeSize, int entry, int depth, int stackSize)
+{
+    Analysis analysis;
+    int safe = 0, i;
+
+    analysis.code = code;
+    analysis.stackSize = stackSize;
+    analysis.count = 0;
+    analysis.pending = malloc (sizeof (int) * codeSize);
+    analysis.queued = calloc (codeSize, sizeof (char));
+    analysis.grown = calloc (codeSize, sizeof (int));
+
+    /* Without the memory to do the analysis, nothing can be proven safe. */
+    if (analysis.pending == NULL || analysis.queued == NULL || analysis.grown == NULL)
+    {
+        free (analysis.pending);
+        free (analysis.queued);
+        free (analysis.grown);
+
+        for (i = 0 ; i < codeSize ; i++)
+            code[i].operation = decode_operation (code[i].opcode);
+
+        return 0;
+    }
+
+    join_depths (&analysis, entry, depth, depth);
+
+    while (analysis.count > 0)
+    {
+        Instruction *instruction;
+        int low, high, delta, lo, hi;
+
+        i = analysis.pending[--analysis.count];
+        analysis.queued[i] = 0;
+        instruction = &code[i];
+
+        if (stack_effect (decode_operation (instruction->opcode), stackSize, &low, &high, &delta) == 0)
+            continue;
+
+        /* Only the depths that don't cause a stack error carry on to the next instruction. If there aren't
+         * any, this instruction always stops the program. */
+        lo = (instruction->depthMin > low) ? instruction->depthMin : low;
+        hi = (instruction->depthMax < high) ? instruction->depthMax : high;
+        if (lo > hi)
+            continue;
+
+        /* A host function that a CALL calls can leave anything on the stack (and can't make it overflow or
+         * underflow, since it only goes through ctx_stack_push() and its friends). */
+        if (instruction->opcode == CALL)
+        {
+            lo = 0;
+            hi = stackSize;
+        }
+
+        /* Jumps can go to their target as well as the next instruction, except for JMP, which only ever goes
+         * to its target. The IHALT at the end of the program has no next instruction, but it also never
+         * continues. */
+        if (instruction->target != -1)
+            join_depths (&analysis, instruction->target, lo + delta, hi + delta);
+
+        if (i + 1 < codeSize && instruction->opcode != JMP)
+            join_depths (&analysis, i + 1, lo + delta, hi + delta);
+    }
+
+    /* Now every instruction whose whole range is one it can run with doesn't need to check the stack. Every
+     * other instruction goes back to the operation for its opcode, which also undoes any superinstructions
+     * that decode_fuse() made, since they depend on the old results. */
+    for (i = 0 ; i < codeSize ; i++)
+    {
+        Operation operation = decode_operation (code[i].opcode);
+        int low, high, delta;
+
+        code[i].operation = operation;
+        if (unchecked_operation (operation) == operation || code[i].depthMin > code[i].depthMax)
+            continue;
+
+        if (stack_effect (operation, stackSize, &low, &high, &delta) &&
+            code[i].depthMin >= low && code[i].depthMax <= high)
+        {
+            code[i].operation = unchecked_operation (operation);
+            safe++;
+        }
+    }
+
+    free (analysis.pending);
+    free (analysis.queued);
+    free (analysis.grown);
+
+    return safe;
+}
+
+/***********************************************************************************************************/
+
+/* Work out what the instruction provided does if it's in the body of a counted loop: the register it writes
+ * (or -1 if it doesn't), the set of registers that it reads to do that other than the one it writes, and
+ * whether it adds to the register (1) or gives it a value (0). Returns 0 if it can't be in the body of a
+ * counted loop at all. */
+static int loop_update (const Instruction *instruction, int *written, int *read, int *adds)
+{
+    const int *p = instruction->parameters;
+
+    *written = -1;
+    *read = 0;
+    *adds = 1;
+
+    switch (instruction->opcode)
+    {
+        case NOP:
+            return 1;
+
+        case RDEC:
+        case RINC:
+            *written = p[0];
+            return 1;
+
+        case RADDI:
+        case RSUBI:
+            *written = p[0];
+            return p[1] == p[0];
+
+        /* The register has to be added to (or subtracted from) in place, by some other register. */
+        case RADDR:
+        case RSUBR:
+            *written = p[0];
+            if (p[1] == p[0] && p[2] != p[0])
+            {
+                *read = REGISTER_BIT (p[2]);
+                return 1;
+            }
+
+            if (instruction->opcode == RADDR && p[2] == p[0] && p[1] != p[0])
+            {
+                *read = REGISTER_BIT (p[1]);
+                return 1;
+            }
+
+            return 0;
+
+        case RMOVI:
+            *written = p[0];
+            *adds = 0;
+            return 1;
+
+        case RMOV:
+            *written = p[0];
+            *read = REGISTER_BIT (p[1]);
+            *adds = 0;
+            return p[1] != p[0];
+
+        default:
+            return 0;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Check if the jump at the index given closes a counted loop (see analyze_loops()). */
+static int counted_loop (const Instruction *code, int index)
+{
+    const Instruction *jump = &code[index];
+    const int *p = jump->parameters;
+    int written = 0, adding = 0, read = 0, counter, i;
+
+    if (jump->target == -1 || jump->target >= index || index - jump->target > LOOP_BODY_MAX)
+        return 0;
+
+    for (i = jump->target ; i < index ; i++)
+    {
+        int reg, reads, adds;
+
+        if (loop_update (&code[i], &reg, &reads, &adds) == 0)
+            return 0;
+
+        if (reg == -1)
+            continue;
+
+        if ((written & REGISTER_BIT (reg)) != 0)
+            return 0;
+
+        written |= REGISTER_BIT (reg);
+        read |= reads;
+        if (adds)
+            adding |= REGISTER_BIT (reg);
+    }
+
+    /* Everything that the body reads has to be the same on every trip. */
+    if ((read & written) != 0)
+        return 0;
+
+    switch (jump->opcode)
+    {
+        /* Nothing in the body touches the stack, so the top of it doesn't change, but it has to be there. */
+        case RJNE:
+            if (jump->operation != OP_RJNE_UNCHECKED)
+                return 0;
+
+            counter = p[0];
+            break;
+
+        case RJNEI:
+        case RJEQI:
+        case RJLTI:
+            counter = p[0];
+            break;
+
+        /* One of the registers has to be the counter, and the other one can't change. */
+        case RJNER:
+        case RJEQR:
+        case RJLTR:
+            if ((written & REGISTER_BIT (p[0])) != 0 && (written & REGISTER_BIT (p[1])) == 0)
+                counter = p[0];
+            else if ((written & REGISTER_BIT (p[1])) != 0 && (written & REGISTER_BIT (p[0])) == 0)
+                counter = p[1];
+            else
+                return 0;
+            break;
+
+        default:
+            return 0;
+    }
+
+    return (adding & REGISTER_BIT (counter)) != 0;
+}
+
+/***********************************************************************************************************/
+
+/* Look for counted loops in a decoded program and switch the jump that closes each one to OP_LOOP. */
+int analyze_loops (Instruction *code, int codeEnd)
+{
+    int loops = 0, i;
+
+    for (i = 0 ; i < codeEnd ; i++)
+    {
+        if (counted_loop (code, i))
+        {
+            code[i].operation = OP_LOOP;
+            loops++;
+        }
+    }
+
+    return loops;
+}
+
+/***********************************************************************************************************/
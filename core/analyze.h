@@ -0,0 +1,53 @@
+#ifndef __ANALYZEdotH__
+#define __ANALYZEdotH__
+
+/***********************************************************************************************************/
+
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* Work out the range of stack depths (the number of items on the stack) that every instruction in a decoded
+ * program can execute with, when the program starts running at the instruction with index entry with depth
+ * items on its stack, for a stack that can hold stackSize items.
+ *
+ * This follows every path through the program without running it, so a loop that keeps growing the stack
+ * ends up with a range that covers the entire stack. Any instruction that uses the stack whose range shows
+ * that it can never overflow or underflow the stack has its operation switched to the unchecked version,
+ * and any that can't be proven safe is switched back to the checked version. Any superinstructions and
+ * closed form loops in the program are split back up, so analyze_loops() and decode_fuse() need to be run
+ * again afterwards.
+ *
+ * The ranges from any earlier analysis of the same program are kept and added to, so the results of calling
+ * this again with a different entry point are valid for both of them. The result is valid for any later
+ * state of a program started at any of the entry points analyzed, which is what allows a program to stop
+ * and resume without needing to be analyzed again.
+ *
+ * The return value is the number of instructions that can now skip their stack checks. */
+int analyze_stack (Instruction *code, int codeSize, int entry, int depth, int stackSize);
+
+/* Look for counted loops in a decoded program and switch the jump that closes each one to OP_LOOP, which
+ * runs whatever is left of the loop in a constant number of steps instead of once for every trip around it.
+ * A counted loop is a backward compare and branch (RJNE, or one of the register forms) and the straight run
+ * of instructions from its target up to it, where:
+ *
+ *     - the body only uses RDEC, RINC, RMOV, RMOVI, the register forms of arithmetic that add to or subtract
+ *       from a register in place (such as RADDI a, a, 1 or RADDR a, a, b), and NOP
+ *     - no register is written more than once in the body, and no register that is written is read by any
+ *       other instruction in it, so every register that changes goes up by the same amount on every trip or
+ *       gets the same value on every trip
+ *     - the jump compares a register that goes up by the same amount on every trip (the counter) with
+ *       something that doesn't change: a value, a register that isn't written or the top of the stack
+ *
+ * Then the number of trips until the comparison fails can be worked out from the counter, how much it
+ * changes by and what it's compared with, and so can the registers after that many trips, with the same
+ * wraparound as running it. A loop that never ends is run until the budget runs out. An RJNE is only used
+ * if analyze_stack() has already shown that it never needs to check the stack, so this should be run after
+ * that, and before decode_fuse(), which would otherwise fuse the last instruction of the body with the jump.
+ *
+ * The return value is the number of loops found. */
+int analyze_loops (Instruction *code, int codeEnd);
+
+/***********************************************************************************************************/
+
+#endif
@@ -0,0 +1,377 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include "aot.h"
+#include "decode.h"
+
+/***********************************************************************************************************/
+
+/* The start of every generated program: its own copy of the interface in aot.h, and the macros that the code
+ * for the instructions uses. The arithmetic is done unsigned, so that it wraps around the way the interpreter
+ * does without the C compiler being allowed to assume that it doesn't. */
+static const char aot_prologue[] =
+    "typedef struct AotFrame\n"
+    "{\n"
+    "    void *context;\n"
+    "    int *registers;\n"
+    "    int *stack;\n"
+    "    int sp;\n"
+    "    int stackSize;\n"
+    "    long long budget;\n"
+    "    int traceOps;\n"
+    "    void (*outputPop) (void *context, int value);\n"
+    "    void (*outputSet) (void *context, int reg, int value);\n"
+    "} AotFrame;\n"
+    "\n"
+    "typedef struct AotProgram\n"
+    "{\n"
+    "    int version;\n"
+    "    int frameSize;\n"
+    "    int registerCount;\n"
+    "    const int *program;\n"
+    "    int programLength;\n"
+    "    int (*run) (AotFrame *frame, int pc);\n"
+    "} AotProgram;\n"
+    "\n"
+    "#define ADD(a, b) ((int) ((unsigned int) (a) + (unsigned int) (b)))\n"
+    "#define SUB(a, b) ((int) ((unsigned int) (a) - (unsigned int) (b)))\n"
+    "\n"
+    "/* Stop at the instruction given, leaving it to the interpreter. */\n"
+    "#define STOP(index) do { pc = (index); goto stop; } while (0)\n"
+    "\n"
+    "/* Jump back to the instruction given, charging the budget for the loop that closes. */\n"
+    "#define LOOP(index, size) do { if ((budget -= (size)) <= 0) STOP (index); goto i##index; } while (0)\n"
+    "\n";
+
+/***********************************************************************************************************/
+
+/* Display the value that a POP removed from the stack, for compiled code. */
+static void aot_output_pop (void *context, int value)
+{
+    vm_output_pop ((VMContext *) context, value);
+}
+
+/***********************************************************************************************************/
+
+/* Display the value that a SET stored in a register, for compiled code. */
+static void aot_output_set (void *context, int reg, int value)
+{
+    vm_output_set ((VMContext *) context, reg, value);
+}
+
+/***********************************************************************************************************/
+
+/* Write out the code for a jump from the instruction at the index given to its target, which is taken when
+ * the condition provided is true (or always, if it is NULL). */
+static void aot_jump (FILE *file, const char *condition, const Instruction *instruction, int index)
+{
+    if (condition != NULL)
+        fprintf (file, "    if (%s)\n    ", condition);
+
+    if (instruction->target <= index)
+        fprintf (file, "    LOOP (%d, %d);\n", instruction->target, index - instruction->target + 1);
+    else
+        fprintf (file, "    goto i%d;\n", instruction->target);
+}
+
+/***********************************************************************************************************/
+
+/* Write out the code for the instruction at the index given. The registers are the locals r0 and up. */
+static void aot_instruction (FILE *file, const Instruction *instruction, int index)
+{
+    const int *p = instruction->parameters;
+    char condition[64];
+
+    switch (instruction->operation)
+    {
+        case OP_NOP:
+            break;
+
+        case OP_PUSH:
+            fprintf (file, "    if (sp == full) STOP (%d);\n", index);
+            fprintf (file, "    stack[++sp] = %d;\n", p[0]);
+            break;
+
+        case OP_POP:
+            fprintf (file, "    if (sp < 0) STOP (%d);\n", index);
+            fprintf (file, "    if (traceOps) frame->outputPop (frame->context, stack[sp]);\n");
+            fprintf (file, "    sp--;\n");
+            break;
+
+        case OP_SET:
+            fprintf (file, "    if (sp < 0) STOP (%d);\n", index);
+            fprintf (file, "    r%d = stack[sp--];\n", p[0]);
+            fprintf (file, "    if (traceOps) frame->outputSet (frame->context, %d, r%d);\n", p[0], p[0]);
+            break;
+
+        case OP_ADD:
+            fprintf (file, "    if (sp < 1) STOP (%d);\n", index);
+            fprintf (file, "    stack[sp - 1] = ADD (stack[sp], stack[sp - 1]);\n");
+            fprintf (file, "    sp--;\n");
+            break;
+
+        case OP_RADD:
+            fprintf (file, "    if (sp == full) STOP (%d);\n", index);
+            fprintf (file, "    stack[++sp] = ADD (r%d, r%d);\n", p[0], p[1]);
+            break;
+
+        case OP_RDEC:
+            fprintf (file, "    r%d = SUB (r%d, 1);\n", p[0], p[0]);
+            break;
+
+        case OP_RJNE:
+            fprintf (file, "    if (sp < 0) STOP (%d);\n", index);
+            snprintf (condition, sizeof (condition), "r%d != stack[sp]", p[0]);
+            aot_jump (file, condition, instruction, index);
+            break;
+
+        case OP_RMOV:
+            fprintf (file, "    r%d = r%d;\n", p[0], p[1]);
+            break;
+
+        case OP_RMOVI:
+            fprintf (file, "    r%d = %d;\n", p[0], p[1]);
+            break;
+
+        case OP_RADDR:
+        case OP_RSUBR:
+            fprintf (file, "    r%d = %s (r%d, r%d);\n", p[0], instruction->operation == OP_RADDR ? "ADD" : "SUB",
+                     p[1], p[2]);
+            break;
+
+        case OP_RADDI:
+        case OP_RSUBI:
+            fprintf (file, "    r%d = %s (r%d, %d);\n", p[0], instruction->operation == OP_RADDI ? "ADD" : "SUB",
+                     p[1], p[2]);
+            break;
+
+        case OP_RINC:
+            fprintf (file, "    r%d = ADD (r%d, 1);\n", p[0], p[0]);
+            break;
+
+        case OP_RJNEI:
+        case OP_RJEQI:
+        case OP_RJLTI:
+            snprintf (condition, sizeof (condition), "r%d %s %d", p[0],
+                      instruction->operation == OP_RJNEI ? "!=" : instruction->operation == OP_RJEQI ? "==" : "<",
+                      p[1]);
+            aot_jump (file, condition, instruction, index);
+            break;
+
+        case OP_RJNER:
+        case OP_RJEQR:
+        case OP_RJLTR:
+            snprintf (condition, sizeof (condition), "r%d %s r%d", p[0],
+                      instruction->operation == OP_RJNER ? "!=" : instruction->operation == OP_RJEQR ? "==" : "<",
+                      p[1]);
+            aot_jump (file, condition, instruction, index);
+            break;
+
+        case OP_JMP:
+            aot_jump (file, NULL, instruction, index);
+            break;
+
+        /* Halting is left to the interpreter, along with anything else that the decoder doesn't produce for
+         * a program that hasn't been analyzed. */
+        default:
+            fprintf (file, "    STOP (%d);\n", index);
+            break;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Write the provided program out as a C source file that compiles into a program that aot_load() can load. */
+int aot_generate (const int *program, int programLength, FILE *file)
+{
+    Instruction *code;
+    int codeSize, codeEnd, i;
+
+    code = decode_program (program, programLength, &codeSize, &codeEnd);
+    if (code == NULL)
+        return 0;
+
+    fprintf (file, "/* Generated by aot_generate() from a bytecode program of %d ints; do not edit. */\n\n",
+             programLength);
+    fputs (aot_prologue, file);
+
+    /* The bytecode itself, so that the program can only be used with the one that it was compiled from. */
+    fprintf (file, "static const int program[%d] = {", programLength > 0 ? programLength : 1);
+    for (i = 0 ; i < programLength ; i++)
+        fprintf (file, "%s%s%d", i > 0 ? "," : "", i % 16 == 0 ? "\n    " : " ", program[i]);
+    fprintf (file, "%s\n};\n\n", programLength > 0 ? "" : "\n    0");
+
+    /* The state of the context is kept in locals while the program runs, and stored back when it stops. */
+    fprintf (file, "static int run (AotFrame *frame, int pc)\n{\n");
+    fprintf (file, "    int *stack = frame->stack;\n");
+    fprintf (file, "    int sp = frame->sp;\n");
+    fprintf (file, "    int full = frame->stackSize - 1;\n");
+    fprintf (file, "    int traceOps = frame->traceOps;\n");
+    fprintf (file, "    long long budget = frame->budget;\n");
+    for (i = 0 ; i < REGISTER_COUNT ; i++)
+        fprintf (file, "    int r%d = frame->registers[%d];\n", i, i);
+
+    /* The program can be started at any instruction. */
+    fprintf (file, "\n    switch (pc)\n    {\n");
+    for (i = 0 ; i < codeSize ; i++)
+        fprintf (file, "        case %d: goto i%d;\n", i, i);
+    fprintf (file, "        default: goto stop;\n    }\n\n");
+
+    for (i = 0 ; i < codeSize ; i++)
+    {
+        fprintf (file, "i%d: /* %d: %s */\n", i, code[i].ip, operation_name (code[i].operation));
+        aot_instruction (file, &code[i], i);
+    }
+
+    fprintf (file, "\nstop:\n");
+    fprintf (file, "    frame->sp = sp;\n");
+    fprintf (file, "    frame->budget = budget;\n");
+    for (i = 0 ; i < REGISTER_COUNT ; i++)
+        fprintf (file, "    frame->registers[%d] = r%d;\n", i, i);
+    fprintf (file, "    return pc;\n}\n\n");
+
+    fprintf (file, "const AotProgram %s = { %d, %d, %d, program, %d, run };\n", AOT_SYMBOL, AOT_VERSION,
+             (int) sizeof (AotFrame), REGISTER_COUNT, programLength);
+
+    free (code);
+
+    return ferror (file) == 0;
+}
+
+/***********************************************************************************************************/
+
+/* Fill out the error provided (if there is one) and return NULL to indicate failure. */
+static AotModule *aot_fail (AotError *error, AotError reason)
+{
+    if (error != NULL)
+        *error = reason;
+
+    return NULL;
+}
+
+/***********************************************************************************************************/
+
+/* Load a program that was compiled ahead of time. */
+AotModule *aot_load (const char *path, AotError *error)
+{
+    const AotProgram *program;
+    AotModule *module;
+    void *handle;
+
+    /* The path is always a file; dlopen() would search the library path for one without a directory in it. */
+    if (strchr (path, '/') == NULL)
+    {
+        char local[FILENAME_MAX];
+
+        snprintf (local, sizeof (local), "./%s", path);
+        handle = dlopen (local, RTLD_NOW | RTLD_LOCAL);
+    }
+    else
+        handle = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+
+    if (handle == NULL)
+    {
+        fprintf (stderr, "%s\n", dlerror ());
+        return aot_fail (error, AOT_ERROR_OPEN);
+    }
+
+    program = (const AotProgram *) dlsym (handle, AOT_SYMBOL);
+    if (program == NULL)
+    {
+        dlclose (handle);
+        return aot_fail (error, AOT_ERROR_SYMBOL);
+    }
+
+    if (program->version != AOT_VERSION || program->frameSize != (int) sizeof (AotFrame) ||
+        program->registerCount != REGISTER_COUNT)
+    {
+        dlclose (handle);
+        return aot_fail (error, AOT_ERROR_VERSION);
+    }
+
+    module = malloc (sizeof (AotModule));
+    if (module == NULL)
+    {
+        dlclose (handle);
+        return aot_fail (error, AOT_ERROR_MEMORY);
+    }
+
+    module->handle = handle;
+    module->program = program;
+
+    return module;
+}
+
+/***********************************************************************************************************/
+
+/* Check whether a loaded program was compiled from the provided program. */
+int aot_matches (const AotModule *module, const int *program, int programLength)
+{
+    return program != NULL && module->program->programLength == programLength &&
+           memcmp (module->program->program, program, sizeof (int) * programLength) == 0;
+}
+
+/***********************************************************************************************************/
+
+/* Run the compiled program in the provided context, starting at the instruction with index pc. */
+int aot_run (const AotModule *module, VMContext *context, int pc, long long *budget)
+{
+    AotFrame frame;
+
+    frame.context = context;
+    frame.registers = context->registers;
+    frame.stack = context->stack;
+    frame.sp = context->sp;
+    frame.stackSize = context->stackSize;
+    frame.budget = *budget;
+    frame.traceOps = VM_TRACE_ENABLED && context->traceLevel >= VM_TRACE_OPS;
+    frame.outputPop = aot_output_pop;
+    frame.outputSet = aot_output_set;
+
+    pc = module->program->run (&frame, pc);
+
+    context->sp = frame.sp;
+    *budget = frame.budget;
+
+    return pc;
+}
+
+/***********************************************************************************************************/
+
+/* Unload a compiled program. */
+void aot_unload (AotModule *module)
+{
+    if (module == NULL)
+        return;
+
+    dlclose (module->handle);
+    free (module);
+}
+
+/***********************************************************************************************************/
+
+/* Convert the reason that a compiled program could not be loaded into a human readable string. */
+const char *aot_error_reason (AotError error)
+{
+    switch (error)
+    {
+        case AOT_ERROR_OPEN:
+            return "Unable to open the compiled program";
+
+        case AOT_ERROR_SYMBOL:
+            return "File is not a compiled bytecode program";
+
+        case AOT_ERROR_VERSION:
+            return "Compiled program was built by an incompatible version";
+
+        case AOT_ERROR_MEMORY:
+            return "Unable to allocate memory for the compiled program";
+    }
+
+    return "Unknown compiled program error";
+}
+
+/***********************************************************************************************************/
@@ -0,0 +1,119 @@
+#ifndef __AOTdotH__
+#define __AOTdotH__
+
+/***********************************************************************************************************/
+
+#include <stdio.h>
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* The version of the interface between libcore and a program compiled ahead of time, which changes whenever
+ * AotFrame or AotProgram do. A module built for some other version is refused when it's loaded. */
+#define AOT_VERSION 1
+
+/* The name of the AotProgram that a compiled program exports, which is how libcore finds it. */
+#define AOT_SYMBOL "simplevm_aot"
+
+/* The state of a context that compiled code works on while it runs. The generated code has its own copy of
+ * this structure, so it must not change without AOT_VERSION changing too. */
+typedef struct AotFrame
+{
+    /* The context being run, which is only passed back to the functions below. */
+    void *context;
+
+    /* The registers, the stack and the stack pointer, the number of entries that the stack has room for and
+     * the budget, which the compiled code keeps in locals while it runs and stores back when it stops. */
+    int *registers;
+    int *stack;
+    int sp;
+    int stackSize;
+    long long budget;
+
+    /* True if the context is tracing operations, in which case the results of POP and SET are handed to
+     * these functions to display. */
+    int traceOps;
+    void (*outputPop) (void *context, int value);
+    void (*outputSet) (void *context, int reg, int value);
+} AotFrame;
+
+/* What a compiled program exports under AOT_SYMBOL. */
+typedef struct AotProgram
+{
+    /* AOT_VERSION, the size of AotFrame and REGISTER_COUNT as they were when the program was generated. */
+    int version;
+    int frameSize;
+    int registerCount;
+
+    /* A copy of the bytecode that the program was compiled from, which is what a context has to be running
+     * for the compiled code to be used in it. */
+    const int *program;
+    int programLength;
+
+    /* The compiled program, which starts at the instruction with index pc in the decoded program and works
+     * the same way as jit_run(). */
+    int (*run) (AotFrame *frame, int pc);
+} AotProgram;
+
+/* A compiled program that has been loaded with aot_load(). */
+typedef struct AotModule
+{
+    /* The handle of the shared object, and the program that it exports. */
+    void *handle;
+    const AotProgram *program;
+} AotModule;
+
+/* The reasons that a compiled program could not be loaded. */
+typedef enum
+{
+    /* The shared object could not be opened; aot_load() displays why. */
+    AOT_ERROR_OPEN,
+
+    /* The shared object doesn't export a compiled program. */
+    AOT_ERROR_SYMBOL,
+
+    /* The program was compiled by an incompatible version of libcore. */
+    AOT_ERROR_VERSION,
+
+    /* There was not enough memory. */
+    AOT_ERROR_MEMORY,
+} AotError;
+
+/***********************************************************************************************************/
+
+/* Write the provided program out as a C source file that compiles (as a shared object) into a program that
+ * aot_load() can load. Every instruction in the decoded program becomes a label and every jump a goto, so the
+ * C compiler sees the whole control flow of the program and can keep the registers in machine registers
+ * across it, which neither the interpreter nor the JIT can do.
+ *
+ * The program is generated from the bytecode as it decodes, without any of the analysis that the interpreter
+ * does on it, so it doesn't depend on where the program is started or with how much on the stack. The
+ * generated code needs nothing but a C compiler; it doesn't include any headers.
+ *
+ * Returns 0 if the program could not be decoded or written, or 1 otherwise. */
+int aot_generate (const int *program, int programLength, FILE *file);
+
+/* Load a program that was compiled ahead of time from the source written by aot_generate(). The module stays
+ * loaded until it is released with aot_unload(), and can be attached to any number of contexts that run the
+ * program it was compiled from with ctx_aot().
+ *
+ * Returns NULL and fills out the error provided (if there is one) if the module could not be loaded. */
+AotModule *aot_load (const char *path, AotError *error);
+
+/* Check whether a loaded program was compiled from the provided program. Returns 1 if it was, or 0 if not. */
+int aot_matches (const AotModule *module, const int *program, int programLength);
+
+/* Run the compiled program in the provided context the same way that jit_run() runs native code, starting at
+ * the instruction with index pc in the decoded program. The return value is the index of the instruction
+ * that the interpreter should carry on from, and the budget is updated with what is left. */
+int aot_run (const AotModule *module, VMContext *context, int pc, long long *budget);
+
+/* Unload a compiled program. It's safe to pass NULL. */
+void aot_unload (AotModule *module);
+
+/* Convert the reason that a compiled program could not be loaded into a human readable string. */
+const char *aot_error_reason (AotError error);
+
+/***********************************************************************************************************/
+
+#endif
@@ -0,0 +1,519 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "batch.h"
+#include "decode.h"
+
+/***********************************************************************************************************/
+
+/* The vector operations that the batch engine uses, on a vector of BATCH_WIDTH lanes of 32 bit integers.
+ * A mask is a vector that has every bit set in the lanes that it selects and none set in the others, which
+ * is what the comparisons produce. Since a selected lane is -1, subtracting a mask adds one to the lanes
+ * that it selects, and adding it takes one away. */
+#if defined (__AVX2__)
+
+#include <immintrin.h>
+
+#define BATCH_WIDTH 8
+typedef __m256i BatchVector;
+
+#define VEC_LOAD(p)          _mm256_loadu_si256 ((const __m256i *) (p))
+#define VEC_STORE(p, v)      _mm256_storeu_si256 ((__m256i *) (p), (v))
+#define VEC_SPLAT(x)         _mm256_set1_epi32 (x)
+#define VEC_ADD(a, b)        _mm256_add_epi32 ((a), (b))
+#define VEC_SUB(a, b)        _mm256_sub_epi32 ((a), (b))
+#define VEC_EQ(a, b)         _mm256_cmpeq_epi32 ((a), (b))
+#define VEC_GT(a, b)         _mm256_cmpgt_epi32 ((a), (b))
+#define VEC_AND(a, b)        _mm256_and_si256 ((a), (b))
+#define VEC_ANDNOT(a, b)     _mm256_andnot_si256 ((a), (b))
+#define VEC_SELECT(m, a, b)  _mm256_blendv_epi8 ((b), (a), (m))
+#define VEC_MIN(a, b)        _mm256_min_epi32 ((a), (b))
+#define VEC_MASK(m)          _mm256_movemask_ps (_mm256_castsi256_ps (m))
+
+#elif defined (__SSE2__)
+
+#include <emmintrin.h>
+
+#define BATCH_WIDTH 4
+typedef __m128i BatchVector;
+
+#define VEC_LOAD(p)          _mm_loadu_si128 ((const __m128i *) (p))
+#define VEC_STORE(p, v)      _mm_storeu_si128 ((__m128i *) (p), (v))
+#define VEC_SPLAT(x)         _mm_set1_epi32 (x)
+#define VEC_ADD(a, b)        _mm_add_epi32 ((a), (b))
+#define VEC_SUB(a, b)        _mm_sub_epi32 ((a), (b))
+#define VEC_EQ(a, b)         _mm_cmpeq_epi32 ((a), (b))
+#define VEC_GT(a, b)         _mm_cmpgt_epi32 ((a), (b))
+#define VEC_AND(a, b)        _mm_and_si128 ((a), (b))
+#define VEC_ANDNOT(a, b)     _mm_andnot_si128 ((a), (b))
+#define VEC_SELECT(m, a, b)  _mm_or_si128 (_mm_and_si128 ((m), (a)), _mm_andnot_si128 ((m), (b)))
+#define VEC_MIN(a, b)        VEC_SELECT (VEC_GT ((b), (a)), (a), (b))
+#define VEC_MASK(m)          _mm_movemask_ps (_mm_castsi128_ps (m))
+
+#else
+
+/* Without vector instructions, a vector is a single lane. */
+#define BATCH_WIDTH 1
+typedef int BatchVector;
+
+#define VEC_LOAD(p)          (*(p))
+#define VEC_STORE(p, v)      (*(p) = (v))
+#define VEC_SPLAT(x)         (x)
+#define VEC_ADD(a, b)        ((int) ((unsigned int) (a) + (unsigned int) (b)))
+#define VEC_SUB(a, b)        ((int) ((unsigned int) (a) - (unsigned int) (b)))
+#define VEC_EQ(a, b)         (-((a) == (b)))
+#define VEC_GT(a, b)         (-((a) > (b)))
+#define VEC_AND(a, b)        ((a) & (b))
+#define VEC_ANDNOT(a, b)     (~(a) & (b))
+#define VEC_SELECT(m, a, b)  (((m) & (a)) | (~(m) & (b)))
+#define VEC_MIN(a, b)        ((a) < (b) ? (a) : (b))
+#define VEC_MASK(m)          ((m) & 1)
+
+#endif
+
+/* The number of arrays of width ints that a batch needs: pc, ip, error, reason, sp, tos, the registers and
+ * the stack, which has one extra slot. */
+#define BATCH_ARRAYS (6 + REGISTER_COUNT + CONTEXT_STACK_SIZE + 1)
+
+/***********************************************************************************************************/
+
+/* Set up a batch with the number of lanes given to run the provided program. */
+int batch_init (VMBatch *batch, const int *program, int programLength, int lanes)
+{
+    int *memory, start, i, r;
+
+    memset (batch, 0, sizeof (VMBatch));
+
+    batch->code = decode_program (program, programLength, &batch->codeSize, &batch->codeEnd);
+    if (batch->code == NULL)
+        return 0;
+
+    /* Everything goes in one allocation, starting with the pc array. */
+    batch->lanes = lanes;
+    batch->width = lanes < 1 ? BATCH_WIDTH : (lanes + BATCH_WIDTH - 1) / BATCH_WIDTH * BATCH_WIDTH;
+    memory = calloc ((size_t) batch->width * BATCH_ARRAYS, sizeof (int));
+    if (memory == NULL)
+    {
+        free (batch->code);
+        batch->code = NULL;
+        return 0;
+    }
+
+    batch->pc     = memory;
+    batch->ip     = memory + batch->width;
+    batch->error  = memory + batch->width * 2;
+    batch->reason = memory + batch->width * 3;
+    batch->sp     = memory + batch->width * 4;
+    batch->tos    = memory + batch->width * 5;
+    for (r = 0 ; r < REGISTER_COUNT ; r++)
+        batch->registers[r] = memory + batch->width * (6 + r);
+    batch->stack  = memory + batch->width * (6 + REGISTER_COUNT);
+
+    /* Every lane starts at IP 0 with an empty stack, and the padding is already done. */
+    start = decode_locate (batch->code, batch->codeEnd, 0);
+    for (i = 0 ; i < batch->width ; i++)
+    {
+        batch->pc[i] = i < lanes ? start : BATCH_HALTED;
+        batch->sp[i] = -1;
+    }
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Release the memory that the batch provided is using. */
+void batch_release (VMBatch *batch)
+{
+    free (batch->code);
+    free (batch->pc);
+    memset (batch, 0, sizeof (VMBatch));
+}
+
+/***********************************************************************************************************/
+
+/* Set the state of a lane to be the same as the state of a context. */
+void batch_load (VMBatch *batch, int lane, const VMContext *context)
+{
+    int i;
+
+    batch->pc[lane] = decode_locate (batch->code, batch->codeEnd, context->ip);
+    batch->ip[lane] = context->ip;
+    batch->error[lane] = context->error;
+    batch->reason[lane] = context->error ? context->errorReason : IHALT_UNKNOWN;
+
+    /* A context that is halted stays that way, and one sitting at an IP that isn't an instruction halts as
+     * soon as it runs. */
+    if (context->halted)
+        batch->pc[lane] = BATCH_HALTED;
+    else if (batch->pc[lane] == -1)
+    {
+        batch->pc[lane] = BATCH_HALTED;
+        batch->error[lane] = 1;
+        batch->reason[lane] = IHALT_INVALID_IP;
+    }
+
+    batch->sp[lane] = context->sp;
+    for (i = 0 ; i <= context->sp ; i++)
+        batch->stack[(i + 1) * batch->width + lane] = context->stack[i];
+    batch->tos[lane] = batch->stack[(context->sp + 1) * batch->width + lane];
+
+    for (i = 0 ; i < REGISTER_COUNT ; i++)
+        batch->registers[i][lane] = context->registers[i];
+}
+
+/***********************************************************************************************************/
+
+/* Copy the state of a lane into a context running the same program. */
+void batch_store (const VMBatch *batch, int lane, VMContext *context)
+{
+    int i;
+
+    context->halted = batch->pc[lane] == BATCH_HALTED;
+    context->error = batch->error[lane];
+    context->ip = context->halted ? batch->ip[lane] : batch->code[batch->pc[lane]].ip;
+    context->errorReason = batch->reason[lane];
+    context->errorOpcode = NOP;
+
+    /* The reasons that are about an opcode come from an IHALT, which has it. */
+    if (context->error)
+    {
+        int pc = decode_locate (batch->code, batch->codeEnd, context->ip);
+
+        if (pc != -1 && batch->code[pc].opcode == IHALT && batch->code[pc].pCount > 1)
+            context->errorOpcode = batch->code[pc].parameters[1];
+    }
+
+    context->sp = batch->sp[lane];
+    for (i = 0 ; i <= context->sp ; i++)
+        context->stack[i] = batch->stack[(i + 1) * batch->width + lane];
+
+    for (i = 0 ; i < REGISTER_COUNT ; i++)
+        context->registers[i] = batch->registers[i][lane];
+}
+
+/***********************************************************************************************************/
+
+/* Halt the lanes selected by bits in the vector of lanes starting at base, at the instruction provided. */
+static void batch_halt (VMBatch *batch, int base, int bits, const Instruction *instruction, int error,
+                        int reason)
+{
+    int i;
+
+    for (i = 0 ; i < BATCH_WIDTH ; i++)
+    {
+        if ((bits & (1 << i)) == 0)
+            continue;
+
+        batch->ip[base + i] = instruction->ip;
+        batch->error[base + i] = error;
+        batch->reason[base + i] = reason;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Store the top of the stack of the selected lanes into their stacks, after a push. The slot that the top of
+ * the stack is in depends on the stack pointer of the lane, so this is done a lane at a time. */
+static void batch_push (VMBatch *batch, int base, int bits)
+{
+    int i;
+
+    for (i = 0 ; i < BATCH_WIDTH ; i++)
+    {
+        if (bits & (1 << i))
+            batch->stack[(batch->sp[base + i] + 1) * batch->width + base + i] = batch->tos[base + i];
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Load the top of the stack of the selected lanes from their stacks, after a pop. */
+static void batch_pop (VMBatch *batch, int base, int bits)
+{
+    int i;
+
+    for (i = 0 ; i < BATCH_WIDTH ; i++)
+    {
+        if (bits & (1 << i))
+            batch->tos[base + i] = batch->stack[(batch->sp[base + i] + 1) * batch->width + base + i];
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Carry out the instruction provided for the active lanes in the vector of lanes starting at base, which
+ * are at the instruction pointers provided. Returns the new instruction pointers of the lanes. */
+static BatchVector batch_execute (VMBatch *batch, const Instruction *instruction, int base, BatchVector at,
+                                  BatchVector active)
+{
+    const int *parameters = instruction->parameters;
+    BatchVector sp = VEC_LOAD (batch->sp + base);
+    BatchVector fail = VEC_SPLAT (0);
+    BatchVector ok, reg;
+    int reason = IHALT_UNKNOWN;
+
+    switch (instruction->opcode)
+    {
+        /* These need room to push an item. */
+        case PUSH:
+        case RADD:
+            fail = VEC_AND (active, VEC_EQ (sp, VEC_SPLAT (CONTEXT_STACK_SIZE - 1)));
+            ok = VEC_ANDNOT (fail, active);
+            reason = IHALT_STACK_OVERFLOW;
+
+            if (instruction->opcode == PUSH)
+                reg = VEC_SPLAT (parameters[0]);
+            else
+                reg = VEC_ADD (VEC_LOAD (batch->registers[parameters[0]] + base),
+                               VEC_LOAD (batch->registers[parameters[1]] + base));
+
+            VEC_STORE (batch->tos + base, VEC_SELECT (ok, reg, VEC_LOAD (batch->tos + base)));
+            VEC_STORE (batch->sp + base, VEC_SUB (sp, ok));
+            batch_push (batch, base, VEC_MASK (ok));
+            at = VEC_SUB (at, ok);
+            break;
+
+        /* These need an item to take off of the stack. */
+        case POP:
+        case SET:
+            fail = VEC_AND (active, VEC_EQ (sp, VEC_SPLAT (-1)));
+            ok = VEC_ANDNOT (fail, active);
+            reason = IHALT_STACK_UNDERFLOW;
+
+            if (instruction->opcode == SET)
+            {
+                reg = VEC_LOAD (batch->registers[parameters[0]] + base);
+                VEC_STORE (batch->registers[parameters[0]] + base,
+                           VEC_SELECT (ok, VEC_LOAD (batch->tos + base), reg));
+            }
+
+            VEC_STORE (batch->sp + base, VEC_ADD (sp, ok));
+            batch_pop (batch, base, VEC_MASK (ok));
+            at = VEC_SUB (at, ok);
+            break;
+
+        /* This needs two items. When it fails, the stack is left the way it was. */
+        case ADD:
+            {
+                int bits, i;
+
+                fail = VEC_AND (active, VEC_GT (VEC_SPLAT (1), sp));
+                ok = VEC_ANDNOT (fail, active);
+                reason = IHALT_STACK_UNDERFLOW;
+
+                sp = VEC_ADD (sp, ok);
+                VEC_STORE (batch->sp + base, sp);
+
+                bits = VEC_MASK (ok);
+                for (i = 0 ; i < BATCH_WIDTH ; i++)
+                {
+                    int *slot;
+
+                    if ((bits & (1 << i)) == 0)
+                        continue;
+
+                    slot = &batch->stack[(batch->sp[base + i] + 1) * batch->width + base + i];
+                    *slot = (int) ((unsigned int) *slot + (unsigned int) batch->tos[base + i]);
+                    batch->tos[base + i] = *slot;
+                }
+
+                at = VEC_SUB (at, ok);
+            }
+            break;
+
+        case RDEC:
+            reg = VEC_LOAD (batch->registers[parameters[0]] + base);
+            VEC_STORE (batch->registers[parameters[0]] + base, VEC_ADD (reg, active));
+            at = VEC_SUB (at, active);
+            break;
+
+        /* The lanes where the register doesn't match the top of the stack go to the target, and the rest go
+         * on to the next instruction. */
+        case RJNE:
+            {
+                BatchVector taken;
+
+                fail = VEC_AND (active, VEC_EQ (sp, VEC_SPLAT (-1)));
+                ok = VEC_ANDNOT (fail, active);
+                reason = IHALT_STACK_UNDERFLOW;
+
+                reg = VEC_LOAD (batch->registers[parameters[0]] + base);
+                taken = VEC_ANDNOT (VEC_EQ (reg, VEC_LOAD (batch->tos + base)), ok);
+                at = VEC_SELECT (taken, VEC_SPLAT (instruction->target), VEC_SUB (at, ok));
+            }
+            break;
+
+        /* The register forms set the register in their first operand in the active lanes. */
+        case RMOV:
+        case RMOVI:
+        case RADDR:
+        case RSUBR:
+        case RADDI:
+        case RSUBI:
+        case RINC:
+            {
+                BatchVector value;
+
+                reg = VEC_LOAD (batch->registers[parameters[0]] + base);
+
+                switch (instruction->opcode)
+                {
+                    case RMOV:
+                        value = VEC_LOAD (batch->registers[parameters[1]] + base);
+                        break;
+
+                    case RMOVI:
+                        value = VEC_SPLAT (parameters[1]);
+                        break;
+
+                    case RADDR:
+                        value = VEC_ADD (VEC_LOAD (batch->registers[parameters[1]] + base),
+                                         VEC_LOAD (batch->registers[parameters[2]] + base));
+                        break;
+
+                    case RSUBR:
+                        value = VEC_SUB (VEC_LOAD (batch->registers[parameters[1]] + base),
+                                         VEC_LOAD (batch->registers[parameters[2]] + base));
+                        break;
+
+                    case RADDI:
+                        value = VEC_ADD (VEC_LOAD (batch->registers[parameters[1]] + base),
+                                         VEC_SPLAT (parameters[2]));
+                        break;
+
+                    case RSUBI:
+                        value = VEC_SUB (VEC_LOAD (batch->registers[parameters[1]] + base),
+                                         VEC_SPLAT (parameters[2]));
+                        break;
+
+                    default:
+                        value = VEC_SUB (reg, VEC_SPLAT (-1));
+                        break;
+                }
+
+                VEC_STORE (batch->registers[parameters[0]] + base, VEC_SELECT (active, value, reg));
+                at = VEC_SUB (at, active);
+            }
+            break;
+
+        /* The lanes where the comparison is true go to the target, and the rest go on to the next
+         * instruction. Less than is greater than the other way around. */
+        case RJNEI:
+        case RJEQI:
+        case RJLTI:
+        case RJNER:
+        case RJEQR:
+        case RJLTR:
+            {
+                BatchVector left = VEC_LOAD (batch->registers[parameters[0]] + base), right, taken;
+
+                if (instruction->opcode >= RJNER)
+                    right = VEC_LOAD (batch->registers[parameters[1]] + base);
+                else
+                    right = VEC_SPLAT (parameters[1]);
+
+                if (instruction->opcode == RJNEI || instruction->opcode == RJNER)
+                    taken = VEC_ANDNOT (VEC_EQ (left, right), active);
+                else if (instruction->opcode == RJEQI || instruction->opcode == RJEQR)
+                    taken = VEC_AND (VEC_EQ (left, right), active);
+                else
+                    taken = VEC_AND (VEC_GT (right, left), active);
+
+                at = VEC_SELECT (taken, VEC_SPLAT (instruction->target), VEC_SUB (at, active));
+            }
+            break;
+
+        case JMP:
+            at = VEC_SELECT (active, VEC_SPLAT (instruction->target), at);
+            break;
+
+        case HALT:
+            batch_halt (batch, base, VEC_MASK (active), instruction, 0, IHALT_UNKNOWN);
+            at = VEC_SELECT (active, VEC_SPLAT (BATCH_HALTED), at);
+            break;
+
+        /* A batch has no host functions, so this is a call to one that doesn't exist, the same as in a context
+         * that hasn't been given any. */
+        case CALL:
+            fail = active;
+            reason = IHALT_INVALID_HOST_CALL;
+            break;
+
+        /* The decoder turns anything wrong with the program into an IHALT that says what the problem is. */
+        case IHALT:
+            fail = active;
+            reason = parameters[0];
+            break;
+
+        /* Opcodes that don't exist do nothing, just like NOP. */
+        default:
+            at = VEC_SUB (at, active);
+            break;
+    }
+
+    /* The lanes that found an error halt with it. */
+    if (VEC_MASK (fail) != 0)
+    {
+        batch_halt (batch, base, VEC_MASK (fail), instruction, 1, reason);
+        at = VEC_SELECT (fail, VEC_SPLAT (BATCH_HALTED), at);
+    }
+
+    return at;
+}
+
+/***********************************************************************************************************/
+
+/* Carry out the instruction at index pc for every lane that is sitting on it. The return value is the
+ * lowest instruction index of any lane afterwards, which is the instruction to run next. */
+static int batch_step (VMBatch *batch, int pc)
+{
+    const Instruction *instruction = &batch->code[pc];
+    BatchVector here = VEC_SPLAT (pc);
+    BatchVector next = VEC_SPLAT (BATCH_HALTED);
+    int lowest[BATCH_WIDTH], base, i;
+
+    for (base = 0 ; base < batch->width ; base += BATCH_WIDTH)
+    {
+        BatchVector at = VEC_LOAD (batch->pc + base);
+        BatchVector active = VEC_EQ (at, here);
+
+        if (VEC_MASK (active) != 0)
+        {
+            at = batch_execute (batch, instruction, base, at, active);
+            VEC_STORE (batch->pc + base, at);
+        }
+
+        next = VEC_MIN (next, at);
+    }
+
+    VEC_STORE (lowest, next);
+    for (i = 1 ; i < BATCH_WIDTH ; i++)
+    {
+        if (lowest[i] < lowest[0])
+            lowest[0] = lowest[i];
+    }
+
+    return lowest[0];
+}
+
+/***********************************************************************************************************/
+
+/* Run every lane in the batch until it halts. */
+void batch_run (VMBatch *batch)
+{
+    int pc = BATCH_HALTED, i;
+
+    for (i = 0 ; i < batch->width ; i++)
+    {
+        if (batch->pc[i] < pc)
+            pc = batch->pc[i];
+    }
+
+    while (pc != BATCH_HALTED)
+        pc = batch_step (batch, pc);
+}
+
+/***********************************************************************************************************/
@@ -0,0 +1,93 @@
+#ifndef __BATCHdotH__
+#define __BATCHdotH__
+
+/***********************************************************************************************************/
+
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* The value of the pc of a lane that has halted. */
+#define BATCH_HALTED 0x7FFFFFFF
+
+/* A batch of contexts that all run the same program in lockstep. Each context in the batch is a lane, and
+ * the state of the lanes is stored as a structure of arrays, with one entry in each array for every lane,
+ * so that an instruction can be carried out for several lanes at once with vector instructions.
+ *
+ * Every array has room for a whole number of vectors worth of lanes; the lanes past the end of the batch
+ * are always halted. */
+typedef struct
+{
+    /* The program being run, in its decoded form. */
+    Instruction *code;
+    int codeSize;
+    int codeEnd;
+
+    /* The number of lanes in the batch, and the number that the arrays have room for. */
+    int lanes;
+    int width;
+
+    /* The index in the decoded program of the instruction that each lane runs next, or BATCH_HALTED. */
+    int *pc;
+
+    /* For the lanes that have halted, the IP of the instruction that halted them, whether it was an error
+     * (an IHALT) and if so, the reason for it. */
+    int *ip;
+    int *error;
+    int *reason;
+
+    /* The stack pointer of each lane, and the value of the item at the top of its stack. The top value is
+     * also stored in the stack; keeping a copy here is what lets the instructions that look at it use
+     * vector instructions. */
+    int *sp;
+    int *tos;
+
+    /* The stacks. The stacks of all of the lanes are interleaved, with slot s of the stack of lane l at
+     * stack[(s + 1) * width + l]; the extra slot at the bottom of each stack is what the top of an empty
+     * stack reads. */
+    int *stack;
+
+    /* The registers, each of which has its own array. */
+    int *registers[REGISTER_COUNT];
+} VMBatch;
+
+/***********************************************************************************************************/
+
+/* Set up a batch with the number of lanes given to run the provided program, which is assumed to be of the
+ * given length. Every lane starts out the same way that ctx_init() sets up a context.
+ *
+ * Returns 1 if the batch is ready or 0 if the memory for it could not be allocated. */
+int batch_init (VMBatch *batch, const int *program, int programLength, int lanes);
+
+/* Release the memory that the batch provided is using. */
+void batch_release (VMBatch *batch);
+
+/* Set the state of a lane to be the same as the state of a context (its IP, stack and registers) running
+ * the same program. This is how each lane gets different seed values.
+ *
+ * Every lane has a stack of CONTEXT_STACK_SIZE entries, so the contexts loaded into and stored from a batch
+ * need to have stacks of that size (which is what ctx_init() gives them) for the lanes to produce the same
+ * results that they would. */
+void batch_load (VMBatch *batch, int lane, const VMContext *context);
+
+/* Copy the state of a lane into a context running the same program, which leaves the context exactly the
+ * way that vm_interpret() would have left it if it had run the lane on its own. */
+void batch_store (const VMBatch *batch, int lane, VMContext *context);
+
+/* Run every lane in the batch until it halts.
+ *
+ * The lanes run in lockstep: each step carries out a single instruction for every lane whose next
+ * instruction it is, using vector instructions where possible (AVX2 when libcore is compiled with it, SSE2
+ * on other x86-64 builds, or one lane at a time without either). When a jump sends the lanes in different
+ * directions, the lanes that are furthest behind in the program always go first, which brings the others
+ * back together with them as soon as they catch up.
+ *
+ * The results in each lane are identical to those of running the program on its own. The batch never
+ * produces any output though; the reason that a lane halted is in its error and reason arrays instead.
+ * There are no host functions either, so a lane that gets to a CALL halts with IHALT_INVALID_HOST_CALL, the
+ * way a context does that hasn't been given any (see ctx_host()). */
+void batch_run (VMBatch *batch);
+
+/***********************************************************************************************************/
+
+#endif
@@ -0,0 +1,478 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "compact.h"
+
+/***********************************************************************************************************/
+
+/* The most bytes that a varint can take up. */
+#define VARINT_MAX 5
+
+/* The high four bits of an IHALT that marks an instruction that the program ends in the middle of. */
+#define COMPACT_TRUNCATED 0x10
+
+/* The low four bits of the first byte of an instruction whose opcode doesn't fit in them, which is in the byte
+ * after it instead. */
+#define COMPACT_EXTENDED 0x0F
+
+/***********************************************************************************************************/
+
+/* The number of bytes that the varint for the value provided takes up. */
+static int varint_size (int value)
+{
+    unsigned int bits = ((unsigned int) value << 1) ^ (unsigned int) (value >> 31);
+    int size = 1;
+
+    while (bits >= 0x80)
+    {
+        bits >>= 7;
+        size++;
+    }
+
+    return size;
+}
+
+/***********************************************************************************************************/
+
+/* Store the varint for the value provided, returning the number of bytes used. This is padded out to at
+ * least width bytes with continuation bytes of zero, which still read as the same value. */
+static int varint_write (unsigned char *out, int value, int width)
+{
+    unsigned int bits = ((unsigned int) value << 1) ^ (unsigned int) (value >> 31);
+    int size = 0;
+
+    while (bits >= 0x80 || size + 1 < width)
+    {
+        out[size++] = (unsigned char) (bits | 0x80);
+        bits >>= 7;
+    }
+    out[size++] = (unsigned char) bits;
+
+    return size;
+}
+
+/***********************************************************************************************************/
+
+/* Read the varint at offset at in code, storing its value. Returns the number of bytes used, or 0 if the
+ * program ends before the varint does. */
+static int varint_read (const unsigned char *code, int size, int at, int *value)
+{
+    unsigned int bits = 0;
+    int used = 0;
+
+    do
+    {
+        if (at + used >= size)
+            return 0;
+
+        bits |= (unsigned int) (code[at + used] & 0x7F) << (7 * used);
+    } while ((code[at + used++] & 0x80) != 0 && used < VARINT_MAX);
+
+    *value = (int) ((bits >> 1) ^ (0u - (bits & 1)));
+    return used;
+}
+
+/***********************************************************************************************************/
+
+/* Encode the instruction at the given IP of the program into out, or just work out how big it is if out is
+ * NULL. The offset of a jump is given in bytes, since the one in the program is in integers, along with
+ * how many bytes it has to take up. Returns the size of the instruction in bytes. */
+static int compact_one (const int *program, int programLength, int ip, int offset, int width,
+                        unsigned char *out)
+{
+    unsigned char scratch[2 + MAX_OPCODE_PARAMS * VARINT_MAX];
+    Opcode opcode = (Opcode) program[ip];
+    const char *mask = opcode_operand_mask (opcode);
+    int i, count = opcode_operand_count (opcode), size = 1, nibble;
+
+    if (out == NULL)
+        out = scratch;
+
+    /* An instruction that the program ends in the middle of can only ever IHALT, so all that's kept of it
+     * is its opcode, for the IHALT to report. */
+    if (opcode != IHALT && ip + count >= programLength)
+    {
+        out[0] = IHALT | COMPACT_TRUNCATED;
+        out[1] = (unsigned char) opcode;
+        return 2;
+    }
+
+    /* The nibble is the byte whose high four bits are free for the next register, or -1 if there isn't
+     * one. That's the first byte to begin with, even when the opcode is in the byte after it. */
+    if (opcode < COMPACT_EXTENDED)
+        out[0] = (unsigned char) opcode;
+    else
+    {
+        out[0] = COMPACT_EXTENDED;
+        out[size++] = (unsigned char) opcode;
+    }
+    nibble = 0;
+
+    for (i = 0 ; i < count ; i++)
+    {
+        int jump = mask[i] == 'j';
+        int value = jump ? offset : program[ip + i + 1];
+
+        if (mask[i] == 'r' && nibble != -1)
+        {
+            out[nibble] |= (unsigned char) (value << 4);
+            nibble = -1;
+        }
+        else if (mask[i] == 'r')
+        {
+            out[size] = (unsigned char) value;
+            nibble = size++;
+        }
+        else
+        {
+            size += varint_write (out + size, value, jump ? width : 1);
+            nibble = -1;
+        }
+    }
+
+    return size;
+}
+
+/***********************************************************************************************************/
+
+/* Encode a bytecode program into the compact encoding. */
+unsigned char *compact_encode (const int *program, int programLength, int *size)
+{
+    unsigned char *code = NULL;
+    int *where, *offsets, *widths;
+    int ip, next, total, changed, i;
+
+    /* Where every IP of the program ends up in the result (or -1 for one in the middle of an instruction),
+     * and the offset in bytes of the jump at every IP along with how many bytes it takes up. */
+    where = malloc (sizeof (int) * (programLength + 1));
+    offsets = calloc (programLength + 1, sizeof (int));
+    widths = malloc (sizeof (int) * (programLength + 1));
+    if (where == NULL || offsets == NULL || widths == NULL)
+        goto done;
+
+    /* Make sure that every opcode fits in a byte and every register fits in four bits before anything
+     * else. Registers that don't exist are fine as long as they fit, since they IHALT the same way when
+     * they're run. */
+    for (ip = 0 ; ip < programLength ; ip += 1 + opcode_operand_count ((Opcode) program[ip]))
+    {
+        const char *mask = opcode_operand_mask ((Opcode) program[ip]);
+
+        if (program[ip] < 0 || program[ip] > 255)
+            goto done;
+
+        for (i = 0 ; i < opcode_operand_count ((Opcode) program[ip]) && ip + i + 1 < programLength ; i++)
+        {
+            if (mask[i] == 'r' && (program[ip + i + 1] < 0 || program[ip + i + 1] > 15))
+                goto done;
+        }
+    }
+
+    for (ip = 0 ; ip <= programLength ; ip++)
+        widths[ip] = 1;
+
+    /* The size of a jump depends on how far it goes, which depends on the size of everything between it and
+     * where it lands. Every jump starts out a byte long, and any that turn out to need more are grown and
+     * everything is laid out again. Jumps never shrink (a short offset is padded out instead), so this
+     * always settles. */
+    do
+    {
+        changed = 0;
+
+        for (ip = 0 ; ip <= programLength ; ip++)
+            where[ip] = -1;
+
+        for (ip = 0, total = 0 ; ip < programLength ; ip = next)
+        {
+            next = ip + 1 + opcode_operand_count ((Opcode) program[ip]);
+            where[ip] = total;
+            total += compact_one (program, programLength, ip, 0, widths[ip], NULL);
+        }
+        where[programLength] = total;
+
+        for (ip = 0 ; ip < programLength ; ip = next)
+        {
+            long long target;
+
+            next = ip + 1 + opcode_operand_count ((Opcode) program[ip]);
+            if (opcode_is_jump ((Opcode) program[ip]) == 0 || next > programLength)
+                continue;
+
+            /* Anything past the end goes to the end, and anything else that isn't an instruction goes to
+             * just before the start, so that they IHALT the same way that they would have. The offset is
+             * always the last operand. */
+            target = (long long) ip + program[next - 1];
+            if (target >= programLength)
+                offsets[ip] = total - where[ip];
+            else if (target < 0 || where[target] == -1)
+                offsets[ip] = -1 - where[ip];
+            else
+                offsets[ip] = where[target] - where[ip];
+
+            if (varint_size (offsets[ip]) > widths[ip])
+            {
+                widths[ip] = varint_size (offsets[ip]);
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    code = malloc (total > 0 ? total : 1);
+    if (code == NULL)
+        goto done;
+
+    for (ip = 0 ; ip < programLength ; ip += 1 + opcode_operand_count ((Opcode) program[ip]))
+        compact_one (program, programLength, ip, offsets[ip], widths[ip], code + where[ip]);
+
+    *size = total;
+
+done:
+    free (where);
+    free (offsets);
+    free (widths);
+    return code;
+}
+
+/***********************************************************************************************************/
+
+/* Initialize the instruction provided to be an IHALT at the given IP for the given reason, the same way that
+ * the decoder does. */
+static void compact_ihalt (Instruction *instruction, int ip, IHALT_Reason reason, Opcode opcode)
+{
+    instruction->opcode = IHALT;
+    instruction->operation = OP_IHALT;
+    instruction->parameters[0] = reason;
+    instruction->pCount = 1;
+    instruction->ip = ip;
+    instruction->target = -1;
+    instruction->depthMin = 1;
+    instruction->depthMax = 0;
+
+    if (reason == IHALT_MISSING_OPCODE_PARAMETER || reason == IHALT_INVALID_REGISTER)
+        instruction->parameters[instruction->pCount++] = opcode;
+}
+
+/***********************************************************************************************************/
+
+/* Read the opcode of the instruction that starts at the byte offset ip, which is in the low four bits of its
+ * first byte unless it's too big to fit. Returns the number of bytes that the opcode takes up, or 0 if the
+ * program ends before it does. */
+static int compact_opcode (const unsigned char *code, int size, int ip, Opcode *opcode)
+{
+    if ((code[ip] & 0x0F) != COMPACT_EXTENDED)
+    {
+        *opcode = (Opcode) (code[ip] & 0x0F);
+        return 1;
+    }
+
+    if (ip + 1 >= size)
+        return 0;
+
+    *opcode = (Opcode) code[ip + 1];
+    return 2;
+}
+
+/***********************************************************************************************************/
+
+/* Read the operands of the instruction that starts at the byte offset ip into parameters. Registers come
+ * out of the high four bits of the first byte or the last register byte, the same way that they were put
+ * in. Returns the size of the instruction in bytes, or 0 if the program ends before the operands do. */
+static int compact_operands (const unsigned char *code, int size, int ip, int *parameters)
+{
+    Opcode opcode;
+    const char *mask;
+    int i, count, at, nibble = ip, used;
+
+    at = compact_opcode (code, size, ip, &opcode);
+    if (at == 0)
+        return 0;
+
+    mask = opcode_operand_mask (opcode);
+    count = opcode_operand_count (opcode);
+    at += ip;
+
+    for (i = 0 ; i < count ; i++)
+    {
+        if (mask[i] == 'r' && nibble != -1)
+        {
+            parameters[i] = code[nibble] >> 4;
+            nibble = -1;
+            continue;
+        }
+
+        if (mask[i] == 'r')
+        {
+            if (at >= size)
+                return 0;
+
+            parameters[i] = code[at] & 0x0F;
+            nibble = at;
+            used = 1;
+        }
+        else
+        {
+            used = varint_read (code, size, at, &parameters[i]);
+            nibble = -1;
+
+            if (used == 0)
+                return 0;
+        }
+
+        at += used;
+    }
+
+    return at - ip;
+}
+
+/***********************************************************************************************************/
+
+/* Decode the single instruction that starts at the byte offset ip of a program in the compact encoding. */
+int compact_fetch (const unsigned char *code, int size, int ip, Instruction *instruction)
+{
+    const char *mask;
+    Opcode opcode;
+    int length, i;
+
+    /* Running off of the end of the program, or jumping to before its start. */
+    if (ip >= size)
+    {
+        compact_ihalt (instruction, size, IHALT_MISSING_OPCODE, NOP);
+        return 0;
+    }
+
+    if (ip < 0)
+    {
+        compact_ihalt (instruction, ip, IHALT_INVALID_IP, NOP);
+        return 0;
+    }
+
+    /* An opcode that the program ends in the middle of is cut short before it even starts. */
+    if (compact_opcode (code, size, ip, &opcode) == 0)
+    {
+        compact_ihalt (instruction, ip, IHALT_MISSING_OPCODE_PARAMETER, NOP);
+        return 0;
+    }
+
+    /* An IHALT is only bad if it gets executed, unless it stands in for an instruction that was cut short,
+     * which is the end of the program. */
+    if (opcode == IHALT && (code[ip] & COMPACT_TRUNCATED) == 0)
+    {
+        compact_ihalt (instruction, ip, IHALT_IHALT_EXPLICIT, NOP);
+        return 1;
+    }
+
+    if (opcode == IHALT)
+    {
+        compact_ihalt (instruction, ip, IHALT_MISSING_OPCODE_PARAMETER,
+                       ip + 1 < size ? (Opcode) code[ip + 1] : NOP);
+        return 0;
+    }
+
+    length = compact_operands (code, size, ip, instruction->parameters);
+    if (length == 0)
+    {
+        compact_ihalt (instruction, ip, IHALT_MISSING_OPCODE_PARAMETER, opcode);
+        return 0;
+    }
+
+    instruction->opcode = opcode;
+    instruction->operation = decode_operation (opcode);
+    instruction->pCount = opcode_operand_count (opcode);
+    instruction->ip = ip;
+    instruction->target = opcode_is_jump (opcode) ? ip + instruction->parameters[instruction->pCount - 1] : -1;
+    instruction->depthMin = 1;
+    instruction->depthMax = 0;
+
+    /* The same check as the decoder makes; the program still carries on after this. */
+    mask = opcode_operand_mask (opcode);
+    for (i = 0 ; i < instruction->pCount ; i++)
+    {
+        if (mask[i] == 'r' && instruction->parameters[i] >= REGISTER_COUNT)
+        {
+            compact_ihalt (instruction, ip, IHALT_INVALID_REGISTER, opcode);
+            break;
+        }
+    }
+
+    return length;
+}
+
+/***********************************************************************************************************/
+
+/* Decode a program in the compact encoding back into a bytecode program. */
+int *compact_decode (const unsigned char *code, int size, int *programLength)
+{
+    int *program, *where, ip, length, next, pass;
+
+    /* Where every byte offset of the program ends up in the bytecode, or -1 for one that isn't the start of
+     * an instruction. No instruction is smaller than a byte, which bounds how big the result can be. */
+    where = malloc (sizeof (int) * ((size_t) size + 1));
+    program = malloc (sizeof (int) * ((size_t) size * (1 + MAX_OPCODE_PARAMS) + 1));
+    if (where == NULL || program == NULL)
+    {
+        free (where);
+        free (program);
+        return NULL;
+    }
+
+    for (ip = 0 ; ip <= size ; ip++)
+        where[ip] = -1;
+
+    /* The first pass works out where everything goes, and the second copies it all over, turning jumps
+     * back into a distance in integers. An instruction that the program ends in the middle of becomes its
+     * opcode on its own, which is the end of the program either way. */
+    for (pass = 0 ; pass < 2 ; pass++)
+    {
+        for (ip = 0, length = 0 ; ip < size ; ip = next)
+        {
+            Opcode opcode = RJNE;
+            int count, parameters[MAX_OPCODE_PARAMS];
+
+            where[ip] = length;
+            next = compact_opcode (code, size, ip, &opcode);
+            count = opcode_operand_count (opcode);
+
+            if (next != 0 && opcode != IHALT)
+                next = compact_operands (code, size, ip, parameters);
+
+            if (next == 0 || (opcode == IHALT && (code[ip] & COMPACT_TRUNCATED) != 0))
+            {
+                if (pass)
+                    program[length] = opcode != IHALT ? opcode : ip + 1 < size ? code[ip + 1] : RJNE;
+
+                length++;
+                break;
+            }
+
+            if (pass)
+            {
+                long long target = (long long) ip + parameters[count > 0 ? count - 1 : 0];
+                int jump = opcode_is_jump (opcode);
+
+                program[length] = opcode;
+                memcpy (&program[length + 1], parameters, sizeof (int) * count);
+
+                /* The offset is always the last operand. */
+                if (jump && target >= size)
+                    program[length + count] = where[size] - length;
+                else if (jump && (target < 0 || where[target] == -1))
+                    program[length + count] = -1 - length;
+                else if (jump)
+                    program[length + count] = where[target] - length;
+            }
+
+            next += ip;
+            length += 1 + count;
+        }
+
+        where[size] = length;
+    }
+
+    free (where);
+
+    *programLength = length;
+    return program;
+}
+
+/***********************************************************************************************************/
@@ -0,0 +1,60 @@
+#ifndef __COMPACTdotH__
+#define __COMPACTdotH__
+
+/***********************************************************************************************************/
+
+#include "vm.h"
+#include "decode.h"
+
+/***********************************************************************************************************/
+
+/* The compact encoding of a program stores the same instructions as a bytecode program, in far less space:
+ *
+ *    - Every instruction starts with a single byte, with the opcode in the low four bits. If the first
+ *      operand of the opcode is a register, it goes in the high four bits. An opcode of 15 or more doesn't
+ *      fit, so the low four bits are all set instead and the opcode goes in the byte after it.
+ *    - Any other register operands are packed two to a byte, low four bits first.
+ *    - Integer operands are stored as zig-zag encoded varints: the sign is moved to the lowest bit, so that
+ *      small negative numbers are small too, and the result is stored seven bits at a time, lowest first,
+ *      with the top bit of each byte set when there is another byte to come.
+ *    - The offset of a jump is the distance in bytes from the start of the jump to the instruction that it
+ *      lands on. A jump that lands somewhere that isn't an instruction jumps to offset -1 of the program,
+ *      and one past the end of the program jumps to the end of the program, so that they fail the same way.
+ *    - An instruction that the program ends in the middle of is stored as an IHALT with 1 in its high four
+ *      bits, followed by a byte holding the opcode that was cut short.
+ *
+ * This makes RDEC REG_F a single byte where the bytecode takes eight, and an RJNE that stays inside a small
+ * loop two bytes instead of twelve. Only programs whose opcodes fit in a byte and whose registers fit in
+ * four bits can be encoded this way. */
+
+/***********************************************************************************************************/
+
+/* Encode a bytecode program into the compact encoding. The size of the result in bytes is stored in size.
+ *
+ * The returned array is allocated with malloc() and should be released with free(). NULL is returned if the
+ * memory could not be allocated, or the program has an opcode that doesn't fit in a byte or a register value
+ * that doesn't fit in four bits. */
+unsigned char *compact_encode (const int *program, int programLength, int *size);
+
+/* Decode a program in the compact encoding back into a bytecode program, whose length is stored in
+ * programLength. The result runs the same way as the program that was encoded, although a jump to somewhere
+ * that isn't an instruction may not have the same (invalid) offset that it started with.
+ *
+ * The returned array is allocated with malloc() and should be released with free(). NULL is returned if the
+ * memory could not be allocated. */
+int *compact_decode (const unsigned char *code, int size, int *programLength);
+
+/* Decode the single instruction that starts at the byte offset ip of a program in the compact encoding into
+ * the instruction provided, which is how the interpreter runs a compact program directly. The target of a
+ * jump is set to the byte offset that it lands on.
+ *
+ * Anything that would make the interpreter issue an IHALT (such as running off the end of the program, a
+ * missing operand or a register that doesn't exist) is decoded as an IHALT saying why, the same as
+ * decode_program() would; its IP is the IP the interpreter should be left at. The return value is the size
+ * of the instruction in bytes, which is where the next one starts, or 0 if the program is broken at this
+ * point and there is nothing more to decode. */
+int compact_fetch (const unsigned char *code, int size, int ip, Instruction *instruction);
+
+/***********************************************************************************************************/
+
+#endif
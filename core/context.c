@@ -4,6 +4,19 @@
 #include <stdio.h>
 #include <string.h>
 #include "vm.h"
+#include "decode.h"
+#include "jit.h"
+#include "aot.h"
+#include "profile.h"
+#include "recorder.h"
+#include "output.h"
+#include "snapshot.h"
+
+/***********************************************************************************************************/
+
+/* The stack of a context that doesn't have the memory for one; just the slot in front of it, which is never
+ * written to since there's no room to push anything. */
+static int ctx_no_stack[CONTEXT_STACK_MEMORY (0)];
 
 /***********************************************************************************************************/
 
@@ -11,6 +24,22 @@
  *
  * As a convenience, the initialized context is returned back by the call. */
 VMContext *ctx_init (VMContext *context, int *program, int programLength)
+{
+    int *memory = calloc (CONTEXT_STACK_MEMORY (CONTEXT_STACK_SIZE), sizeof (int));
+
+    if (memory == NULL)
+        return ctx_init_stack (context, program, programLength, ctx_no_stack, 0);
+
+    ctx_init_stack (context, program, programLength, memory, CONTEXT_STACK_SIZE);
+    context->stackMemory = memory;
+
+    return context;
+}
+
+/***********************************************************************************************************/
+
+/* Initialize a VM context to run the provided program, using the memory given for its stack. */
+VMContext *ctx_init_stack (VMContext *context, int *program, int programLength, int *memory, int stackSize)
 {
     /* Zero it. */
     memset (context, 0, sizeof (VMContext));
@@ -20,11 +49,18 @@ VMContext *ctx_init (VMContext *context, int *program, int programLength)
     context->pSize   = programLength;
     context->ip      = 0;
 
-    /* The stack starts empty. */
+    /* The stack starts empty, one slot into its memory. */
+    context->stack = memory + 1;
+    context->stackSize = stackSize;
     context->sp = -1;
 
     /* Not initially halted. */
     context->halted = 0;
+    context->error = 0;
+
+    /* Use the best engine available, and trace everything. */
+    context->engine = VM_ENGINE_DEFAULT;
+    context->traceLevel = VM_TRACE_FULL;
 
     /* Return the initialized context back. */
     return context;
@@ -32,45 +68,292 @@ VMContext *ctx_init (VMContext *context, int *program, int programLength)
 
 /***********************************************************************************************************/
 
-/* Push a value onto the stack of the provided VM context.
- *
- * If the stack is not full, then the stack overflow bit is cleared and the function returns after pushing
- * the item to the top of the stack and updating sp. If the stack is full, the stack overflow bit is set
- * and the function returns without doing anything else. */
-void ctx_stack_push (VMContext *context, int value)
+/* Initialize a VM context to run the provided program in the compact encoding. */
+VMContext *ctx_init_compact (VMContext *context, const unsigned char *code, int size)
 {
-    /* Make sure there is room in the stack. */
-    if (context->sp == CONTEXT_STACK_SIZE - 1)
+    ctx_init (context, NULL, 0);
+
+    context->compact = code;
+    context->compactSize = size;
+
+    return context;
+}
+
+/***********************************************************************************************************/
+
+/* Release any resources that the VM context has allocated while running its program. Currently this is its
+ * reference to the decoded form of the program, its native code, its profile, its recorder, its output sink
+ * and its stack, if any. */
+void ctx_release (VMContext *context)
+{
+    output_release (context->output);
+    context->output = NULL;
+
+    profile_release (context->profile);
+    context->profile = NULL;
+
+    recorder_release (context->recorder);
+    context->recorder = NULL;
+
+    jit_release (context->jit);
+    context->jit = NULL;
+    context->aot = NULL;
+
+    decode_release (context->decoded);
+    context->decoded = NULL;
+
+    /* Leave it with no stack, rather than one that isn't there any more. */
+    free (context->stackMemory);
+    context->stackMemory = NULL;
+    context->stack = ctx_no_stack + 1;
+    context->stackSize = 0;
+    context->sp = -1;
+}
+
+/***********************************************************************************************************/
+
+/* Put the provided VM context back the way it was before its program first ran. */
+void ctx_reset (VMContext *context)
+{
+    context->ip = 0;
+    context->sp = -1;
+    context->halted = 0;
+    context->suspended = 0;
+    context->error = 0;
+    context->errorReason = 0;
+    context->errorOpcode = 0;
+    memset (context->registers, 0, sizeof (context->registers));
+}
+
+/***********************************************************************************************************/
+
+/* Take a snapshot of the state of the provided VM context as it is right now. */
+VMSnapshot *ctx_snapshot (const VMContext *context)
+{
+    VMSnapshot *snapshot = snapshot_create (context->sp + 1);
+
+    if (snapshot == NULL)
+        return NULL;
+
+    snapshot->program = context->program;
+    snapshot->pSize = context->pSize;
+    snapshot->compact = context->compact;
+    snapshot->compactSize = context->compactSize;
+
+    snapshot->engine = context->engine;
+    snapshot->traceLevel = context->traceLevel;
+    snapshot->decoded = context->decoded != NULL ? decode_retain (context->decoded) : NULL;
+
+    snapshot->halted = context->halted;
+    snapshot->suspended = context->suspended;
+    snapshot->error = context->error;
+    snapshot->errorReason = context->errorReason;
+    snapshot->errorOpcode = context->errorOpcode;
+
+    snapshot->ip = context->ip;
+    snapshot->sp = context->sp;
+
+    /* Only the part of the stack that is in use is kept. */
+    memcpy (snapshot->registers, context->registers, sizeof (context->registers));
+    memcpy (snapshot->stack, context->stack, sizeof (int) * (context->sp + 1));
+
+    return snapshot;
+}
+
+/***********************************************************************************************************/
+
+/* Put the provided VM context back into the state recorded in a snapshot. */
+int ctx_restore (VMContext *context, const VMSnapshot *snapshot)
+{
+    if (context->program != snapshot->program || context->pSize != snapshot->pSize ||
+        context->compact != snapshot->compact || context->compactSize != snapshot->compactSize)
+        return 0;
+
+    if (snapshot->sp >= context->stackSize)
+        return 0;
+
+    context->halted = snapshot->halted;
+    context->suspended = snapshot->suspended;
+    context->error = snapshot->error;
+    context->errorReason = snapshot->errorReason;
+    context->errorOpcode = snapshot->errorOpcode;
+
+    context->ip = snapshot->ip;
+    context->sp = snapshot->sp;
+
+    /* The entries above the top of the stack are never read before they're written, so whatever the context
+     * left in them can stay there. */
+    memcpy (context->registers, snapshot->registers, sizeof (context->registers));
+    memcpy (context->stack, snapshot->stack, sizeof (int) * (snapshot->sp + 1));
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Initialize a VM context to run the program that a snapshot was taken of, and restore the snapshot into
+ * it. */
+VMContext *ctx_fork (VMContext *context, const VMSnapshot *snapshot)
+{
+    if (snapshot->compact != NULL)
+        ctx_init_compact (context, snapshot->compact, snapshot->compactSize);
+    else
+        ctx_init (context, snapshot->program, snapshot->pSize);
+
+    context->engine = snapshot->engine;
+    context->traceLevel = snapshot->traceLevel;
+
+    /* Share the decoded program, unless it was analyzed for some other size of stack (which it is if the
+     * context didn't get the memory for one). */
+    if (snapshot->decoded != NULL && snapshot->decoded->stackSize == context->stackSize)
+        context->decoded = decode_retain (snapshot->decoded);
+
+    return ctx_restore (context, snapshot) ? context : NULL;
+}
+
+/***********************************************************************************************************/
+
+/* Give the provided VM context the host functions that its program calls. */
+void ctx_host (VMContext *context, const VMHostFunction *functions, int count, void *userData)
+{
+    context->host = functions;
+    context->hostCount = functions != NULL ? count : 0;
+    context->hostData = userData;
+}
+
+/***********************************************************************************************************/
+
+/* Resume a program that a host function suspended. */
+int ctx_resume (VMContext *context)
+{
+    if (context->suspended == 0)
+        return 0;
+
+    context->suspended = 0;
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Run the program in the provided VM context with a program compiled from it ahead of time, or not. */
+int ctx_aot (VMContext *context, AotModule *module)
+{
+    if (module != NULL && aot_matches (module, context->program, context->pSize) == 0)
+        return 0;
+
+    context->aot = module;
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Turn profiling of the program in the provided context on or off. */
+int ctx_profile (VMContext *context, int enable)
+{
+    profile_release (context->profile);
+    context->profile = NULL;
+
+    /* The profile has a count for every IP in the program, whichever form it's in. */
+    if (enable)
     {
-        context->vmFlags.stackOverflow = 1;
-        return;
+        context->profile = profile_create (context->compact != NULL ? context->compactSize : context->pSize);
+        if (context->profile == NULL)
+            return 0;
     }
 
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Start or stop recording the program in the provided context. */
+int ctx_record (VMContext *context, int capacity)
+{
+    recorder_release (context->recorder);
+    context->recorder = NULL;
+
+    if (capacity > 0)
+    {
+        context->recorder = recorder_create (capacity);
+        if (context->recorder == NULL)
+            return 0;
+    }
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Send the output of the program in the provided context to a file descriptor. */
+int ctx_output_fd (VMContext *context, int fd, VMOutputFlush flush)
+{
+    output_release (context->output);
+
+    context->output = output_create (NULL, OUTPUT_DEFAULT_SIZE, flush);
+    if (context->output == NULL)
+        return 0;
+
+    context->output->fd = fd;
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Send the output of the program in the provided context to a callback. */
+int ctx_output_callback (VMContext *context, VMOutputCallback callback, void *userData, char *buffer,
+                         int size, VMOutputFlush flush)
+{
+    output_release (context->output);
+
+    context->output = output_create (buffer, size, flush);
+    if (context->output == NULL)
+        return 0;
+
+    context->output->callback = callback;
+    context->output->userData = userData;
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Hand over any output of the program in the provided context that its sink is still holding on to. */
+void ctx_output_flush (VMContext *context)
+{
+    if (context->output != NULL)
+        output_flush (context->output);
+}
+
+/***********************************************************************************************************/
+
+/* Push a value onto the stack of the provided VM context. Returns 1 if it was pushed, or 0 if the stack is
+ * full. */
+int ctx_stack_push (VMContext *context, int value)
+{
+    /* Make sure there is room in the stack. */
+    if (context->sp == context->stackSize - 1)
+        return 0;
+
     /* Increment the stack pointer and then store the value. The stack pointer is -1 when empty. */
     context->stack[++context->sp] = value;
-    context->vmFlags.stackOverflow = 0;
+    return 1;
 }
 
 /***********************************************************************************************************/
 
-/* Pop a value from the stack and return it.
- *
- * If the stack is not empty, then the stack underflow bit is cleared and the function returns after
- * removing the item from the top of the stack and updating sp. If the stack is empty, the stack underflow
- * bit is set and the function returns 0. */
-int ctx_stack_pop (VMContext *context)
+/* Pop a value from the stack into value. Returns 1 if there was one, or 0 if the stack is empty. */
+int ctx_stack_pop (VMContext *context, int *value)
 {
     /* Make sure there is something on the stack. */
     if (context->sp == -1)
-    {
-        context->vmFlags.stackUnderflow = 1;
         return 0;
-    }
 
     /* Get the value at the current stack position, then decrement the stack pointer. It becomes -1 when the
      * stack is empty. */
-    context->vmFlags.stackUnderflow = 0;
-    return context->stack[context->sp--];
+    *value = context->stack[context->sp--];
+    return 1;
 }
 
 /***********************************************************************************************************/
@@ -78,19 +361,15 @@ int ctx_stack_pop (VMContext *context)
 /* Peek at the item at the top of the stack without popping it.
  *
  * This function in all regards is identical to ctx_stack_pop() except that it does not modify sp. */
-int ctx_stack_peek (VMContext *context)
+int ctx_stack_peek (const VMContext *context, int *value)
 {
     /* Make sure there is something on the stack. */
     if (context->sp == -1)
-    {
-        context->vmFlags.stackUnderflow = 1;
         return 0;
-    }
 
     /* Get the value at the current stack position. */
-    context->vmFlags.stackUnderflow = 0;
-    return context->stack[context->sp];
+    *value = context->stack[context->sp];
+    return 1;
 }
 
 /***********************************************************************************************************/
-
@@ -3,14 +3,134 @@
 
 /***********************************************************************************************************/
 
-/* This specifies how large of a stack the VM is allowed to have. This is specified in stack entries. */
+/* This specifies how large of a stack the VM is allowed to have when it isn't given a size, such as by
+ * ctx_init(). This is specified in stack entries. */
 #define CONTEXT_STACK_SIZE 256
 
+/* The number of ints of memory that a stack of the given number of entries takes up. There is one extra slot
+ * in front of the stack, which is what is read as the top of an empty stack; see ctx_init_stack(). */
+#define CONTEXT_STACK_MEMORY(size) ((size) + 1)
+
+/* The size of a cache line, in bytes, which is what contexts that come from a pool are aligned to. */
+#define CONTEXT_ALIGNMENT 64
+
+/* Direct threading relies on the labels as values extension, which only some compilers support. */
+#ifndef VM_HAVE_COMPUTED_GOTO
+#  if defined (__GNUC__)
+#    define VM_HAVE_COMPUTED_GOTO 1
+#  else
+#    define VM_HAVE_COMPUTED_GOTO 0
+#  endif
+#endif
+
+/* The JIT generates x86-64 code for the System V calling convention and needs to be able to map memory that
+ * can be executed, so it is only available on 64 bit x86 systems that aren't Windows. */
+#ifndef VM_HAVE_JIT
+#  if defined (__x86_64__) && !defined (_WIN32)
+#    define VM_HAVE_JIT 1
+#  else
+#    define VM_HAVE_JIT 0
+#  endif
+#endif
+
+/***********************************************************************************************************/
+
+/* The engines that the interpreter can use to execute a program. They all produce the same results, they
+ * just get there in different ways. */
+typedef enum
+{
+    /* Dispatch every instruction through a single switch statement. This works everywhere. */
+    VM_ENGINE_SWITCH,
+
+    /* Every instruction jumps directly to the code for the next one (direct threading). This is only
+     * available when VM_HAVE_COMPUTED_GOTO is true; otherwise the switch engine is used instead. */
+    VM_ENGINE_THREADED,
+
+    /* Compile the program to native code and run that. This is only available when VM_HAVE_JIT is true.
+     * Whenever the native code can't carry on (including when the JIT isn't available) the program carries
+     * on in the fastest interpreter instead. */
+    VM_ENGINE_JIT,
+} VMEngine;
+
+/* The engine that ctx_init() selects for a new context; the fastest one that the compiler supports. */
+#if VM_HAVE_COMPUTED_GOTO
+#  define VM_ENGINE_DEFAULT VM_ENGINE_THREADED
+#else
+#  define VM_ENGINE_DEFAULT VM_ENGINE_SWITCH
+#endif
+
+/* How much output the interpreter produces while it runs a program. Each level includes everything that the
+ * levels before it produce. */
+typedef enum
+{
+    /* Produce no output at all. */
+    VM_TRACE_NONE,
+
+    /* Display the reason that a program was halted due to an error (an IHALT). */
+    VM_TRACE_ERRORS,
+
+    /* Display the results of the operations that produce one, such as the value popped by POP. */
+    VM_TRACE_OPS,
+
+    /* Display every instruction as it is executed, along with the value of any registers it uses. */
+    VM_TRACE_FULL,
+} VMTraceLevel;
+
+/* When the output sink of a context hands the text that it has collected over to wherever it goes. The sink
+ * always does so when its buffer is full, and when the context is released. See ctx_output_fd(). */
+typedef enum
+{
+    /* Hand over every line as soon as it is complete, which is the same as writing it out unbuffered. */
+    VM_OUTPUT_FLUSH_LINE,
+
+    /* Hand over whatever has been collected whenever vm_run_for() returns. This is the default. */
+    VM_OUTPUT_FLUSH_RUN,
+
+    /* Only hand it over when the buffer is full, or when ctx_output_flush() asks for it. */
+    VM_OUTPUT_FLUSH_FULL,
+} VMOutputFlush;
+
+/* A function that is given the output of a context by its output sink, instead of it being written to a file
+ * descriptor. The text points straight into the buffer of the sink and is not terminated; it is only valid
+ * until the callback returns. See ctx_output_callback(). */
+typedef void (*VMOutputCallback) (void *userData, const char *text, int length);
+
+/* Tracing can also be removed from the build entirely by defining VM_NO_TRACE when compiling libcore, in
+ * which case the interpreter never produces any output regardless of the trace level of a context. */
+#ifdef VM_NO_TRACE
+#  define VM_TRACE_ENABLED 0
+#else
+#  define VM_TRACE_ENABLED 1
+#endif
+
+/* Host functions are passed the context that called them, which is defined below. */
+typedef struct VMContext VMContext;
+
+/* What a host function tells the interpreter to do once it returns. */
+typedef enum
+{
+    /* Carry on with the instruction after the CALL. */
+    VM_HOST_CONTINUE,
+
+    /* Suspend the program at the instruction after the CALL, until the host resumes it with ctx_resume(). */
+    VM_HOST_SUSPEND,
+
+    /* Halt the program with an error (IHALT_HOST_CALL_FAILED) at the CALL. */
+    VM_HOST_FAIL,
+} VMHostResult;
+
+/* A function that the host gives a context for its program to call with CALL, which is passed the context
+ * and the user data that was given with it to ctx_host(). It runs in the middle of the program, on whichever
+ * thread is running it, and can look at and change the registers and the stack (through ctx_stack_push() and
+ * its friends) however it likes; that is how a program passes it arguments and gets its results. It must not
+ * run the context itself. See ctx_host(). */
+typedef VMHostResult (*VMHostFunction) (VMContext *context, void *userData);
+
 /***********************************************************************************************************/
 
 /* This structure represents a VM context, which is what a program runs in in the VM. All global state for an
  * interpreter is kept here so that there can be multiple interpreters at once if desired. */
-typedef struct
+struct VMContext
 {
     /* The program being executed. This is a set of integers that are the opcodes and their operands. */
     int *program;
@@ -18,58 +138,228 @@ typedef struct
     /* How big the program is, in integers (i.e. the size of the program array). */
     int pSize;
 
+    /* The program in its decoded form, which is what is actually executed, along with the analysis done on it.
+     * This is NULL until the program is first decoded. The context holds a reference to it, which it can
+     * share with snapshots of the context and the contexts forked from them; see decode.h, ctx_fork() and
+     * ctx_release(). */
+    struct DecodedProgram *decoded;
+
+    /* The program in the compact encoding, and its size in bytes, when the context was initialized with
+     * ctx_init_compact() instead; the program is run directly from this, and the IP is a byte offset into
+     * it. See compact.h. */
+    const unsigned char *compact;
+    int compactSize;
+
+    /* The engine used to run the program. */
+    VMEngine engine;
+
+    /* The program compiled to native code, if the JIT engine has been used to run it. This is owned by the
+     * context; see ctx_release(). */
+    struct JitCode *jit;
+
+    /* The program compiled ahead of time that runs in place of the JIT and the interpreter, if one has been
+     * attached with ctx_aot(). This belongs to the host, not the context. */
+    struct AotModule *aot;
+
+    /* How much output the interpreter should produce while running the program. */
+    VMTraceLevel traceLevel;
+
+    /* Where that output goes, or NULL if nothing has been produced or asked for yet, in which case a sink
+     * writing to the standard error stream is created when it's first needed. This is owned by the context;
+     * see ctx_output_fd() and ctx_release(). */
+    struct VMOutput *output;
+
+    /* The execution profile being collected for the program, or NULL if it isn't being profiled. This is
+     * owned by the context; see ctx_profile() and ctx_release(). */
+    struct VMProfile *profile;
+
+    /* The recorder keeping the most recent instructions of the program, or NULL if it isn't being recorded.
+     * This is owned by the context; see ctx_record() and ctx_release(). */
+    struct VMRecorder *recorder;
+
+    /* The host functions that the program can call with CALL, the number of them and the user data that is
+     * passed to them, as given to ctx_host(). The table belongs to the host. */
+    const VMHostFunction *host;
+    int hostCount;
+    void *hostData;
+
     /* True if a halt opcode has been encountered in this program, false otherwise. */
     int halted;
 
+    /* True if a host function has suspended the program, until the host resumes it with ctx_resume(). */
+    int suspended;
+
+    /* True if the program was halted because of an error (an IHALT) rather than by a HALT, in which case the
+     * reason for it (an IHALT_Reason) and the opcode that the reason is about (NOP if it isn't about one) are
+     * kept for vm_run_result(). */
+    int error;
+    int errorReason;
+    int errorOpcode;
+
     /* The instruction pointer; this points to the instruction to be executed in the program. */
     int ip;
 
-    /* The operations stack for this context, and the index of the next slot. */
-    int stack[CONTEXT_STACK_SIZE];
+    /* The operations stack for this context and the number of entries in it. The slot before the stack is
+     * always there too, for reading as the top of an empty stack. The memory belongs to the context if it
+     * was allocated by ctx_init(), in which case stackMemory points at it; see ctx_release(). */
+    int *stack;
+    int stackSize;
+    int *stackMemory;
 
     /* The stack pointer for the stack in this context. The index -1 indicates that the stack is empty;
      * otherwise the value here is the index of the item at the top of the stack. */
     int sp;
 
-    /* Special VM flags. This is a bit field. See the individual members for what the bits do and the
-     * circumstances in which they are set/cleared. */
-    struct {
-        /* After a stack push, this bit is set if the push failed due to a stack overflow. Otherwise it is
-         * cleared. */
-        unsigned int stackOverflow:1;
-
-        /* After a stack pop, this bit is set if the pop failed due to a stack underflow. Otherwise it is
-         * cleared. */
-        unsigned int stackUnderflow:1;
-    } vmFlags;
-
     /* The registers for this particular context. */
     int registers[REGISTER_COUNT];
-} VMContext;
+};
 
 /***********************************************************************************************************/
 
-/* Initialize a VM context to run the provided program, which is assumed to be of the given length.
+/* Initialize a VM context to run the provided program, which is assumed to be of the given length. The
+ * context gets a stack of CONTEXT_STACK_SIZE entries, which is allocated for it and released again by
+ * ctx_release(). If there isn't the memory for it, the context has no stack at all, and so halts with a
+ * stack overflow at its first push.
  *
  * As a convenience, the initialized context is returned back by the call. */
 VMContext *ctx_init (VMContext *context, int *program, int programLength);
 
-/* Push a value onto the stack of the provided VM context.
+/* Initialize a VM context to run the provided program, which is assumed to be of the given length, using
+ * the memory given for its stack instead of allocating one. The stack has room for stackSize entries, and
+ * the memory must be at least CONTEXT_STACK_MEMORY(stackSize) ints long, since the stack starts one int in;
+ * it must remain valid until the context is released. The context never frees it.
+ *
+ * As a convenience, the initialized context is returned back by the call. */
+VMContext *ctx_init_stack (VMContext *context, int *program, int programLength, int *memory, int stackSize);
+
+/* Initialize a VM context to run the provided program in the compact encoding (see compact.h), which is
+ * size bytes long. The program is run straight out of the compact encoding without being decoded first;
+ * this is slower than running the bytecode, but the program takes up a fraction of the memory.
+ *
+ * As a convenience, the initialized context is returned back by the call. */
+VMContext *ctx_init_compact (VMContext *context, const unsigned char *code, int size);
+
+/* Release any resources that the VM context has allocated while running its program, including its
+ * profile and recorder, its output sink, which hands over whatever output it has left first, and its stack
+ * if ctx_init() allocated it. The context must be initialized again with ctx_init() before it can be used
+ * again. */
+void ctx_release (VMContext *context);
+
+/* Put the provided VM context back the way it was before its program first ran, so that it can be run again
+ * from the start: the IP, the stack pointer, the halt state and the registers are cleared, and nothing else. The
+ * decoded program, its native code and the analysis done on it are all kept, which makes this much cheaper
+ * than initializing the context again. The profile, recording and output sink carry on where they were. */
+void ctx_reset (VMContext *context);
+
+/* Take a snapshot of the state of the provided VM context (its IP, stack, registers and halt state, which
+ * includes whether it's suspended) as it is
+ * right now, usually while vm_run_for() has it paused, so that it or other contexts can be put back into that
+ * state later with ctx_restore() or ctx_fork(). The snapshot also holds a reference to the decoded program of
+ * the context, if it has been decoded, for forks to share. See snapshot.h.
+ *
+ * Returns NULL if the memory could not be allocated. Release it with snapshot_release(). */
+struct VMSnapshot *ctx_snapshot (const VMContext *context);
+
+/* Put the provided VM context back into the state recorded in a snapshot, so that running it carries on from
+ * where the context the snapshot was taken of was at the time. Only the IP, the entries of the stack that
+ * were in use, the registers and the halt state are copied; the decoded program, native code, profile,
+ * recording and output sink of the context are all kept.
  *
- * If the stack is not full, then the stack overflow bit is cleared and the function returns after pushing
- * the item to the top of the stack and updating sp. If the stack is full, the stack overflow bit is set
- * and the function returns without doing anything else. */
-void ctx_stack_push (VMContext *context, int value);
+ * Returns 0 without changing anything if the context isn't running the same program as the snapshot, or if
+ * the stack in the snapshot doesn't fit in the stack of the context, or 1 otherwise. */
+int ctx_restore (VMContext *context, const struct VMSnapshot *snapshot);
 
-/* Pop a value from the stack and return it.
+/* Initialize a VM context the way ctx_init() (or ctx_init_compact()) does to run the program that a snapshot
+ * was taken of, with the same engine and trace level, and then restore the snapshot into it. This is how a
+ * host branches off from a common prefix of a program; to fork into a context that has a stack of some other
+ * size, such as one from a pool, use ctx_restore() on it instead.
  *
- * If the stack is not empty, then the stack underflow bit is cleared and the function returns after
- * removing the item from the top of the stack and updating sp. If the stack is empty, the stack underflow
- * bit is set and the function returns 0. */
-int ctx_stack_pop (VMContext *context);
+ * The fork shares the decoded program that the snapshot holds, and the analysis done on it, instead of
+ * decoding and analyzing the program again, as long as it was analyzed for a stack of the same size. Any
+ * context that needs to change a decoded program while it's shared takes a copy of its own (see decode.h).
+ *
+ * Returns NULL if the stack in the snapshot doesn't fit in the stack that the context is given, or the
+ * context otherwise; it needs to be released with ctx_release() either way. */
+VMContext *ctx_fork (VMContext *context, const struct VMSnapshot *snapshot);
+
+/* Run the program in the provided VM context with a program that was compiled from it ahead of time (see
+ * aot.h), or go back to running it with its engine if module is NULL. The compiled program runs in place of
+ * the JIT and the interpreter under the same conditions as the JIT, and leaves the same things as it does to
+ * the engine of the context. The module belongs to the host, which must keep it loaded for as long as the
+ * context uses it; releasing the context doesn't unload it.
+ *
+ * Returns 0 without changing anything if the module was not compiled from the program that the context runs,
+ * or 1 otherwise. */
+int ctx_aot (VMContext *context, struct AotModule *module);
+
+/* Turn profiling of the program in the provided context on or off. While it's on, every instruction that
+ * runs is counted in context->profile (see profile.h), which starts out empty; turning it off throws the
+ * profile away. Profiling uses its own versions of the interpreter engines, so that the ones that run when
+ * it is off don't pay anything for it, and never uses the JIT.
+ *
+ * Returns 0 if the memory for the profile could not be allocated, or 1 otherwise. */
+int ctx_profile (VMContext *context, int enable);
+
+/* Start recording the program in the provided context, keeping at least the given number of the most recent
+ * instructions that it runs (see recorder.h), or stop recording it and throw the recording away if capacity
+ * is 0. A recording is much cheaper than a trace, since nothing is formatted, and so can be left running to
+ * find out what led up to an error after the fact. It shares the same engines as profiling.
+ *
+ * Returns 0 if the memory for the recorder could not be allocated, or 1 otherwise. */
+int ctx_record (VMContext *context, int capacity);
+
+/* Send the output of the program in the provided context to a file descriptor, in pieces no smaller than a
+ * buffer of OUTPUT_DEFAULT_SIZE bytes (see output.h) unless the flush policy says otherwise. Any output
+ * collected so far is handed over first. A context that hasn't been given an output sink writes to the
+ * standard error stream, handing its output over whenever vm_run_for() returns.
+ *
+ * Returns 0 if the memory for the sink could not be allocated, or 1 otherwise. */
+int ctx_output_fd (VMContext *context, int fd, VMOutputFlush flush);
+
+/* Send the output of the program in the provided context to a callback instead, which is given userData
+ * along with it. The output is collected in the buffer given, which is size bytes long, and the callback is
+ * handed the text right where it is in the buffer. If buffer is NULL, the context allocates one of size
+ * bytes (or of OUTPUT_DEFAULT_SIZE bytes if size is 0 or less) itself. A buffer provided by the host must
+ * remain valid until the context is released or given another sink.
+ *
+ * Returns 0 if the memory for the sink could not be allocated, or 1 otherwise. */
+int ctx_output_callback (VMContext *context, VMOutputCallback callback, void *userData, char *buffer,
+                         int size, VMOutputFlush flush);
+
+/* Hand over any output of the program in the provided context that its sink is still holding on to. */
+void ctx_output_flush (VMContext *context);
+
+/* Give the provided VM context the table of host functions that its program calls with CALL, where the
+ * operand of a CALL is the index of the function to call in the table, or take them away if functions is
+ * NULL. The user data is passed to every one of them. A CALL of a function that isn't there (or is NULL)
+ * halts the program with IHALT_INVALID_HOST_CALL. The table belongs to the host and must stay valid while
+ * the context runs. A fork of the context (see ctx_fork()) needs to be given the functions again.
+ *
+ * Since a host function can change the stack, the interpreter can't prove anything about the stack after a
+ * CALL, so the stack operations that come after one always check the stack. */
+void ctx_host (VMContext *context, const VMHostFunction *functions, int count, void *userData);
+
+/* Resume a program that a host function suspended, which carries on from the instruction after the CALL
+ * that suspended it the next time that it's run. This is how a host hands work that would block (such as
+ * I/O) off to an event loop: the host function starts the work and suspends the program, vm_run_for()
+ * returns VM_STATUS_SUSPENDED, and once the work is done the host puts the results where the program
+ * expects them (in its registers or on its stack) and resumes it. A host with many programs waiting on I/O
+ * can run all of them until they suspend (see sched_run()), wait for all of their I/O at once and resume
+ * the ones that are done, without a thread blocked on any of them.
+ *
+ * Returns 1 if the program was suspended, or 0 if it wasn't, in which case nothing is changed. */
+int ctx_resume (VMContext *context);
+
+/* Push a value onto the stack of the provided VM context, such as to hand a program its input. Returns 1 if
+ * the value was pushed, or 0 without doing anything if the stack is full. */
+int ctx_stack_push (VMContext *context, int value);
+
+/* Pop the value at the top of the stack of the provided VM context into value, such as to collect the result
+ * of a program. Returns 1 if there was one, or 0 without doing anything if the stack is empty. */
+int ctx_stack_pop (VMContext *context, int *value);
 
-/* Peek at the item at the top of the stack without popping it. Returns what ctx_stack_pop() would return. */
-int ctx_stack_peek (VMContext *context);
+/* Peek at the value at the top of the stack without popping it. Returns what ctx_stack_pop() would return. */
+int ctx_stack_peek (const VMContext *context, int *value);
 
 /***********************************************************************************************************/
 
@@ -11,6 +11,21 @@
 #include "opcodes.h"
 #include "context.h"
 #include "vm.h"
+#include "decode.h"
+#include "verify.h"
+#include "analyze.h"
+#include "jit.h"
+#include "aot.h"
+#include "optimize.h"
+#include "scheduler.h"
+#include "batch.h"
+#include "image.h"
+#include "compact.h"
+#include "profile.h"
+#include "recorder.h"
+#include "output.h"
+#include "pool.h"
+#include "snapshot.h"
 
 /***********************************************************************************************************/
 
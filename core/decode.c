@@ -0,0 +1,373 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "decode.h"
+
+/***********************************************************************************************************/
+
+/* Initialize the instruction provided to be an IHALT at the given IP for the given reason. The opcode is only
+ * used for reasons that carry the offending opcode along with them. */
+static void decode_ihalt (Instruction *instruction, int ip, IHALT_Reason reason, Opcode opcode)
+{
+    instruction->opcode = IHALT;
+    instruction->operation = OP_IHALT;
+    instruction->parameters[0] = reason;
+    instruction->pCount = 1;
+    instruction->ip = ip;
+    instruction->target = -1;
+    instruction->depthMin = 1;
+    instruction->depthMax = 0;
+
+    /* The reasons that are about a specific opcode carry it as an extra parameter. */
+    if (reason == IHALT_MISSING_OPCODE_PARAMETER || reason == IHALT_INVALID_REGISTER)
+        instruction->parameters[instruction->pCount++] = opcode;
+}
+
+/***********************************************************************************************************/
+
+/* Decode the instruction at the given IP of the program into the buffer provided.
+ *
+ * The return value is the number of integers that the instruction takes up in the program, which is where
+ * the next instruction starts. When this is 0, the program is broken at this point and there is nothing
+ * more to decode; the instruction has been decoded as an IHALT saying why. */
+static int decode_one (const int *program, int programLength, int ip, Instruction *instruction)
+{
+    Opcode opcode = (Opcode) program[ip];
+    const char *mask = opcode_operand_mask (opcode);
+    int i, count = opcode_operand_count (opcode);
+
+    /* If this is an IHALT instruction, that's bad, but it's only bad if it gets executed. */
+    if (opcode == IHALT)
+    {
+        decode_ihalt (instruction, ip, IHALT_IHALT_EXPLICIT, NOP);
+        return 1;
+    }
+
+    /* Leave if there are not enough extra slots in the program to fulfill all of the arguments of this
+     * particular opcode. */
+    if (ip + count >= programLength)
+    {
+        decode_ihalt (instruction, ip, IHALT_MISSING_OPCODE_PARAMETER, opcode);
+        return 0;
+    }
+
+    /* We're all good, so copy over. Opcodes that don't exist do nothing. */
+    instruction->opcode = opcode;
+    instruction->operation = decode_operation (opcode);
+    instruction->pCount = count;
+    instruction->ip = ip;
+    instruction->target = -1;
+    instruction->depthMin = 1;
+    instruction->depthMax = 0;
+
+    /* Copy the required parameters over. We need to add 1 to the ip to skip over the instruction. */
+    for (i = 0 ; i < count ; i++)
+        instruction->parameters[i] = program[ip + i + 1];
+
+    /* Registers are used as array indexes, so one that doesn't exist would run off the end of the registers
+     * in the context. Checking them here means that the interpreter never has to. */
+    for (i = 0 ; i < count ; i++)
+    {
+        if (mask[i] == 'r' && (instruction->parameters[i] < 0 || instruction->parameters[i] >= REGISTER_COUNT))
+        {
+            decode_ihalt (instruction, ip, IHALT_INVALID_REGISTER, opcode);
+            break;
+        }
+    }
+
+    return count + 1;
+}
+
+/***********************************************************************************************************/
+
+/* Translate a bytecode program into an array of decoded instructions, which is what the interpreter actually
+ * executes. See the header for the layout of the result. */
+Instruction *decode_program (const int *program, int programLength, int *codeSize, int *codeEnd)
+{
+    Instruction scratch, *code;
+    int *ipMap;
+    int ip, size, count, jumps, extra, i;
+
+    /* This maps every IP in the program (plus the one just past the end) to the index of the instruction
+     * that starts there, or -1 for an IP that is in the middle of an instruction. */
+    ipMap = malloc (sizeof (int) * (programLength + 1));
+    if (ipMap == NULL)
+        return NULL;
+
+    for (ip = 0 ; ip <= programLength ; ip++)
+        ipMap[ip] = -1;
+
+    /* The first pass finds where every instruction starts and how many jumps there are, since each jump
+     * might need an IHALT of its own if it lands somewhere invalid. */
+    count = jumps = 0;
+    for (ip = 0 ; ip < programLength ; ip += size)
+    {
+        size = decode_one (program, programLength, ip, &scratch);
+        ipMap[ip] = count++;
+
+        if (opcode_is_jump (scratch.opcode))
+            jumps++;
+
+        if (size == 0)
+            break;
+    }
+
+    /* The IHALT for running off the end of the program goes at the end. */
+    ipMap[programLength] = count;
+
+    code = malloc (sizeof (Instruction) * (count + 1 + jumps));
+    if (code == NULL)
+    {
+        free (ipMap);
+        return NULL;
+    }
+
+    /* The second pass does the decode for real. */
+    for (ip = 0, i = 0 ; i < count ; ip += size, i++)
+        size = decode_one (program, programLength, ip, &code[i]);
+
+    decode_ihalt (&code[count], programLength, IHALT_MISSING_OPCODE, NOP);
+
+    /* Now resolve where all of the jumps go. Anything past the end of the program goes to the IHALT at the
+     * end, the same as falling off the end would. */
+    extra = count + 1;
+    for (i = 0 ; i < count ; i++)
+    {
+        long long target;
+
+        if (opcode_is_jump (code[i].opcode) == 0)
+            continue;
+
+        /* The offset is always the last operand. */
+        target = (long long) code[i].ip + code[i].parameters[code[i].pCount - 1];
+        if (target >= programLength)
+            code[i].target = count;
+        else if (target >= 0 && ipMap[target] != -1)
+            code[i].target = ipMap[target];
+        else
+        {
+            decode_ihalt (&code[extra], (int) target, IHALT_INVALID_IP, NOP);
+            code[i].target = extra++;
+        }
+    }
+
+    free (ipMap);
+
+    *codeSize = extra;
+    *codeEnd = count;
+    return code;
+}
+
+/***********************************************************************************************************/
+
+/* Find the decoded instruction that was decoded from the provided IP in the original program. Instructions
+ * are decoded in program order, so this is a binary search. */
+int decode_locate (const Instruction *code, int codeEnd, int ip)
+{
+    int low = 0, high = codeEnd;
+
+    while (low <= high)
+    {
+        int mid = low + (high - low) / 2;
+
+        if (code[mid].ip == ip)
+            return mid;
+
+        if (code[mid].ip < ip)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+
+    return -1;
+}
+
+/***********************************************************************************************************/
+
+/* Convert an opcode into the operation that carries it out with all of its checks in place. */
+Operation decode_operation (Opcode opcode)
+{
+    return ((unsigned int) opcode < OPCODE_COUNT) ? (Operation) opcode : OP_NOP;
+}
+
+/***********************************************************************************************************/
+
+/* Convert an operation into a textual name. */
+const char *operation_name (Operation operation)
+{
+    switch (operation)
+    {
+        case OP_PUSH_UNCHECKED: return "PUSH (unchecked)";
+        case OP_POP_UNCHECKED:  return "POP (unchecked)";
+        case OP_SET_UNCHECKED:  return "SET (unchecked)";
+        case OP_ADD_UNCHECKED:  return "ADD (unchecked)";
+        case OP_RADD_UNCHECKED: return "RADD (unchecked)";
+        case OP_RJNE_UNCHECKED: return "RJNE (unchecked)";
+        case OP_PUSH_SET:       return "PUSH+SET";
+        case OP_RDEC_RJNE:      return "RDEC+RJNE";
+        case OP_RADD_ADD:       return "RADD+ADD";
+        case OP_LOOP:           return "LOOP (closed form)";
+
+        /* The rest are the opcodes themselves. */
+        case OP_NOP:
+        case OP_PUSH:
+        case OP_POP:
+        case OP_SET:
+        case OP_ADD:
+        case OP_RADD:
+        case OP_RDEC:
+        case OP_RJNE:
+        case OP_HALT:
+        case OP_IHALT:
+        case OP_RMOV:
+        case OP_RMOVI:
+        case OP_RADDR:
+        case OP_RSUBR:
+        case OP_RADDI:
+        case OP_RSUBI:
+        case OP_RINC:
+        case OP_RJNEI:
+        case OP_RJEQI:
+        case OP_RJLTI:
+        case OP_RJNER:
+        case OP_RJEQR:
+        case OP_RJLTR:
+        case OP_JMP:
+        case OP_CALL:
+            return opcode_name ((Opcode) operation);
+
+        case OPERATION_COUNT:
+            break;
+    }
+
+    /* This isn't a default case so that we can determine when we forgot to modify this switch. */
+    return "???";
+}
+
+/***********************************************************************************************************/
+
+/* Look for pairs of instructions in a row that can be done as a single superinstruction. The operands that
+ * the superinstruction needs from the second instruction are stored in the unused parameter slots of the
+ * first, so that it only has to look at one instruction. */
+int decode_fuse (Instruction *code, int codeEnd, int counts[OPERATION_COUNT])
+{
+    int i, fused = 0;
+
+    for (i = 0 ; i + 1 < codeEnd ; i++)
+    {
+        Instruction *first = &code[i], *second = &code[i + 1];
+        Operation operation;
+
+        if (first->operation == OP_PUSH_UNCHECKED && second->operation == OP_SET_UNCHECKED)
+        {
+            /* The value to push is already in the first parameter. */
+            operation = OP_PUSH_SET;
+            first->parameters[1] = second->parameters[0];
+        }
+        else if (first->operation == OP_RDEC && second->operation == OP_RJNE_UNCHECKED)
+        {
+            /* The register to decrement is already in the first parameter. */
+            operation = OP_RDEC_RJNE;
+            first->parameters[1] = second->parameters[0];
+            first->parameters[2] = second->target;
+        }
+        else if (first->operation == OP_RADD_UNCHECKED && second->operation == OP_ADD_UNCHECKED)
+        {
+            /* Both registers are already in the parameters. */
+            operation = OP_RADD_ADD;
+        }
+        else
+            continue;
+
+        first->operation = operation;
+        if (counts != NULL)
+            counts[operation]++;
+
+        fused++;
+    }
+
+    return fused;
+}
+
+/***********************************************************************************************************/
+
+/* Decode a program into a decoded program that can be shared. */
+DecodedProgram *decode_create (const int *program, int programLength, int stackSize)
+{
+    DecodedProgram *decoded = malloc (sizeof (DecodedProgram));
+
+    if (decoded == NULL)
+        return NULL;
+
+    decoded->code = decode_program (program, programLength, &decoded->codeSize, &decoded->codeEnd);
+    if (decoded->code == NULL)
+    {
+        free (decoded);
+        return NULL;
+    }
+
+    decoded->stackSize = stackSize;
+    decoded->threadedWith = NULL;
+    atomic_init (&decoded->references, 1);
+
+    return decoded;
+}
+
+/***********************************************************************************************************/
+
+/* Take another reference to a decoded program. */
+DecodedProgram *decode_retain (DecodedProgram *decoded)
+{
+    atomic_fetch_add (&decoded->references, 1);
+    return decoded;
+}
+
+/***********************************************************************************************************/
+
+/* Let go of a reference to a decoded program, releasing it if it was the last one. */
+void decode_release (DecodedProgram *decoded)
+{
+    if (decoded == NULL || atomic_fetch_sub (&decoded->references, 1) != 1)
+        return;
+
+    free (decoded->code);
+    free (decoded);
+}
+
+/***********************************************************************************************************/
+
+/* Get a decoded program that the caller can change, in place of one that it holds a reference to. */
+DecodedProgram *decode_unshare (DecodedProgram *decoded)
+{
+    DecodedProgram *copy;
+
+    /* Any other reference would have to come from one that somebody else holds, so if the caller holds the
+     * only one, it stays that way. */
+    if (atomic_load (&decoded->references) == 1)
+        return decoded;
+
+    copy = malloc (sizeof (DecodedProgram));
+    if (copy == NULL)
+        return NULL;
+
+    copy->code = malloc (sizeof (Instruction) * decoded->codeSize);
+    if (copy->code == NULL)
+    {
+        free (copy);
+        return NULL;
+    }
+
+    memcpy (copy->code, decoded->code, sizeof (Instruction) * decoded->codeSize);
+    copy->codeSize = decoded->codeSize;
+    copy->codeEnd = decoded->codeEnd;
+    copy->stackSize = decoded->stackSize;
+    copy->threadedWith = decoded->threadedWith;
+    atomic_init (&copy->references, 1);
+
+    decode_release (decoded);
+    return copy;
+}
+
+/***********************************************************************************************************/
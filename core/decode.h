@@ -0,0 +1,105 @@
+#ifndef __DECODEdotH__
+#define __DECODEdotH__
+
+/***********************************************************************************************************/
+
+#include <stdatomic.h>
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* A decoded program, along with the analysis done on it, which is shared between a context, the snapshots
+ * taken of it and the contexts forked from those (see ctx_fork()), so that a fork doesn't decode and analyze
+ * the program all over again. It's released along with the last reference to it. Since the contexts sharing
+ * it can be running on different threads, it's only ever changed by a context that holds the only reference
+ * to it; one that needs to change it while it's shared takes a copy of its own (see decode_unshare()). */
+typedef struct DecodedProgram
+{
+    /* The decoded instructions, how many of them there are and the index of the IHALT that ends the program,
+     * as decode_program() makes them. */
+    Instruction *code;
+    int codeSize;
+    int codeEnd;
+
+    /* The size of the stack that the program was analyzed for (see analyze_stack()), and the handler table
+     * of the threaded engine that it was last threaded with (if any). */
+    int stackSize;
+    const void *threadedWith;
+
+    /* How many contexts and snapshots hold a reference to it. */
+    atomic_int references;
+} DecodedProgram;
+
+/***********************************************************************************************************/
+
+/* Translate a bytecode program into an array of decoded instructions, which is what the interpreter actually
+ * executes. This does all of the work that would otherwise be done every time an instruction is executed:
+ * fetching the operands, checking that they are all present and resolving the IP that a jump lands on into
+ * the index of the decoded instruction found there.
+ *
+ * The decoded program contains one instruction for every instruction in the bytecode, in the same order,
+ * followed by an IHALT for running off of the end of the program. Anything that would make the interpreter
+ * issue an IHALT (such as a missing operand or an explicit IHALT) is decoded as an IHALT at that position,
+ * and any jump that does not land on the start of an instruction is resolved to an IHALT as well; those come
+ * after the IHALT that ends the program.
+ *
+ * The total number of decoded instructions is stored in codeSize and the index of the IHALT that ends the
+ * program is stored in codeEnd. The returned array is allocated with malloc() and should be released with
+ * free(). NULL is returned if the memory could not be allocated. */
+Instruction *decode_program (const int *program, int programLength, int *codeSize, int *codeEnd);
+
+/* Find the decoded instruction that was decoded from the provided IP in the original program. The IP of the
+ * end of the program finds the terminating IHALT, whose index is the codeEnd from decode_program().
+ *
+ * The return value is the index of the instruction in the decoded program, or -1 if the IP provided is not
+ * the start of an instruction. */
+int decode_locate (const Instruction *code, int codeEnd, int ip);
+
+/* Convert an opcode into the operation that carries it out with all of its checks in place. Opcodes that
+ * don't exist are a NOP. */
+Operation decode_operation (Opcode opcode);
+
+/* Convert an operation into a textual name. */
+const char *operation_name (Operation operation);
+
+/* Look for pairs of instructions in a row in a decoded program that can be done as a single superinstruction
+ * and switch the first one of each pair to the superinstruction. This should be done after analyze_stack(),
+ * since only instructions that it has shown don't need to check the stack are candidates:
+ *
+ *     PUSH n;    SET reg       ->  PUSH_SET  (set the register directly)
+ *     RDEC reg;  RJNE reg, ofs ->  RDEC_RJNE (the body of a countdown loop)
+ *     RADD a, b; ADD           ->  RADD_ADD  (add two registers to the top of the stack)
+ *
+ * The second instruction of each pair stays where it is, and a superinstruction continues on with the
+ * instruction after it. Nothing moves, so a jump to either instruction still works and there are no jump
+ * targets to fix up.
+ *
+ * The number of times each superinstruction was used is added to counts (which is indexed by Operation), if
+ * it is not NULL. The return value is the total number of superinstructions made. */
+int decode_fuse (Instruction *code, int codeEnd, int counts[OPERATION_COUNT]);
+
+/* Decode a program with decode_program() into a decoded program that can be shared, which is to be analyzed
+ * for a stack of stackSize entries. The caller holds the only reference to it.
+ *
+ * Returns NULL if the memory could not be allocated. Let go of it with decode_release(). */
+DecodedProgram *decode_create (const int *program, int programLength, int stackSize);
+
+/* Take another reference to a decoded program, which is returned. Every reference is let go of with
+ * decode_release(). This is safe to call from several threads at once. */
+DecodedProgram *decode_retain (DecodedProgram *decoded);
+
+/* Let go of a reference to a decoded program, which releases it if it was the last one. NULL is allowed.
+ * This is safe to call from several threads at once. */
+void decode_release (DecodedProgram *decoded);
+
+/* Get a decoded program that the caller can change, in place of one that it holds a reference to: the same
+ * one if the caller's reference is the only one, or otherwise a copy of it that the caller holds the only
+ * reference to, in which case the reference to the one given is let go of.
+ *
+ * Returns NULL if the memory for the copy could not be allocated, in which case the caller still holds its
+ * reference to the one given. */
+DecodedProgram *decode_unshare (DecodedProgram *decoded);
+
+/***********************************************************************************************************/
+
+#endif
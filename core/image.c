@@ -0,0 +1,219 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "verify.h"
+
+/***********************************************************************************************************/
+
+/* The magic number as it reads on a machine with the other byte order. */
+#define IMAGE_MAGIC_SWAPPED 0x53564D42
+
+/* Where the program starts in an image; the header rounded up to a cache line. */
+#define IMAGE_PROGRAM_OFFSET ((sizeof (ImageHeader) + 63) / 64 * 64)
+
+/***********************************************************************************************************/
+
+/* Fill out the error provided (if there is one) and return 0 to indicate failure. */
+static int image_fail (ImageError *error, ImageError reason)
+{
+    if (error != NULL)
+        *error = reason;
+
+    return 0;
+}
+
+/***********************************************************************************************************/
+
+/* Work out the checksum of a block of memory. This is 32 bit FNV-1a. */
+static uint32_t image_checksum (const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0 ; i < size ; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/***********************************************************************************************************/
+
+/* Map the bytecode image in the file provided into memory. */
+int image_open (const char *path, VMImage *image, ImageError *error)
+{
+    const ImageHeader *header;
+    struct stat info;
+    int fd;
+
+    memset (image, 0, sizeof (VMImage));
+
+    fd = open (path, O_RDONLY);
+    if (fd == -1)
+        return image_fail (error, IMAGE_ERROR_IO);
+
+    if (fstat (fd, &info) == -1)
+    {
+        close (fd);
+        return image_fail (error, IMAGE_ERROR_IO);
+    }
+
+    if ((size_t) info.st_size < sizeof (ImageHeader))
+    {
+        close (fd);
+        return image_fail (error, IMAGE_ERROR_FORMAT);
+    }
+
+    /* The mapping stays valid once the file is closed. */
+    image->size = (size_t) info.st_size;
+    image->memory = mmap (NULL, image->size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+
+    if (image->memory == MAP_FAILED)
+    {
+        image->memory = NULL;
+        return image_fail (error, IMAGE_ERROR_IO);
+    }
+
+    header = image->memory;
+
+    /* Make sure that this is an image that we can run before trusting anything else in the header. */
+    if (header->magic != IMAGE_MAGIC)
+    {
+        ImageError reason = header->magic == IMAGE_MAGIC_SWAPPED ? IMAGE_ERROR_VERSION :
+                                                                      IMAGE_ERROR_FORMAT;
+        image_close (image);
+        return image_fail (error, reason);
+    }
+
+    if (header->version != IMAGE_VERSION || header->wordSize != sizeof (int))
+    {
+        image_close (image);
+        return image_fail (error, IMAGE_ERROR_VERSION);
+    }
+
+    if (header->headerSize != sizeof (ImageHeader) || header->programOffset % 64 != 0 ||
+        header->headerChecksum != image_checksum (header, offsetof (ImageHeader, headerChecksum)))
+    {
+        image_close (image);
+        return image_fail (error, IMAGE_ERROR_FORMAT);
+    }
+
+    if ((unsigned long long) header->programOffset +
+        (unsigned long long) header->programLength * sizeof (int) > image->size)
+    {
+        image_close (image);
+        return image_fail (error, IMAGE_ERROR_TRUNCATED);
+    }
+
+    image->header = header;
+    image->program = (int *) ((char *) image->memory + header->programOffset);
+    image->programLength = (int) header->programLength;
+    image->verified = (header->flags & IMAGE_VERIFIED) != 0 &&
+                      header->verifiedChecksum == header->programChecksum;
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Check the program in an image against its checksum. */
+int image_check (const VMImage *image, ImageError *error)
+{
+    uint32_t checksum = image_checksum (image->program, sizeof (int) * image->programLength);
+
+    if (checksum != image->header->programChecksum)
+        return image_fail (error, IMAGE_ERROR_CHECKSUM);
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Unmap an image opened with image_open(). */
+void image_close (VMImage *image)
+{
+    if (image->memory != NULL)
+        munmap (image->memory, image->size);
+
+    memset (image, 0, sizeof (VMImage));
+}
+
+/***********************************************************************************************************/
+
+/* Write the provided program out as a bytecode image in the file given. */
+int image_write (const char *path, const int *program, int programLength, ImageError *error)
+{
+    static const char padding[IMAGE_PROGRAM_OFFSET] = { 0 };
+    ImageHeader header;
+    FILE *file;
+    int written;
+
+    memset (&header, 0, sizeof (ImageHeader));
+    header.magic = IMAGE_MAGIC;
+    header.version = IMAGE_VERSION;
+    header.headerSize = sizeof (ImageHeader);
+    header.wordSize = sizeof (int);
+    header.programOffset = IMAGE_PROGRAM_OFFSET;
+    header.programLength = (uint32_t) programLength;
+    header.programChecksum = image_checksum (program, sizeof (int) * programLength);
+
+    if (verify_program (program, programLength, NULL))
+    {
+        header.flags |= IMAGE_VERIFIED;
+        header.verifiedChecksum = header.programChecksum;
+    }
+
+    header.headerChecksum = image_checksum (&header, offsetof (ImageHeader, headerChecksum));
+
+    file = fopen (path, "wb");
+    if (file == NULL)
+        return image_fail (error, IMAGE_ERROR_IO);
+
+    written = fwrite (&header, sizeof (ImageHeader), 1, file) == 1 &&
+              fwrite (padding, IMAGE_PROGRAM_OFFSET - sizeof (ImageHeader), 1, file) == 1 &&
+              fwrite (program, sizeof (int), programLength, file) == (size_t) programLength;
+
+    if (fclose (file) != 0 || written == 0)
+        return image_fail (error, IMAGE_ERROR_IO);
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Convert the reason that an image could not be read or written into a human readable string. */
+const char *image_error_reason (ImageError error)
+{
+    switch (error)
+    {
+        case IMAGE_ERROR_IO:
+            return "Unable to access the image file";
+
+        case IMAGE_ERROR_FORMAT:
+            return "File is not a bytecode image, or its header is damaged";
+
+        case IMAGE_ERROR_VERSION:
+            return "Bytecode image was written by an incompatible version or machine";
+
+        case IMAGE_ERROR_TRUNCATED:
+            return "Bytecode image is shorter than the program it contains";
+
+        case IMAGE_ERROR_CHECKSUM:
+            return "Bytecode image program does not match its checksum";
+    }
+
+    return "Unknown bytecode image error";
+}
+
+/***********************************************************************************************************/
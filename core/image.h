@@ -0,0 +1,122 @@
+#ifndef __IMAGEdotH__
+#define __IMAGEdotH__
+
+/***********************************************************************************************************/
+
+#include <stdint.h>
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* The magic number at the start of every bytecode image ("SVMB" when read as bytes), and the version of
+ * the format that this code reads and writes. */
+#define IMAGE_MAGIC   0x424D5653
+#define IMAGE_VERSION 1
+
+/* The flags in the header of an image. */
+#define IMAGE_VERIFIED 0x00000001
+
+/* The header at the start of a bytecode image file. An image holds a single program as the same integers
+ * that a VMContext runs, in the byte order and integer size of the machine that wrote it, so that a program
+ * can be run straight out of the file once it's mapped into memory.
+ *
+ * The header ends with the verification section, which is only valid when the IMAGE_VERIFIED flag is set.
+ * It records that the program passed verify_program() when the image was written, so that it doesn't need
+ * to be verified again every time that it's loaded. */
+typedef struct
+{
+    /* IMAGE_MAGIC and IMAGE_VERSION. Reading the magic number backwards means that the image was written on
+     * a machine with the other byte order. */
+    uint32_t magic;
+    uint32_t version;
+
+    /* The size of this header, and the size of an integer in the program, in bytes. */
+    uint32_t headerSize;
+    uint32_t wordSize;
+
+    /* Flags that say what is in the image; see IMAGE_VERIFIED. */
+    uint32_t flags;
+
+    /* Where the program starts in the file in bytes (this is always a multiple of 64), how many integers
+     * long it is, and the checksum of those integers. */
+    uint32_t programOffset;
+    uint32_t programLength;
+    uint32_t programChecksum;
+
+    /* The verification section: the checksum of the program that passed verification. */
+    uint32_t verifiedChecksum;
+
+    /* The checksum of all of the header before this point. */
+    uint32_t headerChecksum;
+} ImageHeader;
+
+/* The reasons that an image can't be read or written. */
+typedef enum
+{
+    /* The file could not be opened, mapped, created or written; errno says why. */
+    IMAGE_ERROR_IO,
+
+    /* The file is not a bytecode image, or its header is damaged. */
+    IMAGE_ERROR_FORMAT,
+
+    /* The file is an image, but from a version of the format that this code doesn't understand, or written
+     * on a machine with a different byte order or integer size. */
+    IMAGE_ERROR_VERSION,
+
+    /* The file is too short to hold the program that the header says it holds. */
+    IMAGE_ERROR_TRUNCATED,
+
+    /* The program does not match its checksum. */
+    IMAGE_ERROR_CHECKSUM,
+} ImageError;
+
+/* A bytecode image that has been mapped into memory. */
+typedef struct
+{
+    /* The mapping of the whole file, and how big it is. */
+    void *memory;
+    size_t size;
+
+    /* The header at the start of the mapping. */
+    const ImageHeader *header;
+
+    /* The program in the mapping and its length in integers. This can be given to ctx_init() as is; the
+     * interpreter never writes to the program. */
+    int *program;
+    int programLength;
+
+    /* True if the image says that the program has already passed verification. */
+    int verified;
+} VMImage;
+
+/***********************************************************************************************************/
+
+/* Map the bytecode image in the file provided into memory. The file is mapped read only and shared, so
+ * that every process running the same image shares the same copy of it, and only the header is looked at
+ * here, so this takes the same amount of time no matter how large the program is. Use image_check() to
+ * check the program against its checksum.
+ *
+ * Returns 1 if the image is ready to use, or 0 (after filling out error, if it's not NULL) if not. */
+int image_open (const char *path, VMImage *image, ImageError *error);
+
+/* Check the program in an image against its checksum. This has to read all of the program.
+ *
+ * Returns 1 if the program is intact or 0 (after filling out error, if it's not NULL) if not. */
+int image_check (const VMImage *image, ImageError *error);
+
+/* Unmap an image opened with image_open(). Any context running the program in it needs to be released
+ * first. */
+void image_close (VMImage *image);
+
+/* Write the provided program out as a bytecode image in the file given, replacing the file if it exists.
+ * The program is verified first, and the image records if it passed.
+ *
+ * Returns 1 if the image was written or 0 (after filling out error, if it's not NULL) if not. */
+int image_write (const char *path, const int *program, int programLength, ImageError *error);
+
+/* Convert the reason that an image could not be read or written into a human readable string. */
+const char *image_error_reason (ImageError error);
+
+/***********************************************************************************************************/
+
+#endif
@@ -0,0 +1,701 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include "jit.h"
+
+#if VM_HAVE_JIT
+#include <sys/mman.h>
+#endif
+
+/***********************************************************************************************************/
+
+#if VM_HAVE_JIT
+
+/* This is a template JIT; every instruction is turned into the same fixed sequence of x86-64 code every time,
+ * with its operands filled in. While the compiled code runs it keeps its state in machine registers:
+ *
+ *     rbx:      The VMContext being run.
+ *     r9:       The address of the item at the top of the stack (&stack[sp]).
+ *     r10d:     The value of the item at the top of the stack. Every push also stores the value in the
+ *               stack itself, so the stack in the context is always up to date and only sp needs to be
+ *               worked out when the code stops.
+ *     r12d-r15d, ebp, r11d: The registers, REG_A through REG_F.
+ *     r8:       What is left of the budget. The address to store it back to is kept on the machine stack.
+ *
+ * With the stack empty, r9 points at the slot before the stack and r10d holds whatever is there; nothing
+ * uses the value until something is pushed. The stack is wherever the context says it is and can be any
+ * size, so the addresses that the stack checks compare r9 against are worked out on the way in and kept on
+ * the machine stack as well.
+ *
+ * Everything that the native code doesn't do itself (a HALT, an IHALT, an opcode it doesn't know or an
+ * instruction that finds a stack error) stops the compiled code with the index of the instruction, and the
+ * interpreter carries on from there. Since nothing has been done for the instruction yet, the interpreter
+ * does exactly what it would have done if it had been running all along. */
+
+/* The machine registers, by the number that the instruction encoding uses for them. */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/* Where the compiled code keeps the context, the stack pointer and the top of the stack. */
+#define JIT_CONTEXT RBX
+#define JIT_SP      R9
+#define JIT_TOS     R10
+#define JIT_BUDGET  R8
+
+/* The machine register that holds each VM register. */
+static const int jitRegisters[REGISTER_COUNT] = { R12, R13, R14, R15, RBP, R11 };
+
+/* The condition codes used in conditional jumps. */
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_L  0xC
+#define CC_LE 0xE
+
+/* The most code that a single instruction can compile to, in bytes, and the size of the code that enters
+ * and leaves the compiled program. These are generous; running out of room fails the compile. */
+#define JIT_MAX_INSTRUCTION 112
+#define JIT_MAX_OVERHEAD    384
+
+/* The offsets of the parts of the context that the compiled code uses. */
+#define CTX_STACK      ((int) offsetof (VMContext, stack))
+#define CTX_STACK_SIZE ((int) offsetof (VMContext, stackSize))
+#define CTX_SP         ((int) offsetof (VMContext, sp))
+#define CTX_REGISTERS  ((int) offsetof (VMContext, registers))
+#define CTX_TRACE      ((int) offsetof (VMContext, traceLevel))
+
+/* What the compiled code keeps on the machine stack, by offset from rsp: the address of the budget, and the
+ * values that r9 has when the stack is empty, when it holds one item and when it is full. The last slot is
+ * padding, which keeps the machine stack aligned for calls. */
+#define FRAME_BUDGET 0
+#define FRAME_EMPTY  8
+#define FRAME_BOTTOM 16
+#define FRAME_FULL   24
+#define FRAME_SIZE   40
+
+/***********************************************************************************************************/
+
+/* A 32 bit relative jump that needs to be pointed at its destination once all of the code exists. */
+typedef struct
+{
+    /* The offset of the 32 bit displacement in the code. */
+    int at;
+
+    /* The instruction that the jump goes to, and whether it goes to the code for that instruction or to the
+     * code that stops at it. */
+    int index;
+    int exit;
+} JitFixup;
+
+/* The state of a compile in progress. */
+typedef struct
+{
+    /* The code generated so far. */
+    unsigned char *code;
+    size_t size;
+    size_t capacity;
+
+    /* The jumps that still need to be resolved. */
+    JitFixup *fixups;
+    int fixupCount;
+} JitBuffer;
+
+/***********************************************************************************************************/
+
+/* Add a byte of code. Running out of room is caught after each instruction, so this never writes past the
+ * end of the buffer but doesn't complain either. */
+static void emit_byte (JitBuffer *buffer, int value)
+{
+    if (buffer->size < buffer->capacity)
+        buffer->code[buffer->size] = (unsigned char) value;
+
+    buffer->size++;
+}
+
+/***********************************************************************************************************/
+
+/* Add a 32 bit value to the code. */
+static void emit_int (JitBuffer *buffer, int value)
+{
+    unsigned int bits = (unsigned int) value;
+
+    emit_byte (buffer, bits & 0xFF);
+    emit_byte (buffer, (bits >> 8) & 0xFF);
+    emit_byte (buffer, (bits >> 16) & 0xFF);
+    emit_byte (buffer, (bits >> 24) & 0xFF);
+}
+
+/***********************************************************************************************************/
+
+/* Add the REX prefix for an instruction whose ModRM byte uses the registers provided, if it needs one. wide
+ * is true for instructions that work on 64 bits. */
+static void emit_rex (JitBuffer *buffer, int wide, int reg, int rm)
+{
+    int rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+
+    if (rex != 0x40)
+        emit_byte (buffer, rex);
+}
+
+/***********************************************************************************************************/
+
+/* Add an instruction that works on two registers; rm is the destination for most instructions. */
+static void emit_rr (JitBuffer *buffer, int wide, int opcode, int reg, int rm)
+{
+    emit_rex (buffer, wide, reg, rm);
+    emit_byte (buffer, opcode);
+    emit_byte (buffer, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/***********************************************************************************************************/
+
+/* Add an instruction that works on a register and the memory at base + disp. */
+static void emit_rm (JitBuffer *buffer, int wide, int opcode, int reg, int base, int disp)
+{
+    emit_rex (buffer, wide, reg, base);
+    emit_byte (buffer, opcode);
+    emit_byte (buffer, 0x80 | ((reg & 7) << 3) | (base & 7));
+
+    /* Addressing off of rsp or r12 needs a SIB byte. */
+    if ((base & 7) == RSP)
+        emit_byte (buffer, 0x24);
+
+    emit_int (buffer, disp);
+}
+
+/***********************************************************************************************************/
+
+/* Add "lea dest, [base + index * 4 + disp]" for 64 bit registers. */
+static void emit_lea_scaled (JitBuffer *buffer, int dest, int base, int index, int disp)
+{
+    emit_byte (buffer, 0x48 | ((dest & 8) ? 0x04 : 0) | ((index & 8) ? 0x02 : 0) | ((base & 8) ? 0x01 : 0));
+    emit_byte (buffer, 0x8D);
+    emit_byte (buffer, 0x80 | ((dest & 7) << 3) | RSP);
+    emit_byte (buffer, 0x80 | ((index & 7) << 3) | (base & 7));
+    emit_int (buffer, disp);
+}
+
+/***********************************************************************************************************/
+
+/* Add "op reg, imm32" for one of the group 1 arithmetic instructions (add is 0, sub is 5). */
+static void emit_ri (JitBuffer *buffer, int wide, int operation, int reg, int value)
+{
+    emit_rex (buffer, wide, 0, reg);
+    emit_byte (buffer, 0x81);
+    emit_byte (buffer, 0xC0 | (operation << 3) | (reg & 7));
+    emit_int (buffer, value);
+}
+
+/***********************************************************************************************************/
+
+/* Add "mov reg32, imm32". */
+static void emit_mov_imm (JitBuffer *buffer, int reg, int value)
+{
+    emit_rex (buffer, 0, 0, reg);
+    emit_byte (buffer, 0xB8 + (reg & 7));
+    emit_int (buffer, value);
+}
+
+/***********************************************************************************************************/
+
+/* Add "push reg" or "pop reg" for a 64 bit register. */
+static void emit_push (JitBuffer *buffer, int reg)
+{
+    emit_rex (buffer, 0, 0, reg);
+    emit_byte (buffer, 0x50 + (reg & 7));
+}
+
+static void emit_pop (JitBuffer *buffer, int reg)
+{
+    emit_rex (buffer, 0, 0, reg);
+    emit_byte (buffer, 0x58 + (reg & 7));
+}
+
+/***********************************************************************************************************/
+
+/* Add a jump (or a conditional jump, if condition is not -1) to the code for the instruction with the index
+ * provided, or to the code that stops at it if exit is true. The destination is filled in later. */
+static void emit_jump (JitBuffer *buffer, int condition, int index, int exit)
+{
+    JitFixup *fixup = &buffer->fixups[buffer->fixupCount++];
+
+    if (condition == -1)
+        emit_byte (buffer, 0xE9);
+    else
+    {
+        emit_byte (buffer, 0x0F);
+        emit_byte (buffer, 0x80 | condition);
+    }
+
+    fixup->at = (int) buffer->size;
+    fixup->index = index;
+    fixup->exit = exit;
+    emit_int (buffer, 0);
+}
+
+/***********************************************************************************************************/
+
+/* Add code that stops at the instruction with the index provided if the stack pointer compares with the
+ * address in the slot of the machine stack given (one of the FRAME_ offsets), using the condition provided
+ * to compare them. */
+static void emit_stack_check (JitBuffer *buffer, int condition, int slot, int index)
+{
+    emit_rm (buffer, 1, 0x3B, JIT_SP, RSP, slot);               /* cmp r9, [rsp + slot] */
+    emit_jump (buffer, condition, index, 1);
+}
+
+/***********************************************************************************************************/
+
+/* Add code that calls one of the functions that displays the result of an operation, passing the context
+ * and up to two more arguments. The first argument is an immediate if reg is -1; the second is always the
+ * value of the top of the stack. The call is skipped when the context isn't tracing operations. */
+static void emit_output (JitBuffer *buffer, void (*function) (void), int reg, int arguments)
+{
+#if VM_TRACE_ENABLED
+    size_t skip;
+    unsigned long long address = (unsigned long long) (size_t) function;
+    int i;
+
+    /* cmp dword [context + traceLevel], VM_TRACE_OPS; jl over the call */
+    emit_byte (buffer, 0x83);
+    emit_byte (buffer, 0x80 | (7 << 3) | JIT_CONTEXT);
+    emit_int (buffer, CTX_TRACE);
+    emit_byte (buffer, VM_TRACE_OPS);
+    emit_byte (buffer, 0x70 | CC_L);
+    emit_byte (buffer, 0);
+    skip = buffer->size;
+
+    /* The stack state, the budget and REG_F are in registers that the call can change; there are four of
+     * them, which keeps the machine stack aligned. */
+    emit_push (buffer, JIT_SP);
+    emit_push (buffer, JIT_TOS);
+    emit_push (buffer, R11);
+    emit_push (buffer, JIT_BUDGET);
+
+    emit_rr (buffer, 1, 0x89, JIT_CONTEXT, RDI);                /* mov rdi, rbx */
+    if (arguments == 1)
+        emit_rr (buffer, 0, 0x89, JIT_TOS, RSI);                /* mov esi, r10d */
+    else
+    {
+        emit_mov_imm (buffer, RSI, reg);                        /* mov esi, reg */
+        emit_rr (buffer, 0, 0x89, JIT_TOS, RDX);                /* mov edx, r10d */
+    }
+
+    /* mov rax, function; call rax */
+    emit_byte (buffer, 0x48);
+    emit_byte (buffer, 0xB8);
+    for (i = 0 ; i < 8 ; i++)
+        emit_byte (buffer, (int) ((address >> (i * 8)) & 0xFF));
+    emit_byte (buffer, 0xFF);
+    emit_byte (buffer, 0xD0);
+
+    emit_pop (buffer, JIT_BUDGET);
+    emit_pop (buffer, R11);
+    emit_pop (buffer, JIT_TOS);
+    emit_pop (buffer, JIT_SP);
+
+    if (buffer->size <= buffer->capacity)
+        buffer->code[skip - 1] = (unsigned char) (buffer->size - skip);
+#else
+    (void) buffer;
+    (void) function;
+    (void) reg;
+    (void) arguments;
+#endif
+}
+
+/***********************************************************************************************************/
+
+/* Add the code for a jump backwards to the instruction at target that is taken when the last comparison
+ * meets the condition provided (or always, if condition is -1), charging the budget for the loop of the
+ * given size that it closes. */
+static void emit_budget_check (JitBuffer *buffer, int condition, int size, int target)
+{
+    size_t skip = 0;
+
+    /* Jump over the jump when the condition isn't met; the opposite condition is the next one up or down. */
+    if (condition != -1)
+    {
+        emit_byte (buffer, 0x70 | (condition ^ 1));
+        emit_byte (buffer, 0);
+        skip = buffer->size;
+    }
+
+    emit_ri (buffer, 1, 5, JIT_BUDGET, size);                   /* sub r8, size */
+    emit_jump (buffer, CC_LE, target, 1);
+    emit_jump (buffer, -1, target, 0);
+
+    if (condition != -1 && buffer->size <= buffer->capacity)
+        buffer->code[skip - 1] = (unsigned char) (buffer->size - skip);
+}
+
+/***********************************************************************************************************/
+
+/* Add the code for a jump instruction, which is at the index provided, that is taken when the last comparison
+ * meets the condition provided (or always, if condition is -1). A jump backwards closes a loop, which is
+ * charged to the budget; when that runs out, stop at the instruction that the jump lands on. */
+static void emit_branch (JitBuffer *buffer, int condition, const Instruction *instruction, int index)
+{
+    if (instruction->target <= index)
+        emit_budget_check (buffer, condition, index - instruction->target + 1, instruction->target);
+    else
+        emit_jump (buffer, condition, instruction->target, 0);
+}
+
+/***********************************************************************************************************/
+
+/* Add code that sets the VM register dest to the VM register source with an immediate added to it (or with
+ * the VM register in other added or subtracted, if other isn't -1). The group 1 operation given (add is 0,
+ * sub is 5) says which. */
+static void emit_arithmetic (JitBuffer *buffer, int operation, int dest, int source, int other, int value)
+{
+    int out = jitRegisters[dest];
+
+    /* If the destination is the register being added or subtracted, it's worked out somewhere else. */
+    if (other == dest && source != dest)
+        out = RAX;
+
+    if (jitRegisters[source] != out)
+        emit_rr (buffer, 0, 0x89, jitRegisters[source], out);  /* mov out, source */
+
+    if (other != -1)
+        emit_rr (buffer, 0, operation << 3 | 0x01, jitRegisters[other], out);
+    else
+        emit_ri (buffer, 0, operation, out, value);
+
+    if (out != jitRegisters[dest])
+        emit_rr (buffer, 0, 0x89, out, jitRegisters[dest]);    /* mov dest, out */
+}
+
+/***********************************************************************************************************/
+
+/* Add code that removes the top item from the stack, loading the item under it into the top of stack
+ * register. */
+static void emit_drop (JitBuffer *buffer)
+{
+    emit_ri (buffer, 1, 5, JIT_SP, 4);                          /* sub r9, 4 */
+    emit_rm (buffer, 0, 0x8B, JIT_TOS, JIT_SP, 0);              /* mov r10d, [r9] */
+}
+
+/***********************************************************************************************************/
+
+/* Add the code for a single decoded instruction, which is at the index provided. */
+static void emit_instruction (JitBuffer *buffer, const Instruction *instruction, int index)
+{
+    /* Instructions whose operation is not the plain one for their opcode have been proven not to need to
+     * check the stack (superinstructions are only made from those). */
+    int checked = instruction->operation == (Operation) instruction->opcode;
+    const int *parameters = instruction->parameters;
+
+    switch (instruction->opcode)
+    {
+        case NOP:
+            break;
+
+        case PUSH:
+            if (checked)
+                emit_stack_check (buffer, CC_E, FRAME_FULL, index);
+            emit_ri (buffer, 1, 0, JIT_SP, 4);                  /* add r9, 4 */
+            emit_mov_imm (buffer, JIT_TOS, parameters[0]);      /* mov r10d, value */
+            emit_rm (buffer, 0, 0x89, JIT_TOS, JIT_SP, 0);      /* mov [r9], r10d */
+            break;
+
+        case POP:
+            if (checked)
+                emit_stack_check (buffer, CC_E, FRAME_EMPTY, index);
+            emit_output (buffer, (void (*) (void)) vm_output_pop, -1, 1);
+            emit_drop (buffer);
+            break;
+
+        case SET:
+            if (checked)
+                emit_stack_check (buffer, CC_E, FRAME_EMPTY, index);
+            emit_rr (buffer, 0, 0x89, JIT_TOS, jitRegisters[parameters[0]]);
+            emit_output (buffer, (void (*) (void)) vm_output_set, parameters[0], 2);
+            emit_drop (buffer);
+            break;
+
+        case ADD:
+            /* This needs two items, so the top can't be the first slot. */
+            if (checked)
+                emit_stack_check (buffer, CC_BE, FRAME_BOTTOM, index);
+            emit_ri (buffer, 1, 5, JIT_SP, 4);                  /* sub r9, 4 */
+            emit_rm (buffer, 0, 0x03, JIT_TOS, JIT_SP, 0);      /* add r10d, [r9] */
+            emit_rm (buffer, 0, 0x89, JIT_TOS, JIT_SP, 0);      /* mov [r9], r10d */
+            break;
+
+        case RADD:
+            if (checked)
+                emit_stack_check (buffer, CC_E, FRAME_FULL, index);
+            emit_rr (buffer, 0, 0x89, jitRegisters[parameters[0]], JIT_TOS);
+            emit_rr (buffer, 0, 0x01, jitRegisters[parameters[1]], JIT_TOS);
+            emit_ri (buffer, 1, 0, JIT_SP, 4);                  /* add r9, 4 */
+            emit_rm (buffer, 0, 0x89, JIT_TOS, JIT_SP, 0);      /* mov [r9], r10d */
+            break;
+
+        case RDEC:
+            /* dec reg */
+            emit_rex (buffer, 0, 0, jitRegisters[parameters[0]]);
+            emit_byte (buffer, 0xFF);
+            emit_byte (buffer, 0xC8 | (jitRegisters[parameters[0]] & 7));
+            break;
+
+        case RJNE:
+            if (checked)
+                emit_stack_check (buffer, CC_E, FRAME_EMPTY, index);
+            emit_rr (buffer, 0, 0x39, JIT_TOS, jitRegisters[parameters[0]]);
+            emit_branch (buffer, CC_NE, instruction, index);
+            break;
+
+        case RMOV:
+            if (parameters[0] != parameters[1])
+                emit_rr (buffer, 0, 0x89, jitRegisters[parameters[1]], jitRegisters[parameters[0]]);
+            break;
+
+        case RMOVI:
+            emit_mov_imm (buffer, jitRegisters[parameters[0]], parameters[1]);
+            break;
+
+        case RADDR:
+            emit_arithmetic (buffer, 0, parameters[0], parameters[1], parameters[2], 0);
+            break;
+
+        case RSUBR:
+            emit_arithmetic (buffer, 5, parameters[0], parameters[1], parameters[2], 0);
+            break;
+
+        case RADDI:
+            emit_arithmetic (buffer, 0, parameters[0], parameters[1], -1, parameters[2]);
+            break;
+
+        case RSUBI:
+            emit_arithmetic (buffer, 5, parameters[0], parameters[1], -1, parameters[2]);
+            break;
+
+        case RINC:
+            /* inc reg */
+            emit_rex (buffer, 0, 0, jitRegisters[parameters[0]]);
+            emit_byte (buffer, 0xFF);
+            emit_byte (buffer, 0xC0 | (jitRegisters[parameters[0]] & 7));
+            break;
+
+        /* cmp reg, imm (the group 1 compare is 7) or cmp reg, reg, and then the jump. */
+        case RJNEI:
+        case RJEQI:
+        case RJLTI:
+            emit_ri (buffer, 0, 7, jitRegisters[parameters[0]], parameters[1]);
+            emit_branch (buffer, instruction->opcode == RJNEI ? CC_NE :
+                                 instruction->opcode == RJEQI ? CC_E : CC_L, instruction, index);
+            break;
+
+        case RJNER:
+        case RJEQR:
+        case RJLTR:
+            emit_rr (buffer, 0, 0x39, jitRegisters[parameters[1]], jitRegisters[parameters[0]]);
+            emit_branch (buffer, instruction->opcode == RJNER ? CC_NE :
+                                 instruction->opcode == RJEQR ? CC_E : CC_L, instruction, index);
+            break;
+
+        case JMP:
+            emit_branch (buffer, -1, instruction, index);
+            break;
+
+        /* HALT, IHALT and anything else is left to the interpreter. */
+        default:
+            emit_jump (buffer, -1, index, 1);
+            break;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Compile a decoded program into native code. */
+JitCode *jit_compile (const Instruction *code, int codeSize)
+{
+    JitBuffer buffer;
+    JitCode *jit;
+    size_t page = (size_t) sysconf (_SC_PAGESIZE);
+    int *exits, exitCode, i;
+
+    jit = calloc (1, sizeof (JitCode));
+    exits = malloc (sizeof (int) * codeSize);
+    buffer.fixups = malloc (sizeof (JitFixup) * codeSize * 3);
+    if (jit == NULL || exits == NULL || buffer.fixups == NULL)
+        goto failed;
+
+    jit->offsets = malloc (sizeof (int) * codeSize);
+    jit->size = ((size_t) codeSize * JIT_MAX_INSTRUCTION + JIT_MAX_OVERHEAD + page - 1) / page * page;
+    jit->memory = mmap (NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->offsets == NULL || jit->memory == MAP_FAILED)
+    {
+        if (jit->memory == MAP_FAILED)
+            jit->memory = NULL;
+        goto failed;
+    }
+
+    buffer.code = jit->memory;
+    buffer.size = 0;
+    buffer.capacity = jit->size;
+    buffer.fixupCount = 0;
+
+    /* On the way in, save the registers that the C calling convention wants preserved and make room for what
+     * is kept on the machine stack, starting with the address of the budget (the third argument). Then load
+     * up the budget and the state of the context, work out where the stack is, and jump to the instruction to
+     * start at, which is the second argument. */
+    emit_push (&buffer, RBX);
+    emit_push (&buffer, RBP);
+    emit_push (&buffer, R12);
+    emit_push (&buffer, R13);
+    emit_push (&buffer, R14);
+    emit_push (&buffer, R15);
+    emit_ri (&buffer, 1, 5, RSP, FRAME_SIZE);                   /* sub rsp, FRAME_SIZE */
+    emit_rr (&buffer, 1, 0x89, RDI, JIT_CONTEXT);               /* mov rbx, rdi */
+    emit_rm (&buffer, 1, 0x89, RDX, RSP, FRAME_BUDGET);         /* mov [rsp], rdx */
+    emit_rm (&buffer, 1, 0x8B, JIT_BUDGET, RDX, 0);             /* mov r8, [rdx] */
+
+    for (i = 0 ; i < REGISTER_COUNT ; i++)
+        emit_rm (&buffer, 0, 0x8B, jitRegisters[i], JIT_CONTEXT, CTX_REGISTERS + i * 4);
+
+    emit_rm (&buffer, 1, 0x8B, RAX, JIT_CONTEXT, CTX_STACK);    /* mov rax, [context + stack] */
+    emit_rm (&buffer, 1, 0x89, RAX, RSP, FRAME_BOTTOM);         /* mov [rsp + bottom], rax */
+    emit_rm (&buffer, 1, 0x8D, RCX, RAX, -4);                   /* lea rcx, [rax - 4] */
+    emit_rm (&buffer, 1, 0x89, RCX, RSP, FRAME_EMPTY);          /* mov [rsp + empty], rcx */
+    emit_rm (&buffer, 1, 0x63, RCX, JIT_CONTEXT, CTX_STACK_SIZE); /* movsxd rcx, [context + stackSize] */
+    emit_lea_scaled (&buffer, RCX, RAX, RCX, -4);               /* lea rcx, [rax + rcx * 4 - 4] */
+    emit_rm (&buffer, 1, 0x89, RCX, RSP, FRAME_FULL);           /* mov [rsp + full], rcx */
+
+    emit_rm (&buffer, 1, 0x63, RCX, JIT_CONTEXT, CTX_SP);       /* movsxd rcx, [context + sp] */
+    emit_lea_scaled (&buffer, JIT_SP, RAX, RCX, 0);             /* lea r9, [rax + rcx * 4] */
+    emit_rm (&buffer, 0, 0x8B, JIT_TOS, JIT_SP, 0);             /* mov r10d, [r9] */
+
+    emit_byte (&buffer, 0xFF);                                  /* jmp rsi */
+    emit_byte (&buffer, 0xE6);
+
+    /* The program itself. */
+    for (i = 0 ; i < codeSize ; i++)
+    {
+        jit->offsets[i] = (int) buffer.size;
+        emit_instruction (&buffer, &code[i], i);
+
+        if (buffer.size > buffer.capacity)
+            goto failed;
+    }
+
+    /* On the way out, store the budget and the state back into the context and return the index in eax. */
+    exitCode = (int) buffer.size;
+    emit_rm (&buffer, 1, 0x8B, RDX, RSP, FRAME_BUDGET);         /* mov rdx, [rsp] */
+    emit_rm (&buffer, 1, 0x89, JIT_BUDGET, RDX, 0);             /* mov [rdx], r8 */
+    for (i = 0 ; i < REGISTER_COUNT ; i++)
+        emit_rm (&buffer, 0, 0x89, jitRegisters[i], JIT_CONTEXT, CTX_REGISTERS + i * 4);
+
+    emit_rr (&buffer, 1, 0x89, JIT_SP, RCX);                    /* mov rcx, r9 */
+    emit_rm (&buffer, 1, 0x2B, RCX, RSP, FRAME_BOTTOM);         /* sub rcx, [rsp + bottom] */
+    emit_byte (&buffer, 0x48);                                  /* sar rcx, 2 */
+    emit_byte (&buffer, 0xC1);
+    emit_byte (&buffer, 0xF9);
+    emit_byte (&buffer, 2);
+    emit_rm (&buffer, 0, 0x89, RCX, JIT_CONTEXT, CTX_SP);       /* mov [context + sp], ecx */
+
+    emit_ri (&buffer, 1, 0, RSP, FRAME_SIZE);                   /* add rsp, FRAME_SIZE */
+    emit_pop (&buffer, R15);
+    emit_pop (&buffer, R14);
+    emit_pop (&buffer, R13);
+    emit_pop (&buffer, R12);
+    emit_pop (&buffer, RBP);
+    emit_pop (&buffer, RBX);
+    emit_byte (&buffer, 0xC3);                                  /* ret */
+
+    /* Stopping at each instruction just needs to say which one it is. */
+    for (i = 0 ; i < codeSize ; i++)
+    {
+        exits[i] = (int) buffer.size;
+        emit_mov_imm (&buffer, RAX, i);
+        emit_byte (&buffer, 0xE9);
+        emit_int (&buffer, exitCode - (int) (buffer.size + 4));
+
+        if (buffer.size > buffer.capacity)
+            goto failed;
+    }
+
+    /* Now that everything has a place, point all of the jumps at it. */
+    for (i = 0 ; i < buffer.fixupCount ; i++)
+    {
+        JitFixup *fixup = &buffer.fixups[i];
+        int to = fixup->exit ? exits[fixup->index] : jit->offsets[fixup->index];
+        int displacement = to - (fixup->at + 4);
+
+        memcpy (buffer.code + fixup->at, &displacement, sizeof (int));
+    }
+
+    /* The code never changes again, so it doesn't need to be writable while it's executable. */
+    if (mprotect (jit->memory, jit->size, PROT_READ | PROT_EXEC) != 0)
+        goto failed;
+
+    free (exits);
+    free (buffer.fixups);
+    return jit;
+
+failed:
+    free (exits);
+    free (buffer.fixups);
+    jit_release (jit);
+    return NULL;
+}
+
+/***********************************************************************************************************/
+
+/* Run the compiled program in the provided context from the instruction with the index provided. */
+int jit_run (JitCode *jit, VMContext *context, int pc, long long *budget)
+{
+    int (*entry) (VMContext *, void *, long long *);
+
+    entry = (int (*) (VMContext *, void *, long long *)) (void *) jit->memory;
+    return entry (context, jit->memory + jit->offsets[pc], budget);
+}
+
+/***********************************************************************************************************/
+
+/* Release the compiled program. */
+void jit_release (JitCode *jit)
+{
+    if (jit == NULL)
+        return;
+
+    if (jit->memory != NULL)
+        munmap (jit->memory, jit->size);
+
+    free (jit->offsets);
+    free (jit);
+}
+
+#else
+
+/***********************************************************************************************************/
+
+/* Without the JIT there is never anything to run, so everything is left to the interpreter. */
+JitCode *jit_compile (const Instruction *code, int codeSize)
+{
+    (void) code;
+    (void) codeSize;
+
+    return NULL;
+}
+
+int jit_run (JitCode *jit, VMContext *context, int pc, long long *budget)
+{
+    (void) jit;
+    (void) context;
+    (void) budget;
+
+    return pc;
+}
+
+void jit_release (JitCode *jit)
+{
+    (void) jit;
+}
+
+#endif
+
+/***********************************************************************************************************/
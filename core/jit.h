@@ -0,0 +1,50 @@
+#ifndef __JITdotH__
+#define __JITdotH__
+
+/***********************************************************************************************************/
+
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* A decoded program that has been compiled to native code. */
+typedef struct JitCode
+{
+    /* The executable memory that holds the compiled program, and how big it is. */
+    unsigned char *memory;
+    size_t size;
+
+    /* The offset in memory of the code for each instruction in the decoded program. */
+    int *offsets;
+} JitCode;
+
+/***********************************************************************************************************/
+
+/* Compile a decoded program into native code. Every instruction in the decoded program is compiled, so that
+ * the compiled code can be started at any of them.
+ *
+ * The compiled code works directly on a VMContext: the registers and the item at the top of the stack are
+ * kept in machine registers while it runs and stored back to the context when it stops, so the context is
+ * left exactly the way that the interpreter would leave it at the same point. Instructions that use the
+ * stack check it unless their operation shows that the check is not needed (see analyze_stack()), so the
+ * compiled code is only valid until the operations in the program change.
+ *
+ * The return value is NULL if the JIT is not available (see VM_HAVE_JIT) or there was not enough memory. */
+JitCode *jit_compile (const Instruction *code, int codeSize);
+
+/* Run the compiled program in the provided context, starting at the instruction with index pc in the decoded
+ * program, until it gets to an instruction that the native code doesn't carry out itself or uses up the
+ * budget, which is charged the same way that vm_run_for() charges it and updated with what is left.
+ *
+ * The instructions left to the interpreter include HALT and IHALT, any opcode that the JIT doesn't know and
+ * any instruction that would cause a stack error, so the return value is the index of the instruction that
+ * the interpreter should carry on from; the context is in the state that the interpreter expects it to be
+ * in to do that. */
+int jit_run (JitCode *jit, VMContext *context, int pc, long long *budget);
+
+/* Release the compiled program. It's safe to pass NULL. */
+void jit_release (JitCode *jit);
+
+/***********************************************************************************************************/
+
+#endif
@@ -0,0 +1,225 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include "opcodes.h"
+
+/***********************************************************************************************************/
+
+/* Convert an opcode into a textual name. */
+const char *opcode_name (Opcode opcode)
+{
+    switch (opcode)
+    {
+        case NOP:   return "NOP";
+        case PUSH:  return "PUSH";
+        case POP:   return "POP";
+        case SET:   return "SET";
+        case ADD:   return "ADD";
+        case RADD:  return "RADD";
+        case RDEC:  return "RDEC";
+        case RJNE:  return "RJNE";
+        case HALT:  return "HALT";
+        case IHALT: return "IHALT";
+        case RMOV:  return "RMOV";
+        case RMOVI: return "RMOVI";
+        case RADDR: return "RADDR";
+        case RSUBR: return "RSUBR";
+        case RADDI: return "RADDI";
+        case RSUBI: return "RSUBI";
+        case RINC:  return "RINC";
+        case RJNEI: return "RJNEI";
+        case RJEQI: return "RJEQI";
+        case RJLTI: return "RJLTI";
+        case RJNER: return "RJNER";
+        case RJEQR: return "RJEQR";
+        case RJLTR: return "RJLTR";
+        case JMP:   return "JMP";
+        case CALL:  return "CALL";
+    }
+
+    /* This isn't a default case so that we can determine when we forgot to modify this switch. */
+    return "???";
+}
+
+/***********************************************************************************************************/
+
+/* Obtain the number of operands an opcode expects. */
+int opcode_operand_count (Opcode opcode)
+{
+    switch (opcode)
+    {
+        /* Need a value to push. */
+        case PUSH:
+            return 1;
+
+        /* Need the register to set. */
+        case SET:
+            return 1;
+
+        /* Need two registers to add. */
+        case RADD:
+            return 2;
+
+        /* Needs the register to decrement. */
+        case RDEC:
+            return 1;
+
+        /* Requires a register and a jump offset. */
+        case RJNE:
+            return 2;
+
+        /* Need the register to set and where to set it from. */
+        case RMOV:
+        case RMOVI:
+            return 2;
+
+        /* Need the register to set and the two things to combine. */
+        case RADDR:
+        case RSUBR:
+        case RADDI:
+        case RSUBI:
+            return 3;
+
+        /* Needs the register to increment. */
+        case RINC:
+            return 1;
+
+        /* Require a register, what to compare it with and a jump offset. */
+        case RJNEI:
+        case RJEQI:
+        case RJLTI:
+        case RJNER:
+        case RJEQR:
+        case RJLTR:
+            return 3;
+
+        /* Requires a jump offset. */
+        case JMP:
+            return 1;
+
+        /* Needs the host function to call. */
+        case CALL:
+            return 1;
+
+        /* These operate on the stack or otherwise do not require parameters. */
+        case NOP:
+        case POP:
+        case ADD:
+        case HALT:
+            return 0;
+
+        /* The IHALT instruction actually takes 1 or more arguments, but it's not allowed to appear in user
+         * programs, so as far as this is concerned, it takes none. This allows for us to detect that it
+         * exists in the program stream and flag it as an error without having to fiddle with worrying if it
+         * has enough parameters. */
+        case IHALT:
+            return 0;
+    }
+
+    /* Because the compiler is kind of stupid. */
+    return 0;
+}
+
+/***********************************************************************************************************/
+
+/* Obtain the operand mask for an opcode. This is a simple string that contains one character for each of the
+ * operands, where each character is laid out as follows:
+ *     i: an integer number
+ *     r: a register
+ *     j: a jump offset, which is an integer number that is always the last operand
+ *
+ * This is used by the trace functionality to display operands properly. */
+const char *opcode_operand_mask (Opcode opcode)
+{
+    switch (opcode)
+    {
+        /* Need a value to push. */
+        case PUSH:
+            return "i";
+
+        /* Need the register to set. */
+        case SET:
+            return "r";
+
+        /* Need two registers to add. */
+        case RADD:
+            return "rr";
+
+        /* Needs the register to decrement. */
+        case RDEC:
+            return "r";
+
+        /* Requires a register and a jump offset. */
+        case RJNE:
+            return "rj";
+
+        /* Need the register to set and where to set it from. */
+        case RMOV:
+            return "rr";
+
+        case RMOVI:
+            return "ri";
+
+        /* Need the register to set and the two things to combine. */
+        case RADDR:
+        case RSUBR:
+            return "rrr";
+
+        case RADDI:
+        case RSUBI:
+            return "rri";
+
+        /* Needs the register to increment. */
+        case RINC:
+            return "r";
+
+        /* Require a register, what to compare it with and a jump offset. */
+        case RJNEI:
+        case RJEQI:
+        case RJLTI:
+            return "rij";
+
+        case RJNER:
+        case RJEQR:
+        case RJLTR:
+            return "rrj";
+
+        /* Requires a jump offset. */
+        case JMP:
+            return "j";
+
+        /* Needs the host function to call. */
+        case CALL:
+            return "i";
+
+        /* These operate on the stack or otherwise do not require parameters. */
+        case NOP:
+        case POP:
+        case ADD:
+        case HALT:
+            return "";
+
+        /* The IHALT instruction actually takes 1 or more arguments, but it's not allowed to appear in user
+         * programs, so as far as this is concerned, it takes none. This allows for us to detect that it
+         * exists in the program stream and flag it as an error without having to fiddle with worrying if it
+         * has enough parameters. */
+        case IHALT:
+            return "";
+    }
+
+    /* Because the compiler is kind of stupid. */
+    return "";
+}
+
+/***********************************************************************************************************/
+
+/* Determine if an opcode is a jump. */
+int opcode_is_jump (Opcode opcode)
+{
+    const char *mask = opcode_operand_mask (opcode);
+    int count = opcode_operand_count (opcode);
+
+    return count > 0 && mask[count - 1] == 'j';
+}
+
+/***********************************************************************************************************/
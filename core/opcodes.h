@@ -46,8 +46,73 @@ typedef enum
     /* Halt program execution. This is used by the interpreter internally to signal that the program
      * provided did not have its own halt statement. */
     IHALT,
+
+    /* The register forms. These work on registers and immediate values directly instead of going through
+     * the stack, which never changes. They come after the opcodes above so that the values of those (which
+     * are stored in bytecode images, recordings and compact programs) stay the same. */
+
+    /* Copy the register in the second operand into the register in the first. */
+    RMOV,
+
+    /* Set the register in the first operand to the value in the second. */
+    RMOVI,
+
+    /* Set the register in the first operand to the result of adding or subtracting the registers in the
+     * second and third operands (the third is subtracted from the second). */
+    RADDR,
+    RSUBR,
+
+    /* Set the register in the first operand to the result of adding the value in the third operand to the
+     * register in the second, or subtracting it from it. */
+    RADDI,
+    RSUBI,
+
+    /* Increment the register in the first operand. */
+    RINC,
+
+    /* Compare and branch. The first operand is a register, which is compared with the value (for the I
+     * forms) or the register (for the R forms) in the second, and if the comparison is true the IP is jumped
+     * by the offset in the third, the same way that it is for RJNE. The comparisons are not equal, equal and
+     * less than; the register in the first operand is the one on the left. */
+    RJNEI,
+    RJEQI,
+    RJLTI,
+    RJNER,
+    RJEQR,
+    RJLTR,
+
+    /* Always jump the IP by the offset in the operand, the same way that it is for RJNE. */
+    JMP,
+
+    /* Call the host function with the index in the operand, from the table that the host gave the context
+     * with ctx_host(). The function can look at and change the registers and the stack, and can suspend the
+     * program until the host resumes it, such as while the host waits for I/O on its behalf. */
+    CALL,
 } Opcode;
 
+/* The number of opcodes; every value below this is an opcode. */
+#define OPCODE_COUNT (CALL + 1)
+
+/***********************************************************************************************************/
+
+/* Convert an opcode into a textual name. */
+const char *opcode_name (Opcode opcode);
+
+/* Obtain the number of operands an opcode expects. */
+int opcode_operand_count (Opcode opcode);
+
+/* Obtain the operand mask for an opcode. This is a simple string that contains one character for each of the
+ * operands, where each character is laid out as follows:
+ *     i: an integer number
+ *     r: a register
+ *     j: a jump offset, which is an integer number that is always the last operand
+ *
+ * This is used by the trace functionality to display operands properly. */
+const char *opcode_operand_mask (Opcode opcode);
+
+/* Determine if an opcode is a jump, which is any opcode that has a jump offset (as its last operand). */
+int opcode_is_jump (Opcode opcode);
+
 /***********************************************************************************************************/
 
 #endif
@@ -0,0 +1,886 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "optimize.h"
+#include "decode.h"
+#include "analyze.h"
+#include "verify.h"
+
+/***********************************************************************************************************/
+
+/* Registers are kept track of in sets, with one bit for each. */
+#define REGISTER_BIT(reg) (1 << (reg))
+#define ALL_REGISTERS     ((1 << REGISTER_COUNT) - 1)
+
+/***********************************************************************************************************/
+
+/* What is known about the registers when an instruction is about to be executed: whether the instruction can
+ * be reached at all, the set of registers whose value is always the same there, and what those values are. */
+typedef struct
+{
+    int reached;
+    int known;
+    int values[REGISTER_COUNT];
+} Constants;
+
+/* An item on the stack, as far as the instructions in a block (a run of instructions that is only ever
+ * entered at the top) know it: whether its value is known, and if so what it is and the index of the PUSH
+ * that put it there, or -1 if that PUSH can't be removed. */
+typedef struct
+{
+    int known;
+    int value;
+    int producer;
+} Slot;
+
+/* The state of one round of optimization over a program. */
+typedef struct
+{
+    /* The program, decoded and analyzed. */
+    Instruction *code;
+    int codeSize;
+    int codeEnd;
+
+    /* For every instruction, the registers going into it, the registers that are read after it before they
+     * are written again, whether it has been removed and whether any jump lands on it. */
+    Constants *constants;
+    int *liveOut;
+    char *removed;
+    char *targets;
+
+    /* The items on the stack that the block being rewritten has pushed. */
+    Slot *slots;
+} Round;
+
+/***********************************************************************************************************/
+
+/* Add two values the way the interpreter does, wrapping around instead of overflowing. */
+static int wrap_add (int a, int b)
+{
+    return (int) ((unsigned int) a + (unsigned int) b);
+}
+
+/***********************************************************************************************************/
+
+/* Check if the analysis found a way to reach the instruction provided. */
+static int reachable (const Instruction *instruction)
+{
+    return instruction->depthMin <= instruction->depthMax;
+}
+
+/***********************************************************************************************************/
+
+/* Check if the instruction provided uses the stack and can't be proven to never get a stack error, which
+ * means that it can stop the program with the registers the way they are at that point. A CALL counts too,
+ * since the host function can look at the stack and the registers, and can fail. */
+static int checks_stack (const Instruction *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case CALL:
+            return 1;
+
+        case PUSH:
+        case POP:
+        case SET:
+        case ADD:
+        case RADD:
+        case RJNE:
+            return instruction->operation == (Operation) instruction->opcode;
+
+        default:
+            return 0;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Get the set of registers that the instruction provided reads. A HALT, an IHALT and anything that might stop
+ * the program with an error read all of them, since the host can see them from then on. */
+static int registers_read (const Instruction *instruction)
+{
+    const int *p = instruction->parameters;
+
+    if (checks_stack (instruction))
+        return ALL_REGISTERS;
+
+    switch (instruction->opcode)
+    {
+        case RADD:
+        case RJNER:
+        case RJEQR:
+        case RJLTR:
+            return REGISTER_BIT (p[0]) | REGISTER_BIT (p[1]);
+
+        case RDEC:
+        case RINC:
+        case RJNE:
+        case RJNEI:
+        case RJEQI:
+        case RJLTI:
+            return REGISTER_BIT (p[0]);
+
+        case RMOV:
+        case RADDI:
+        case RSUBI:
+            return REGISTER_BIT (p[1]);
+
+        case RADDR:
+        case RSUBR:
+            return REGISTER_BIT (p[1]) | REGISTER_BIT (p[2]);
+
+        case HALT:
+        case IHALT:
+            return ALL_REGISTERS;
+
+        default:
+            return 0;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Get the register that the instruction provided writes, or -1 if it doesn't write one. */
+static int register_written (const Instruction *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case SET:
+        case RDEC:
+        case RINC:
+        case RMOV:
+        case RMOVI:
+        case RADDR:
+        case RSUBR:
+        case RADDI:
+        case RSUBI:
+            return instruction->parameters[0];
+
+        default:
+            return -1;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Check if the instruction provided does nothing but write a register, so that it can go if nothing reads
+ * what it writes. */
+static int writes_only_register (const Instruction *instruction)
+{
+    return instruction->opcode != SET && register_written (instruction) != -1;
+}
+
+/***********************************************************************************************************/
+
+/* Work out the value that the instruction provided writes to its register, if that's known from the
+ * registers going into it. Returns 1 and stores the value if it is, or 0 if not. The stack isn't known
+ * here, so this never knows what a SET writes. */
+static int evaluate (const Instruction *instruction, const Constants *in, int *value)
+{
+    const int *p = instruction->parameters;
+
+#define KNOWN(reg) ((in->known & REGISTER_BIT (reg)) != 0)
+
+    switch (instruction->opcode)
+    {
+        case RMOVI:
+            *value = p[1];
+            return 1;
+
+        case RMOV:
+            *value = in->values[p[1]];
+            return KNOWN (p[1]);
+
+        case RDEC:
+        case RINC:
+            *value = wrap_add (in->values[p[0]], instruction->opcode == RINC ? 1 : -1);
+            return KNOWN (p[0]);
+
+        case RADDR:
+        case RSUBR:
+            *value = instruction->opcode == RADDR ? wrap_add (in->values[p[1]], in->values[p[2]]) :
+                     (int) ((unsigned int) in->values[p[1]] - (unsigned int) in->values[p[2]]);
+            return KNOWN (p[1]) && KNOWN (p[2]);
+
+        case RADDI:
+        case RSUBI:
+            *value = instruction->opcode == RADDI ? wrap_add (in->values[p[1]], p[2]) :
+                     (int) ((unsigned int) in->values[p[1]] - (unsigned int) p[2]);
+            return KNOWN (p[1]);
+
+        default:
+            return 0;
+    }
+
+#undef KNOWN
+}
+
+/***********************************************************************************************************/
+
+/* Work out whether the compare and branch instruction provided takes its jump, if that's known from the
+ * registers going into it. Returns 1 and stores the outcome in taken if it is, or 0 if not. */
+static int decide (const Instruction *instruction, const Constants *in, int *taken)
+{
+    const int *p = instruction->parameters;
+    int left, right;
+
+    switch (instruction->opcode)
+    {
+        case RJNEI:
+        case RJEQI:
+        case RJLTI:
+            if ((in->known & REGISTER_BIT (p[0])) == 0)
+                return 0;
+
+            left = in->values[p[0]];
+            right = p[1];
+            break;
+
+        case RJNER:
+        case RJEQR:
+        case RJLTR:
+            /* A register is always equal to itself, whatever is in it. */
+            if (p[0] == p[1])
+                left = right = 0;
+            else if ((in->known & REGISTER_BIT (p[0])) == 0 || (in->known & REGISTER_BIT (p[1])) == 0)
+                return 0;
+            else
+            {
+                left = in->values[p[0]];
+                right = in->values[p[1]];
+            }
+            break;
+
+        default:
+            return 0;
+    }
+
+    if (instruction->opcode == RJNEI || instruction->opcode == RJNER)
+        *taken = left != right;
+    else if (instruction->opcode == RJEQI || instruction->opcode == RJEQR)
+        *taken = left == right;
+    else
+        *taken = left < right;
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Find the instructions that execution can go to from the instruction at the index given, storing their
+ * indexes in next. Returns how many there are. */
+static int successors (const Instruction *code, int index, int next[2])
+{
+    int count = 0;
+
+    switch (code[index].opcode)
+    {
+        case HALT:
+        case IHALT:
+            return 0;
+
+        case JMP:
+            next[0] = code[index].target;
+            return 1;
+
+        default:
+            if (code[index].target != -1)
+                next[count++] = code[index].target;
+            next[count++] = index + 1;
+            return count;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Merge the registers coming out of one instruction into what is known going into another. Returns 1 if that
+ * changed what is known there. */
+static int join_constants (Constants *into, const Constants *from)
+{
+    int known, i;
+
+    if (into->reached == 0)
+    {
+        *into = *from;
+        return 1;
+    }
+
+    /* Only the registers that are known and the same on both ways in stay known. */
+    known = into->known & from->known;
+    for (i = 0 ; i < REGISTER_COUNT ; i++)
+    {
+        if ((known & REGISTER_BIT (i)) != 0 && into->values[i] != from->values[i])
+            known &= ~REGISTER_BIT (i);
+    }
+
+    if (known == into->known)
+        return 0;
+
+    into->known = known;
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Work out which registers are known going into every instruction, following the control flow from the
+ * start of the program, where nothing is known. A compare and branch whose outcome is known only goes the
+ * one way, so what's on the other side isn't reached through it. Returns 0 if there isn't the memory. */
+static int propagate_constants (Round *round)
+{
+    int *pending = malloc (sizeof (int) * round->codeSize);
+    char *queued = calloc (round->codeSize, sizeof (char));
+    int count = 0;
+
+    if (pending == NULL || queued == NULL)
+    {
+        free (pending);
+        free (queued);
+        return 0;
+    }
+
+    round->constants[0].reached = 1;
+    pending[count++] = 0;
+    queued[0] = 1;
+
+    while (count > 0)
+    {
+        int i = pending[--count];
+        const Instruction *instruction = &round->code[i];
+        Constants out = round->constants[i];
+        int next[2], nextCount, written, value, taken, n;
+
+        queued[i] = 0;
+
+        /* A host function can change any of the registers. */
+        if (instruction->opcode == CALL)
+            out.known = 0;
+
+        written = register_written (instruction);
+        if (written != -1)
+        {
+            out.known &= ~REGISTER_BIT (written);
+            if (evaluate (instruction, &round->constants[i], &value))
+            {
+                out.known |= REGISTER_BIT (written);
+                out.values[written] = value;
+            }
+        }
+
+        nextCount = successors (round->code, i, next);
+        if (decide (instruction, &round->constants[i], &taken))
+        {
+            next[0] = taken ? instruction->target : i + 1;
+            nextCount = 1;
+        }
+
+        /* Anything that the stack analysis says can't be reached never is, such as the instruction after one
+         * that always gets a stack error. */
+        for (n = 0 ; n < nextCount ; n++)
+        {
+            if (next[n] >= round->codeSize || reachable (&round->code[next[n]]) == 0)
+                continue;
+
+            if (join_constants (&round->constants[next[n]], &out) && queued[next[n]] == 0)
+            {
+                queued[next[n]] = 1;
+                pending[count++] = next[n];
+            }
+        }
+    }
+
+    free (pending);
+    free (queued);
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Work out which registers are read after every instruction before they are written again, working back
+ * from the HALTs, which read all of them. The instructions that have been removed are still in the program
+ * here, doing nothing, so that what is live after them carries through them to whatever comes before. */
+static void compute_liveness (Round *round)
+{
+    int changed = 1;
+
+    while (changed)
+    {
+        int i;
+
+        changed = 0;
+        for (i = round->codeEnd - 1 ; i >= 0 ; i--)
+        {
+            int next[2], nextCount, live = 0, n;
+
+            nextCount = successors (round->code, i, next);
+            for (n = 0 ; n < nextCount ; n++)
+            {
+                const Instruction *successor = &round->code[next[n]];
+                int written, liveIn;
+
+                /* Running off of the end of the program stops it with an error. */
+                if (next[n] >= round->codeEnd)
+                {
+                    live |= ALL_REGISTERS;
+                    continue;
+                }
+
+                liveIn = round->liveOut[next[n]];
+                if (round->removed[next[n]])
+                {
+                    live |= liveIn;
+                    continue;
+                }
+
+                written = register_written (successor);
+                if (written != -1)
+                    liveIn &= ~REGISTER_BIT (written);
+
+                live |= liveIn | registers_read (successor);
+            }
+
+            if ((live | round->liveOut[i]) != round->liveOut[i])
+            {
+                round->liveOut[i] |= live;
+                changed = 1;
+            }
+        }
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Turn the instruction provided into a PUSH of the value given. */
+static void make_push (Instruction *instruction, int value)
+{
+    instruction->opcode = PUSH;
+    instruction->parameters[0] = value;
+    instruction->pCount = 1;
+    instruction->target = -1;
+}
+
+/***********************************************************************************************************/
+
+/* Turn the instruction provided into an RMOVI of the value given into the register given. */
+static void make_rmovi (Instruction *instruction, int reg, int value)
+{
+    instruction->opcode = RMOVI;
+    instruction->parameters[0] = reg;
+    instruction->parameters[1] = value;
+    instruction->pCount = 2;
+    instruction->target = -1;
+}
+
+/***********************************************************************************************************/
+
+/* Turn a compare and branch whose outcome is known into a JMP if it's taken, or remove it if not. */
+static void fold_branch (Round *round, int index, int taken)
+{
+    Instruction *instruction = &round->code[index];
+
+    if (taken == 0)
+    {
+        round->removed[index] = 1;
+        return;
+    }
+
+    instruction->opcode = JMP;
+    instruction->parameters[0] = 0;
+    instruction->pCount = 1;
+}
+
+/***********************************************************************************************************/
+
+/* Rewrite the instructions of the program using what is known about the registers and the stack, one block
+ * at a time. Items that a block pushes are tracked while it runs, so that a PUSH whose value is used by an
+ * ADD or a SET further on in the block can be folded into it; anything that could see the stack in between
+ * (a jump out of the block, or an instruction that might stop the program with an error) leaves the PUSHes
+ * before it where they are. */
+static void rewrite (Round *round)
+{
+    int count = 0, i, n;
+
+    for (i = 0 ; i < round->codeEnd ; i++)
+    {
+        Instruction *instruction = &round->code[i];
+        const Constants *in = &round->constants[i];
+        int *p = instruction->parameters;
+        int written, dead, value, taken;
+
+        /* A jump can land here, on a stack that this block knows nothing about. */
+        if (round->targets[i])
+            count = 0;
+
+        if (round->removed[i])
+            continue;
+
+        /* Something that might stop the program has to see the stack the way it is. */
+        if (checks_stack (instruction))
+        {
+            for (n = 0 ; n < count ; n++)
+                round->slots[n].producer = -1;
+        }
+
+        written = register_written (instruction);
+        dead = written != -1 && (round->liveOut[i] & REGISTER_BIT (written)) == 0;
+
+        switch (instruction->opcode)
+        {
+            case PUSH:
+                round->slots[count].known = 1;
+                round->slots[count].value = p[0];
+                round->slots[count++].producer = checks_stack (instruction) ? -1 : i;
+                break;
+
+            case POP:
+                if (count > 0)
+                    count--;
+                break;
+
+            /* A SET of a value that was just pushed sets the register directly, or not at all if nothing
+             * reads it. */
+            case SET:
+                if (count > 0 && round->slots[count - 1].producer != -1)
+                {
+                    round->removed[round->slots[count - 1].producer] = 1;
+                    if (dead)
+                        round->removed[i] = 1;
+                    else
+                        make_rmovi (instruction, p[0], round->slots[count - 1].value);
+                }
+
+                if (count > 0)
+                    count--;
+                break;
+
+            case ADD:
+                if (count >= 2 && round->slots[count - 1].producer != -1 &&
+                    round->slots[count - 2].producer != -1)
+                {
+                    value = wrap_add (round->slots[count - 1].value, round->slots[count - 2].value);
+                    round->removed[round->slots[count - 1].producer] = 1;
+                    round->removed[round->slots[count - 2].producer] = 1;
+                    make_push (instruction, value);
+
+                    count -= 2;
+                    round->slots[count].known = 1;
+                    round->slots[count].value = value;
+                    round->slots[count++].producer = i;
+                    break;
+                }
+
+                count = count >= 2 ? count - 2 : 0;
+                round->slots[count].known = 0;
+                round->slots[count++].producer = -1;
+                break;
+
+            case RADD:
+                if ((in->known & REGISTER_BIT (p[0])) != 0 && (in->known & REGISTER_BIT (p[1])) != 0)
+                {
+                    value = wrap_add (in->values[p[0]], in->values[p[1]]);
+                    round->slots[count].producer = checks_stack (instruction) ? -1 : i;
+                    make_push (instruction, value);
+
+                    round->slots[count].known = 1;
+                    round->slots[count++].value = value;
+                    break;
+                }
+
+                round->slots[count].known = 0;
+                round->slots[count++].producer = -1;
+                break;
+
+            /* The item that RJNE looks at has to stay where it is, unless the comparison is known. */
+            case RJNE:
+                if (count > 0 && round->slots[count - 1].known && (in->known & REGISTER_BIT (p[0])) != 0 &&
+                    checks_stack (instruction) == 0)
+                {
+                    fold_branch (round, i, in->values[p[0]] != round->slots[count - 1].value);
+                    break;
+                }
+
+                for (n = 0 ; n < count ; n++)
+                    round->slots[n].producer = -1;
+                break;
+
+            case RJNEI:
+            case RJEQI:
+            case RJLTI:
+            case RJNER:
+            case RJEQR:
+            case RJLTR:
+                if (decide (instruction, in, &taken))
+                    fold_branch (round, i, taken);
+                else
+                {
+                    for (n = 0 ; n < count ; n++)
+                        round->slots[n].producer = -1;
+                }
+                break;
+
+            case RMOV:
+            case RADDR:
+            case RSUBR:
+            case RADDI:
+            case RSUBI:
+                if (evaluate (instruction, in, &value))
+                    make_rmovi (instruction, written, value);
+                break;
+
+            default:
+                break;
+        }
+
+        if (dead && round->removed[i] == 0 && writes_only_register (instruction))
+            round->removed[i] = 1;
+
+        /* Nothing carries on past a JMP or a HALT; whatever comes next is the start of a block. Nothing is
+         * known about the stack after a CALL either, since the host function can change it. */
+        if (round->removed[i] == 0 && (instruction->opcode == JMP || instruction->opcode == HALT ||
+                                       instruction->opcode == CALL))
+            count = 0;
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Check if the instruction provided is a jump that does nothing but jump when it goes to the next
+ * instruction, so that it can be removed if that's where it goes. */
+static int removable_jump (const Instruction *instruction)
+{
+    if (instruction->opcode == RJNE)
+        return checks_stack (instruction) == 0;
+
+    return instruction->opcode != NOP && opcode_is_jump (instruction->opcode);
+}
+
+/***********************************************************************************************************/
+
+/* Write out what is left of the program after a round, relocating the jumps. Every removed instruction does
+ * nothing, so a jump to one goes to the instruction left after it instead; if there isn't one, it goes to a
+ * HALT at the end, which is only ever reached by something that has already stopped the program. The map
+ * gives the IP in the program before the round of every int in the program after it. Returns 0 if there
+ * isn't the memory. */
+static int emit (Round *round, int **program, int *length, int **map)
+{
+    int *resolve = malloc (sizeof (int) * (round->codeEnd + 1));
+    int *newIp = malloc (sizeof (int) * (round->codeEnd + 1));
+    int changed = 1, end = 0, size = 0, i, n;
+
+    if (resolve == NULL || newIp == NULL)
+    {
+        free (resolve);
+        free (newIp);
+        return 0;
+    }
+
+    /* Work out where everything goes, and take out the jumps to the instruction after them until there are
+     * none left; taking one out can leave another one jumping to the next instruction. */
+    while (changed)
+    {
+        changed = 0;
+
+        resolve[round->codeEnd] = round->codeEnd;
+        for (i = round->codeEnd - 1 ; i >= 0 ; i--)
+            resolve[i] = round->removed[i] ? resolve[i + 1] : i;
+
+        for (i = 0 ; i < round->codeEnd ; i++)
+        {
+            const Instruction *instruction = &round->code[i];
+
+            if (round->removed[i] == 0 && removable_jump (instruction) &&
+                resolve[instruction->target] == resolve[i + 1])
+            {
+                round->removed[i] = 1;
+                changed = 1;
+            }
+        }
+    }
+
+    /* A HALT is needed at the end if anything can get there. */
+    for (i = 0 ; i < round->codeEnd ; i++)
+    {
+        const Instruction *instruction = &round->code[i];
+
+        if (round->removed[i])
+            continue;
+
+        newIp[i] = size;
+        size += 1 + instruction->pCount;
+
+        if ((instruction->target != -1 && resolve[instruction->target] == round->codeEnd) ||
+            (instruction->opcode != HALT && instruction->opcode != JMP && resolve[i + 1] == round->codeEnd))
+            end = 1;
+    }
+
+    newIp[round->codeEnd] = size;
+
+    *length = size + end;
+    *program = malloc (sizeof (int) * (*length > 0 ? *length : 1));
+    *map = malloc (sizeof (int) * (*length > 0 ? *length : 1));
+    if (*program == NULL || *map == NULL)
+    {
+        free (*program);
+        free (*map);
+        free (resolve);
+        free (newIp);
+        return 0;
+    }
+
+    for (i = 0 ; i < round->codeEnd ; i++)
+    {
+        const Instruction *instruction = &round->code[i];
+        int ip = newIp[i];
+
+        if (round->removed[i])
+            continue;
+
+        (*program)[ip] = instruction->opcode;
+        for (n = 0 ; n < instruction->pCount ; n++)
+            (*program)[ip + n + 1] = instruction->parameters[n];
+
+        if (instruction->target != -1)
+            (*program)[ip + instruction->pCount] = newIp[resolve[instruction->target]] - ip;
+
+        for (n = 0 ; n <= instruction->pCount ; n++)
+            (*map)[ip + n] = instruction->ip;
+    }
+
+    if (end)
+    {
+        (*program)[size] = HALT;
+        (*map)[size] = round->code[round->codeEnd].ip;
+    }
+
+    free (resolve);
+    free (newIp);
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Run one round of optimization over a program, which is known to be valid, writing out what it makes of it
+ * and the map back to the program it was given. Returns 0 if there isn't the memory. */
+static int optimize_round (const int *program, int programLength, int stackSize, int **optimized,
+                           int *optimizedLength, int **map)
+{
+    Round round;
+    int result = 0, i;
+
+    memset (&round, 0, sizeof (Round));
+
+    round.code = decode_program (program, programLength, &round.codeSize, &round.codeEnd);
+    if (round.code == NULL)
+        return 0;
+
+    round.constants = calloc (round.codeSize, sizeof (Constants));
+    round.liveOut = calloc (round.codeSize, sizeof (int));
+    round.removed = calloc (round.codeSize, sizeof (char));
+    round.targets = calloc (round.codeSize, sizeof (char));
+    round.slots = malloc (sizeof (Slot) * round.codeSize);
+
+    if (round.constants != NULL && round.liveOut != NULL && round.removed != NULL && round.targets != NULL &&
+        round.slots != NULL)
+    {
+        /* The stack analysis finds what can be reached from the start, and which instructions can't get a
+         * stack error. */
+        analyze_stack (round.code, round.codeSize, 0, 0, stackSize);
+
+        for (i = 0 ; i < round.codeEnd ; i++)
+            round.removed[i] = reachable (&round.code[i]) == 0 || round.code[i].opcode == NOP;
+
+        for (i = 0 ; i < round.codeEnd ; i++)
+        {
+            if (round.removed[i] == 0 && round.code[i].target != -1)
+                round.targets[round.code[i].target] = 1;
+        }
+
+        if (propagate_constants (&round))
+        {
+            compute_liveness (&round);
+            rewrite (&round);
+            result = emit (&round, optimized, optimizedLength, map);
+        }
+    }
+
+    free (round.code);
+    free (round.constants);
+    free (round.liveOut);
+    free (round.removed);
+    free (round.targets);
+    free (round.slots);
+
+    return result;
+}
+
+/***********************************************************************************************************/
+
+/* Optimize a bytecode program into a smaller one that does the same thing. */
+int *optimize_program (const int *program, int programLength, int stackSize, int *optimizedLength,
+                       int **ipMap)
+{
+    int *current, *map, length = programLength, rounds, i;
+
+    current = malloc (sizeof (int) * (programLength > 0 ? programLength : 1));
+    map = malloc (sizeof (int) * (programLength > 0 ? programLength : 1));
+    if (current == NULL || map == NULL)
+    {
+        free (current);
+        free (map);
+        return NULL;
+    }
+
+    memcpy (current, program, sizeof (int) * programLength);
+    for (i = 0 ; i < programLength ; i++)
+        map[i] = i;
+
+    /* Nothing can be proven about a program that isn't valid. */
+    for (rounds = 0 ; rounds < OPTIMIZE_MAX_ROUNDS && verify_program (program, programLength, NULL) ; rounds++)
+    {
+        int *next, *nextMap, nextLength, same;
+
+        if (optimize_round (current, length, stackSize, &next, &nextLength, &nextMap) == 0)
+        {
+            free (current);
+            free (map);
+            return NULL;
+        }
+
+        /* A program that is proven to loop forever is still the same program, but the verifier refuses one
+         * without a way to a HALT, so it's left the way it was before it got that far. */
+        if (verify_program (next, nextLength, NULL) == 0)
+        {
+            free (next);
+            free (nextMap);
+            break;
+        }
+
+        /* The map from this round goes back to the program before it, which the map so far takes back to the
+         * original; the HALT that may be added at the end maps to the end of the program. */
+        for (i = 0 ; i < nextLength ; i++)
+            nextMap[i] = nextMap[i] < length ? map[nextMap[i]] : programLength;
+
+        same = nextLength == length && memcmp (next, current, sizeof (int) * length) == 0;
+
+        free (current);
+        free (map);
+        current = next;
+        map = nextMap;
+        length = nextLength;
+
+        if (same)
+            break;
+    }
+
+    *optimizedLength = length;
+    if (ipMap != NULL)
+        *ipMap = map;
+    else
+        free (map);
+
+    return current;
+}
+
+/***********************************************************************************************************/
@@ -0,0 +1,49 @@
+#ifndef __OPTIMIZEdotH__
+#define __OPTIMIZEdotH__
+
+/***********************************************************************************************************/
+
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* The most times that the passes are run over a program, each time on what the last time made of it. Every
+ * pass can open up more work for the others, so they're run until nothing changes or this many times. */
+#define OPTIMIZE_MAX_ROUNDS 8
+
+/***********************************************************************************************************/
+
+/* Optimize a bytecode program into a smaller one that does the same thing. The passes follow the control flow
+ * of the program, and are:
+ *    - constant folding and propagation: arithmetic on values that are known when the program is optimized
+ *      is done then, including values carried through registers, and a compare and branch whose outcome is
+ *      known becomes a JMP or goes away
+ *    - PUSH a; PUSH b; ADD becomes PUSH a+b, and PUSH a; SET r becomes RMOVI r, a
+ *    - dead store elimination: a register that is written and then written again before anything reads it
+ *      isn't written the first time, including by a SET of a value that was just pushed
+ *    - NOPs, code that can never be reached (such as after a HALT) and jumps to the next instruction are
+ *      removed, and the offsets of the jumps that are left are relocated to match
+ *
+ * The optimized program leaves the registers and the stack the same as the original when it halts, whether
+ * that's with a HALT or an error, and pops the same values along the way, as long as it's started the same
+ * way that ctx_init() starts a program: at the first instruction with an empty stack. The registers can be
+ * anything to start with. Only stack operations that are proven to never overflow a stack of stackSize
+ * entries (or underflow) are folded away, so this holds for a stack of at least that size. What it doesn't
+ * keep is how it gets there: there are fewer instructions to trace and to charge to a budget, and the SETs
+ * that are removed or turned into register moves are no longer displayed. A CALL is left where it is, and the
+ * host function that it calls sees the registers and the stack the way they would have been.
+ *
+ * Only programs that pass verify_program() are optimized; anything else is returned as it is. The optimized
+ * program always passes it too.
+ *
+ * The return value is the optimized program, which is allocated with malloc() and should be released with
+ * free(), and its length is stored in optimizedLength. If ipMap is not NULL, it is set to an array allocated
+ * the same way that has an entry for every int in the optimized program, giving the IP in the original
+ * program of the instruction that it came from, which is how a trace of the optimized program is related
+ * back to the original. NULL is returned if the memory could not be allocated. */
+int *optimize_program (const int *program, int programLength, int stackSize, int *optimizedLength,
+                       int **ipMap);
+
+/***********************************************************************************************************/
+
+#endif
@@ -0,0 +1,114 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "output.h"
+
+/***********************************************************************************************************/
+
+/* Create an output sink that collects text in the buffer given. */
+VMOutput *output_create (char *buffer, int size, VMOutputFlush flush)
+{
+    VMOutput *output = calloc (1, sizeof (VMOutput));
+
+    if (output == NULL)
+        return NULL;
+
+    /* A buffer with no room in it is no buffer at all. */
+    if (buffer == NULL || size <= 0)
+    {
+        if (size <= 0)
+            size = OUTPUT_DEFAULT_SIZE;
+
+        buffer = malloc (size);
+        if (buffer == NULL)
+        {
+            free (output);
+            return NULL;
+        }
+
+        output->owned = 1;
+    }
+
+    output->buffer = buffer;
+    output->size = size;
+    output->used = 0;
+    output->flush = flush;
+    output->fd = STDERR_FILENO;
+
+    return output;
+}
+
+/***********************************************************************************************************/
+
+/* Hand over whatever text is left in an output sink, and then release it. */
+void output_release (VMOutput *output)
+{
+    if (output == NULL)
+        return;
+
+    output_flush (output);
+
+    if (output->owned)
+        free (output->buffer);
+
+    free (output);
+}
+
+/***********************************************************************************************************/
+
+/* Hand over all of the text in an output sink that hasn't been handed over yet. */
+void output_flush (VMOutput *output)
+{
+    int done = 0, count;
+
+    if (output->used == 0)
+        return;
+
+    /* The callback gets the text straight out of the buffer. */
+    if (output->callback != NULL)
+        output->callback (output->userData, output->buffer, output->used);
+    else
+    {
+        /* A file descriptor can take less than all of it at once. If it won't take any more at all, the rest
+         * is thrown away, the same as stdio would do. */
+        while (done < output->used)
+        {
+            count = (int) write (output->fd, output->buffer + done, output->used - done);
+            if (count < 0 && errno == EINTR)
+                continue;
+
+            if (count <= 0)
+                break;
+
+            done += count;
+        }
+    }
+
+    output->used = 0;
+}
+
+/***********************************************************************************************************/
+
+/* Add length bytes of text to an output sink, handing over the buffer whenever it fills. */
+void output_write (VMOutput *output, const char *text, int length)
+{
+    int count;
+
+    while (length > 0)
+    {
+        if (output->used == output->size)
+            output_flush (output);
+
+        count = output->size - output->used < length ? output->size - output->used : length;
+        memcpy (output->buffer + output->used, text, count);
+
+        output->used += count;
+        text += count;
+        length -= count;
+    }
+}
+
+/***********************************************************************************************************/
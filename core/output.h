@@ -0,0 +1,96 @@
+#ifndef __OUTPUTdotH__
+#define __OUTPUTdotH__
+
+/***********************************************************************************************************/
+
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* The size of the buffer that an output sink allocates for itself when it isn't given one, in bytes. */
+#define OUTPUT_DEFAULT_SIZE 65536
+
+/* An output sink, which is where everything that the interpreter displays for a context goes; the trace, the
+ * results of operations and the reasons for errors. Text is collected in a buffer that belongs to the context
+ * and is handed over in large pieces, either to a file descriptor or to a callback, so that producing it
+ * doesn't take a lock or make a system call for every line and contexts running on different threads don't
+ * get in each other's way. See ctx_output_fd() and ctx_output_callback(). */
+typedef struct VMOutput
+{
+    /* Where the text goes: the callback if there is one, or the file descriptor otherwise. */
+    VMOutputCallback callback;
+    void *userData;
+    int fd;
+
+    /* When the text is handed over, in addition to whenever the buffer is full. */
+    VMOutputFlush flush;
+
+    /* The buffer, its size and how much of it holds text that hasn't been handed over yet, and whether the
+     * buffer was allocated by the sink (as opposed to being provided by the host). */
+    char *buffer;
+    int size;
+    int used;
+    int owned;
+} VMOutput;
+
+/***********************************************************************************************************/
+
+/* Create an output sink that collects text in the buffer given, which is size bytes long, and hands it over
+ * according to the flush policy. If buffer is NULL, the sink allocates one of its own that is size bytes
+ * long, or OUTPUT_DEFAULT_SIZE bytes if size is 0 or less (in which case any buffer given is ignored). The
+ * sink starts out writing to the standard error stream; set the callback or the file descriptor in it to
+ * send the text somewhere else.
+ *
+ * Returns NULL if the memory could not be allocated. Release it with output_release(). */
+VMOutput *output_create (char *buffer, int size, VMOutputFlush flush);
+
+/* Hand over whatever text is left in an output sink, and then release it. NULL is allowed. A buffer that was
+ * provided by the host is left alone. */
+void output_release (VMOutput *output);
+
+/* Hand over all of the text in an output sink that hasn't been handed over yet, leaving the buffer empty. */
+void output_flush (VMOutput *output);
+
+/* Add length bytes of text to an output sink, handing over the buffer whenever it fills. */
+void output_write (VMOutput *output, const char *text, int length);
+
+/***********************************************************************************************************/
+
+/* Add a string to an output sink. */
+static inline void output_string (VMOutput *output, const char *text)
+{
+    output_write (output, text, (int) strlen (text));
+}
+
+/* Add an integer to an output sink, in decimal. */
+static inline void output_int (VMOutput *output, int value)
+{
+    char digits[12];
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int) value : (unsigned int) value;
+    int at = sizeof (digits);
+
+    /* The digits go in from the end, so that they come out in the right order. */
+    do
+    {
+        digits[--at] = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    if (value < 0)
+        digits[--at] = '-';
+
+    output_write (output, digits + at, (int) sizeof (digits) - at);
+}
+
+/* End the current line in an output sink, handing it over if the sink does that after every line. */
+static inline void output_end_line (VMOutput *output)
+{
+    output_write (output, "\n", 1);
+
+    if (output->flush == VM_OUTPUT_FLUSH_LINE)
+        output_flush (output);
+}
+
+/***********************************************************************************************************/
+
+#endif
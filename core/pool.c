@@ -0,0 +1,130 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+/***********************************************************************************************************/
+
+/* Round a size in bytes up to a whole number of cache lines. */
+#define POOL_ALIGN(size) (((size) + CONTEXT_ALIGNMENT - 1) / CONTEXT_ALIGNMENT * CONTEXT_ALIGNMENT)
+
+/* The space that a context takes up in a block, not counting its stack, which comes right after it. */
+#define POOL_CONTEXT_SIZE POOL_ALIGN (sizeof (VMContext))
+
+/***********************************************************************************************************/
+
+/* Create a pool of contexts with stacks of the size given. */
+VMPool *pool_create (int stackSize, int blockSize)
+{
+    VMPool *pool = calloc (1, sizeof (VMPool));
+
+    if (pool == NULL)
+        return NULL;
+
+    pool->stackSize = stackSize > 0 ? stackSize : CONTEXT_STACK_SIZE;
+    pool->blockSize = blockSize > 0 ? blockSize : POOL_DEFAULT_BLOCK;
+    pool->slotSize = POOL_CONTEXT_SIZE + POOL_ALIGN (sizeof (int) * CONTEXT_STACK_MEMORY (pool->stackSize));
+
+    return pool;
+}
+
+/***********************************************************************************************************/
+
+/* Release a pool created with pool_create(), along with all of its contexts. */
+void pool_release (VMPool *pool)
+{
+    VMPoolBlock *block, *next;
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    /* The contexts that were never used are all zeroes, and the ones that were given back have already had
+     * everything released, so releasing every context only does anything to the ones still in use. */
+    for (block = pool->blocks ; block != NULL ; block = next)
+    {
+        next = block->next;
+
+        for (i = 0 ; i < pool->blockSize ; i++)
+            ctx_release ((VMContext *) (block->memory + pool->slotSize * i));
+
+        free (block->memory);
+        free (block);
+    }
+
+    free (pool->free);
+    free (pool);
+}
+
+/***********************************************************************************************************/
+
+/* Allocate another block of contexts for a pool, all of which are free. Returns 0 if there isn't the memory
+ * for it, or 1 otherwise. */
+static int pool_grow (VMPool *pool)
+{
+    VMPoolBlock *block;
+    VMContext **freeList;
+    size_t size = pool->slotSize * pool->blockSize;
+    int count = 0, i;
+
+    for (block = pool->blocks ; block != NULL ; block = block->next)
+        count += pool->blockSize;
+
+    /* The free list needs room for every context once this block is added, since they can all be given back
+     * at once. */
+    freeList = realloc (pool->free, sizeof (VMContext *) * (count + pool->blockSize));
+    if (freeList == NULL)
+        return 0;
+
+    pool->free = freeList;
+
+    block = malloc (sizeof (VMPoolBlock));
+    if (block == NULL)
+        return 0;
+
+    block->memory = aligned_alloc (CONTEXT_ALIGNMENT, size);
+    if (block->memory == NULL)
+    {
+        free (block);
+        return 0;
+    }
+
+    memset (block->memory, 0, size);
+    block->next = pool->blocks;
+    pool->blocks = block;
+
+    /* The free list is used from the end, so put them in backwards to hand them out in order. */
+    for (i = pool->blockSize - 1 ; i >= 0 ; i--)
+        pool->free[pool->freeCount++] = (VMContext *) (block->memory + pool->slotSize * i);
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Get a context from a pool, initialized to run the provided program. */
+VMContext *pool_acquire (VMPool *pool, int *program, int programLength)
+{
+    VMContext *context;
+
+    if (pool->freeCount == 0 && pool_grow (pool) == 0)
+        return NULL;
+
+    /* The memory for the stack of a context is right after it. */
+    context = pool->free[--pool->freeCount];
+
+    return ctx_init_stack (context, program, programLength,
+                           (int *) ((unsigned char *) context + POOL_CONTEXT_SIZE), pool->stackSize);
+}
+
+/***********************************************************************************************************/
+
+/* Give a context back to the pool that it came from. */
+void pool_return (VMPool *pool, VMContext *context)
+{
+    ctx_release (context);
+    pool->free[pool->freeCount++] = context;
+}
+
+/***********************************************************************************************************/
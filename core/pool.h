@@ -0,0 +1,76 @@
+#ifndef __POOLdotH__
+#define __POOLdotH__
+
+/***********************************************************************************************************/
+
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* The number of contexts that a pool allocates at a time when it isn't given a number. */
+#define POOL_DEFAULT_BLOCK 64
+
+/* A block of contexts in a pool, all allocated at once. */
+typedef struct VMPoolBlock
+{
+    /* The memory for the contexts and their stacks, which is aligned to CONTEXT_ALIGNMENT. */
+    unsigned char *memory;
+
+    /* The next block, in the order that they were allocated in (newest first). */
+    struct VMPoolBlock *next;
+} VMPoolBlock;
+
+/* A pool of contexts, for hosts that run a lot of short programs. The contexts are kept in large blocks of
+ * memory together with their stacks, one after the other, and are handed out and taken back without
+ * allocating anything or clearing any more than ctx_init_stack() does, so that a context costs next to
+ * nothing to get hold of. Every context starts on a cache line of its own, as does the memory for its stack,
+ * so that contexts running on different threads never share one.
+ *
+ * All of the contexts in a pool have stacks of the same size, which can be much smaller than the usual
+ * CONTEXT_STACK_SIZE entries for programs that don't need it (see analyze_stack()); use a pool for each size
+ * that is needed. A pool is not safe to use from several threads at once, though the contexts from it are
+ * as independent as any others. */
+typedef struct VMPool
+{
+    /* The size of the stack of every context, in entries, and the space that each context takes up in a
+     * block along with its stack, in bytes. */
+    int stackSize;
+    size_t slotSize;
+
+    /* The number of contexts in each block, and the blocks. */
+    int blockSize;
+    VMPoolBlock *blocks;
+
+    /* The contexts that aren't in use, and the number of them. There is room in this for every context in
+     * every block. */
+    VMContext **free;
+    int freeCount;
+} VMPool;
+
+/***********************************************************************************************************/
+
+/* Create a pool of contexts with stacks of stackSize entries (or CONTEXT_STACK_SIZE entries if it's 0 or
+ * less), which allocates blockSize contexts at a time (or POOL_DEFAULT_BLOCK contexts if it's 0 or less).
+ * No contexts are allocated until the first one is asked for.
+ *
+ * Returns NULL if the memory could not be allocated. Release it with pool_release(). */
+VMPool *pool_create (int stackSize, int blockSize);
+
+/* Release a pool created with pool_create(), along with all of its contexts and everything that they have
+ * allocated, whether or not they have been given back. NULL is allowed. */
+void pool_release (VMPool *pool);
+
+/* Get a context from a pool, initialized to run the provided program the same way that ctx_init_stack()
+ * does. It stays in use until it is given back with pool_return(), and must not be released with
+ * ctx_release() in the meantime.
+ *
+ * Returns NULL if the pool needed to allocate more contexts and there wasn't the memory to. */
+VMContext *pool_acquire (VMPool *pool, int *program, int programLength);
+
+/* Give a context back to the pool that it came from once it's no longer needed, releasing everything that
+ * it allocated while it ran, the way ctx_release() does. */
+void pool_return (VMPool *pool, VMContext *context);
+
+/***********************************************************************************************************/
+
+#endif
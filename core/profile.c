@@ -0,0 +1,173 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "profile.h"
+
+/***********************************************************************************************************/
+
+/* The name of the opcode counted in the given slot of a profile. */
+static const char *profile_opcode_name (int slot)
+{
+    return slot == PROFILE_OPCODES - 1 ? "(unknown)" : opcode_name ((Opcode) slot);
+}
+
+/***********************************************************************************************************/
+
+/* Create an empty profile for a program with the given number of IPs. */
+VMProfile *profile_create (int ipCount)
+{
+    VMProfile *profile = calloc (1, sizeof (VMProfile));
+
+    if (profile == NULL)
+        return NULL;
+
+    /* Always allocate something, so that NULL only ever means that there's no memory. */
+    profile->ips = calloc (ipCount > 0 ? ipCount : 1, sizeof (unsigned long long));
+    if (profile->ips == NULL)
+    {
+        free (profile);
+        return NULL;
+    }
+
+    profile->ipCount = ipCount;
+    profile->current = -1;
+
+    return profile;
+}
+
+/***********************************************************************************************************/
+
+/* Release a profile created with profile_create(). */
+void profile_release (VMProfile *profile)
+{
+    if (profile == NULL)
+        return;
+
+    free (profile->ips);
+    free (profile);
+}
+
+/***********************************************************************************************************/
+
+/* Set every count in a profile back to zero. */
+void profile_reset (VMProfile *profile)
+{
+    memset (profile->opcodes, 0, sizeof (profile->opcodes));
+    memset (profile->cycles, 0, sizeof (profile->cycles));
+    memset (profile->ips, 0, sizeof (unsigned long long) * profile->ipCount);
+
+    profile->current = -1;
+}
+
+/***********************************************************************************************************/
+
+/* The profile that profile_compare_ips() is sorting the IPs of. qsort() doesn't pass anything along to the
+ * comparison, so it has to go here; it's per thread so that profiles can be dumped from several at once. */
+static _Thread_local const VMProfile *sorting;
+
+/* Sort IPs by the number of times that they ran, most first, and then by IP. */
+static int profile_compare_ips (const void *left, const void *right)
+{
+    int a = *(const int *) left, b = *(const int *) right;
+
+    if (sorting->ips[a] != sorting->ips[b])
+        return sorting->ips[a] < sorting->ips[b] ? 1 : -1;
+
+    return a - b;
+}
+
+/***********************************************************************************************************/
+
+/* Write out a profile in a form meant for people. */
+void profile_dump_text (const VMProfile *profile, FILE *out, int top)
+{
+    unsigned long long total = 0, cycles = 0;
+    int *order, count = 0, i;
+
+    for (i = 0 ; i < PROFILE_OPCODES ; i++)
+    {
+        total += profile->opcodes[i];
+        cycles += profile->cycles[i];
+    }
+
+    fprintf (out, "Profile: %llu instructions", total);
+    if (PROFILE_HAVE_CYCLES)
+        fprintf (out, ", %llu cycles", cycles);
+    fprintf (out, "\n\n");
+
+    fprintf (out, "%-10s %16s %8s", "Opcode", "Count", "%");
+    if (PROFILE_HAVE_CYCLES)
+        fprintf (out, " %16s %8s %10s", "Cycles", "%", "Cycles/op");
+    fprintf (out, "\n");
+
+    for (i = 0 ; i < PROFILE_OPCODES ; i++)
+    {
+        if (profile->opcodes[i] == 0)
+            continue;
+
+        fprintf (out, "%-10s %16llu %7.2f%%", profile_opcode_name (i), profile->opcodes[i],
+                 100.0 * profile->opcodes[i] / total);
+
+        if (PROFILE_HAVE_CYCLES)
+            fprintf (out, " %16llu %7.2f%% %10.2f", profile->cycles[i],
+                     cycles > 0 ? 100.0 * profile->cycles[i] / cycles : 0.0,
+                     (double) profile->cycles[i] / profile->opcodes[i]);
+
+        fprintf (out, "\n");
+    }
+
+    /* The IPs that ran, hottest first. If there isn't the memory to sort them, leave them out. */
+    order = malloc (sizeof (int) * (profile->ipCount > 0 ? profile->ipCount : 1));
+    if (order == NULL)
+        return;
+
+    for (i = 0 ; i < profile->ipCount ; i++)
+    {
+        if (profile->ips[i] != 0)
+            order[count++] = i;
+    }
+
+    sorting = profile;
+    qsort (order, count, sizeof (int), profile_compare_ips);
+
+    if (top > 0 && count > top)
+        count = top;
+
+    fprintf (out, "\n%-10s %16s %8s\n", "IP", "Count", "%");
+    for (i = 0 ; i < count ; i++)
+        fprintf (out, "%-10d %16llu %7.2f%%\n", order[i], profile->ips[order[i]],
+                 100.0 * profile->ips[order[i]] / total);
+
+    free (order);
+}
+
+/***********************************************************************************************************/
+
+/* Write out a profile as a JSON object holding everything in it. */
+void profile_dump_json (const VMProfile *profile, FILE *out)
+{
+    int i, first = 1;
+
+    fprintf (out, "{\"cycles\": %s, \"opcodes\": [", PROFILE_HAVE_CYCLES ? "true" : "false");
+    for (i = 0 ; i < PROFILE_OPCODES ; i++)
+    {
+        fprintf (out, "%s{\"opcode\": \"%s\", \"count\": %llu, \"cycles\": %llu}", i == 0 ? "" : ", ",
+                 profile_opcode_name (i), profile->opcodes[i], profile->cycles[i]);
+    }
+
+    fprintf (out, "], \"ips\": [");
+    for (i = 0 ; i < profile->ipCount ; i++)
+    {
+        if (profile->ips[i] == 0)
+            continue;
+
+        fprintf (out, "%s{\"ip\": %d, \"count\": %llu}", first ? "" : ", ", i, profile->ips[i]);
+        first = 0;
+    }
+
+    fprintf (out, "]}\n");
+}
+
+/***********************************************************************************************************/
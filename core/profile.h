@@ -0,0 +1,112 @@
+#ifndef __PROFILEdotH__
+#define __PROFILEdotH__
+
+/***********************************************************************************************************/
+
+#include <stdio.h>
+#include "opcodes.h"
+
+#if defined (__x86_64__) || defined (__i386__)
+#  include <x86intrin.h>
+#endif
+
+/***********************************************************************************************************/
+
+/* Cycles are counted with the time stamp counter, which is only available on x86; everywhere else a profile
+ * only has counts. */
+#if defined (__x86_64__) || defined (__i386__)
+#  define PROFILE_HAVE_CYCLES 1
+#else
+#  define PROFILE_HAVE_CYCLES 0
+#endif
+
+/* The number of opcode slots in a profile; one for every opcode, and one more at the end that every opcode
+ * that doesn't exist (and so runs as a NOP) is counted in. */
+#define PROFILE_OPCODES (OPCODE_COUNT + 1)
+
+/* The execution profile of a program, which says how often every opcode and every IP in the program ran and
+ * roughly how long each opcode took. A context collects one while it runs if it has one; see ctx_profile().
+ *
+ * Cycles are measured from the start of one instruction to the start of the next, so an instruction is
+ * charged for its dispatch and for reading the counter as well as for its own work. That makes them useful
+ * for comparing opcodes and finding where a program spends its time, but they are larger than the same
+ * instructions take when they aren't being profiled. */
+typedef struct VMProfile
+{
+    /* How many times every opcode ran, and how many cycles were spent in them. */
+    unsigned long long opcodes[PROFILE_OPCODES];
+    unsigned long long cycles[PROFILE_OPCODES];
+
+    /* How many times the instruction at every IP in the program ran, and the number of IPs. For a context
+     * running a compact program, the IPs are byte offsets into it. */
+    unsigned long long *ips;
+    int ipCount;
+
+    /* The opcode slot that the instruction currently running is counted in (or -1 when there isn't one),
+     * and when it started. */
+    int current;
+    unsigned long long started;
+} VMProfile;
+
+/***********************************************************************************************************/
+
+/* Create an empty profile for a program with the given number of IPs. Returns NULL if the memory could not
+ * be allocated. Release it with profile_release(). */
+VMProfile *profile_create (int ipCount);
+
+/* Release a profile created with profile_create(). NULL is allowed. */
+void profile_release (VMProfile *profile);
+
+/* Set every count in a profile back to zero. */
+void profile_reset (VMProfile *profile);
+
+/* Write out a profile in a form meant for people: a table of opcodes by how often they ran, and the IPs
+ * that ran the most. At most top IPs are listed, or all of them that ran if top is 0 or less. */
+void profile_dump_text (const VMProfile *profile, FILE *out, int top);
+
+/* Write out a profile as a JSON object holding everything in it; every opcode, and every IP that ran. */
+void profile_dump_json (const VMProfile *profile, FILE *out);
+
+/***********************************************************************************************************/
+
+/* Read the cycle counter, or return 0 if there isn't one. */
+static inline unsigned long long profile_clock (void)
+{
+#if PROFILE_HAVE_CYCLES
+    return __rdtsc ();
+#else
+    return 0;
+#endif
+}
+
+/* Count an instruction that is about to run, charging the one that ran before it with the cycles since it
+ * started. The engines that profile call this for every instruction they execute. */
+static inline void profile_record (VMProfile *profile, Opcode opcode, int ip)
+{
+    unsigned long long now = profile_clock ();
+    int slot = (unsigned int) opcode < OPCODE_COUNT ? (int) opcode : PROFILE_OPCODES - 1;
+
+    if (profile->current != -1)
+        profile->cycles[profile->current] += now - profile->started;
+
+    profile->opcodes[slot]++;
+    profile->current = slot;
+    profile->started = now;
+
+    /* The IHALTs for jumps that go nowhere and for running off of the end aren't at an IP in the program. */
+    if ((unsigned int) ip < (unsigned int) profile->ipCount)
+        profile->ips[ip]++;
+}
+
+/* Charge the instruction that is running with the cycles up until now, when the engine stops running. */
+static inline void profile_stop (VMProfile *profile)
+{
+    if (profile->current != -1)
+        profile->cycles[profile->current] += profile_clock () - profile->started;
+
+    profile->current = -1;
+}
+
+/***********************************************************************************************************/
+
+#endif
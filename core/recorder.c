@@ -0,0 +1,203 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "recorder.h"
+
+/***********************************************************************************************************/
+
+/* Create a recorder that keeps at least capacity records. */
+VMRecorder *recorder_create (int capacity)
+{
+    VMRecorder *recorder;
+    uint64_t size = 1;
+
+    while (size < (uint64_t) (capacity > 0 ? capacity : 1))
+        size <<= 1;
+
+    recorder = malloc (sizeof (VMRecorder));
+    if (recorder == NULL)
+        return NULL;
+
+    recorder->records = malloc (sizeof (TraceRecord) * size);
+    if (recorder->records == NULL)
+    {
+        free (recorder);
+        return NULL;
+    }
+
+    recorder->mask = size - 1;
+    atomic_init (&recorder->head, 0);
+
+    return recorder;
+}
+
+/***********************************************************************************************************/
+
+/* Release a recorder created with recorder_create(). */
+void recorder_release (VMRecorder *recorder)
+{
+    if (recorder == NULL)
+        return;
+
+    free (recorder->records);
+    free (recorder);
+}
+
+/***********************************************************************************************************/
+
+/* Record that the program is being halted because of an error, and why. */
+void recorder_halt (VMRecorder *recorder, const VMContext *context, IHALT_Reason reason, Opcode opcode)
+{
+    Instruction instruction;
+
+    memset (&instruction, 0, sizeof (Instruction));
+    instruction.opcode = IHALT;
+    instruction.ip = -1;
+    instruction.parameters[0] = reason;
+    instruction.parameters[1] = opcode;
+    instruction.pCount = 2;
+
+    recorder_write (recorder, context, &instruction);
+}
+
+/***********************************************************************************************************/
+
+/* Write the records in a recorder out to the file given. */
+int recorder_dump (VMRecorder *recorder, const char *path)
+{
+    RecorderHeader header;
+    TraceRecord *copy;
+    uint64_t head, start, first, last, i;
+    FILE *file;
+    int written;
+
+    /* Copy out everything that's been published so far. */
+    head = atomic_load_explicit (&recorder->head, memory_order_acquire);
+    start = head > recorder->mask ? head - recorder->mask - 1 : 0;
+
+    copy = malloc (sizeof (TraceRecord) * (head - start + 1));
+    if (copy == NULL)
+        return 0;
+
+    for (i = start ; i < head ; i++)
+        copy[i - start] = recorder->records[i & recorder->mask];
+
+    /* If the program carried on while we were copying, the slots it wrote to since held the oldest records,
+     * and so does the slot that it's writing to right now. Those are all left out, so that nothing that was
+     * half written ends up in the dump. */
+    atomic_thread_fence (memory_order_acquire);
+    last = atomic_load_explicit (&recorder->head, memory_order_relaxed);
+
+    first = start;
+    if (last > recorder->mask && last - recorder->mask > first)
+        first = last - recorder->mask < head ? last - recorder->mask : head;
+
+    memset (&header, 0, sizeof (RecorderHeader));
+    header.magic = RECORDER_MAGIC;
+    header.version = RECORDER_VERSION;
+    header.recordSize = sizeof (TraceRecord);
+    header.total = head;
+    header.count = head - first;
+
+    file = fopen (path, "wb");
+    if (file == NULL)
+    {
+        free (copy);
+        return 0;
+    }
+
+    written = fwrite (&header, sizeof (RecorderHeader), 1, file) == 1 &&
+              fwrite (copy + (first - start), sizeof (TraceRecord), header.count, file) == header.count;
+
+    free (copy);
+
+    return fclose (file) == 0 && written;
+}
+
+/***********************************************************************************************************/
+
+/* Read a dump written by recorder_dump() back in. */
+TraceRecord *recorder_load (const char *path, int *count, uint64_t *total)
+{
+    RecorderHeader header;
+    TraceRecord *records = NULL;
+    FILE *file;
+
+    file = fopen (path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    if (fread (&header, sizeof (RecorderHeader), 1, file) == 1 && header.magic == RECORDER_MAGIC &&
+        header.version == RECORDER_VERSION && header.recordSize == sizeof (TraceRecord) &&
+        header.count <= INT_MAX)
+    {
+        records = malloc (sizeof (TraceRecord) * (header.count > 0 ? header.count : 1));
+        if (records != NULL && fread (records, sizeof (TraceRecord), header.count, file) != header.count)
+        {
+            free (records);
+            records = NULL;
+        }
+    }
+
+    fclose (file);
+
+    if (records != NULL)
+    {
+        *count = (int) header.count;
+        *total = header.total;
+    }
+
+    return records;
+}
+
+/***********************************************************************************************************/
+
+/* Write a record out the same way that the interpreter traces the instruction that it was made from. */
+void recorder_print (const TraceRecord *record, VMTraceLevel level, FILE *out)
+{
+    Opcode opcode = (Opcode) record->opcode;
+    const char *mask;
+    int i;
+
+    /* The interpreter displays the reason for an error instead of tracing the IHALT. */
+    if (opcode == IHALT)
+    {
+        if (level >= VM_TRACE_ERRORS)
+        {
+            fprintf (out, ">> *** << Invalid program detected\n");
+            fprintf (out, ">> *** << %s\n", ihalt_error_reason ((IHALT_Reason) record->parameters[0],
+                                                               (Opcode) record->parameters[1]));
+        }
+
+        return;
+    }
+
+    if (level == VM_TRACE_FULL)
+    {
+        mask = opcode_operand_mask (opcode);
+
+        fprintf (out, ">>> %s", opcode_name (opcode));
+        for (i = 0 ; i < record->pCount ; i++)
+        {
+            if (mask[i] == 'r')
+                fprintf (out, " %s (%d) ", register_name ((Register) record->parameters[i]),
+                         record->values[i]);
+            else
+                fprintf (out, " %d ", record->parameters[i]);
+        }
+        fprintf (out, "\n");
+    }
+
+    /* The results of the operations that produce one, unless the stack was empty, which is an error. */
+    if (level >= VM_TRACE_OPS && record->sp >= 0)
+    {
+        if (opcode == POP)
+            fprintf (out, "<<POP>> %d\n", record->top);
+        else if (opcode == SET)
+            fprintf (out, "<<SET %s>> %d\n", register_name ((Register) record->parameters[0]), record->top);
+    }
+}
+
+/***********************************************************************************************************/
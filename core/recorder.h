@@ -0,0 +1,144 @@
+#ifndef __RECORDERdotH__
+#define __RECORDERdotH__
+
+/***********************************************************************************************************/
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* The magic number at the start of a recording dump ("SVMT" when read as bytes), and the version of the
+ * format that this code reads and writes. */
+#define RECORDER_MAGIC   0x544D5653
+#define RECORDER_VERSION 2
+
+/* The most operands that a record keeps for an instruction, which is as many as any opcode has. */
+#define RECORDER_PARAMETERS 3
+
+/* The number of records that a recorder keeps when no other size is asked for. */
+#define RECORDER_DEFAULT_CAPACITY (1 << 20)
+
+/* A single record in a recording, which is what the interpreter knew about an instruction just before it
+ * executed it; everything that the text trace shows for it, in a fixed size and without any formatting. */
+typedef struct
+{
+    /* The IP of the instruction, or -1 for an IHALT record (see below). */
+    int32_t ip;
+
+    /* The opcode, and how many of the parameters are used. */
+    uint16_t opcode;
+    uint16_t pCount;
+
+    /* The stack pointer, and the item at the top of the stack (or 0 if it's empty). The result of a POP or
+     * a SET is the item at the top of the stack when it starts. */
+    int32_t sp;
+    int32_t top;
+
+    /* The operands of the instruction, and the value of each operand that is a register. */
+    int32_t parameters[RECORDER_PARAMETERS];
+    int32_t values[RECORDER_PARAMETERS];
+} TraceRecord;
+
+/* A recorder, which keeps the most recent records of a program as it runs in a ring buffer. The context
+ * running the program is the only thing that ever writes to it, and it never waits for anything to do so;
+ * a dump can be taken from another thread while it's running. See ctx_record(). */
+typedef struct VMRecorder
+{
+    /* The ring buffer, and one less than the number of records in it, which is a power of two. */
+    TraceRecord *records;
+    uint64_t mask;
+
+    /* The number of records that have ever been written. The newest record is the one before this. */
+    _Atomic uint64_t head;
+} VMRecorder;
+
+/* The header at the start of a recording dump. It is followed by count records, oldest first. */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+
+    /* The size of a single record in bytes. */
+    uint32_t recordSize;
+    uint32_t reserved;
+
+    /* The number of records that the recorder had ever written when the dump was taken, and the number of
+     * them (the most recent ones) that are in the dump. */
+    uint64_t total;
+    uint64_t count;
+} RecorderHeader;
+
+/***********************************************************************************************************/
+
+/* Create a recorder that keeps at least capacity records, which is rounded up to a power of two. Returns
+ * NULL if the memory could not be allocated. Release it with recorder_release(). */
+VMRecorder *recorder_create (int capacity);
+
+/* Release a recorder created with recorder_create(). NULL is allowed. */
+void recorder_release (VMRecorder *recorder);
+
+/* Write the records in a recorder out to the file given, replacing the file if it exists. This can be
+ * called while the recorder is being written to, in which case any records that were overwritten while
+ * they were being copied are left out.
+ *
+ * Returns 1 if the dump was written or 0 if not, in which case errno says why. */
+int recorder_dump (VMRecorder *recorder, const char *path);
+
+/* Read a dump written by recorder_dump() back in. The number of records in it and the number that had been
+ * written in total are stored in count and total. The returned array is allocated with malloc() and should
+ * be released with free(). NULL is returned if the file can't be read or is not a dump. */
+TraceRecord *recorder_load (const char *path, int *count, uint64_t *total);
+
+/* Write a record out the same way that the interpreter traces the instruction that it was made from, with
+ * as much detail as the trace level given asks for. */
+void recorder_print (const TraceRecord *record, VMTraceLevel level, FILE *out);
+
+/***********************************************************************************************************/
+
+/* Fill out the record provided with the details of the instruction about to be executed. */
+static inline void recorder_fill (TraceRecord *record, const VMContext *context,
+                                  const Instruction *instruction)
+{
+    const char *mask = opcode_operand_mask (instruction->opcode);
+    int i;
+
+    record->ip = instruction->ip;
+    record->opcode = (uint16_t) instruction->opcode;
+    record->pCount = (uint16_t) (instruction->pCount < RECORDER_PARAMETERS ? instruction->pCount :
+                                 RECORDER_PARAMETERS);
+    record->sp = context->sp;
+    record->top = context->sp >= 0 ? context->stack[context->sp] : 0;
+
+    for (i = 0 ; i < RECORDER_PARAMETERS ; i++)
+    {
+        record->parameters[i] = i < record->pCount ? instruction->parameters[i] : 0;
+        record->values[i] = 0;
+
+        if (i < record->pCount && mask[i] == 'r')
+            record->values[i] = context->registers[record->parameters[i]];
+    }
+}
+
+/* Record an instruction that is about to run. The engines that record call this for every instruction that
+ * they execute except for IHALTs; the IHALT record comes from recorder_halt() instead, since a program can
+ * halt with an error without executing one. */
+static inline void recorder_write (VMRecorder *recorder, const VMContext *context,
+                                   const Instruction *instruction)
+{
+    uint64_t head = atomic_load_explicit (&recorder->head, memory_order_relaxed);
+
+    recorder_fill (&recorder->records[head & recorder->mask], context, instruction);
+
+    /* Publish the record only once it's all there, for anything dumping it. */
+    atomic_store_explicit (&recorder->head, head + 1, memory_order_release);
+}
+
+/* Record that the program is being halted because of an error, and why. The opcode is only used for errors
+ * that are about a specific opcode. */
+void recorder_halt (VMRecorder *recorder, const VMContext *context, IHALT_Reason reason, Opcode opcode);
+
+/***********************************************************************************************************/
+
+#endif
@@ -0,0 +1,29 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include "registers.h"
+
+/***********************************************************************************************************/
+
+/* Convert a register into a textual name. */
+const char *register_name (Register reg)
+{
+    switch (reg)
+    {
+        case REG_A: return "REG_A";
+        case REG_B: return "REG_B";
+        case REG_C: return "REG_C";
+        case REG_D: return "REG_D";
+        case REG_E: return "REG_E";
+        case REG_F: return "REG_F";
+
+        /* Do nothing here, so we fall through and trigger on the default below. */
+        case REGISTER_COUNT:
+                    break;
+    }
+
+    /* This isn't a default case so that we can determine when we forgot to modify this switch. */
+    return "???";
+}
+
+/***********************************************************************************************************/
@@ -31,4 +31,9 @@ typedef enum
 
 /***********************************************************************************************************/
 
+/* Convert a register into a textual name. */
+const char *register_name (Register reg);
+
+/***********************************************************************************************************/
+
 #endif
@@ -0,0 +1,347 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "scheduler.h"
+
+/***********************************************************************************************************/
+
+/* The number of instructions that a context runs for before it has to give the worker to the next one. See
+ * vm_run_for() for how these are counted. */
+#define SCHED_SLICE 100000
+
+/***********************************************************************************************************/
+
+/* The queue of contexts that a worker has waiting to run. The worker that owns the queue takes contexts from
+ * the back and other workers steal from the front, so the two rarely go after the same context. Since every
+ * context is only ever in one queue, each one is big enough to hold all of them. */
+typedef struct
+{
+    pthread_mutex_t lock;
+
+    /* A ring buffer of contexts; there are count of them waiting to run, starting at head. */
+    VMContext **items;
+    int capacity;
+    int head;
+    int count;
+} SchedulerQueue;
+
+/* The state of a batch that is being run. */
+typedef struct Scheduler Scheduler;
+
+/* A worker thread, and everything that it owns. */
+typedef struct
+{
+    Scheduler *scheduler;
+    int index;
+
+    SchedulerQueue queue;
+    SchedulerStats stats;
+
+    /* The state of the random number generator used to pick where to start looking for work to steal. */
+    unsigned int seed;
+
+    pthread_t thread;
+} SchedulerWorker;
+
+struct Scheduler
+{
+    SchedulerWorker *workers;
+    int workerCount;
+
+    SchedulerCallback callback;
+    void *userData;
+
+    /* The number of contexts that have not halted yet. Workers keep looking for work until this is 0. */
+    atomic_int remaining;
+
+    /* Workers that have nothing to run and nothing to steal wait on idleWake until there might be something
+     * for them, which is when a context is added to a queue behind another one, or when the batch is done.
+     * Each of those adds one to wakeups, which is how a worker knows that something happened while it was
+     * looking. All three are protected by idleLock. */
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleWake;
+    int idle;
+    unsigned int wakeups;
+};
+
+/***********************************************************************************************************/
+
+/* Add a context to the queue provided; to the front if front is true, or to the back otherwise. Returns
+ * the number of contexts in the queue after adding it. */
+static int queue_push (SchedulerQueue *queue, VMContext *context, int front)
+{
+    int count;
+
+    pthread_mutex_lock (&queue->lock);
+    if (front)
+    {
+        queue->head = (queue->head + queue->capacity - 1) % queue->capacity;
+        queue->items[queue->head] = context;
+    }
+    else
+        queue->items[(queue->head + queue->count) % queue->capacity] = context;
+
+    count = ++queue->count;
+    pthread_mutex_unlock (&queue->lock);
+
+    return count;
+}
+
+/***********************************************************************************************************/
+
+/* Take a context from the queue provided; from the back if this is the worker that owns it, or from the
+ * front otherwise. Returns NULL if the queue is empty. */
+static VMContext *queue_take (SchedulerQueue *queue, int owner)
+{
+    VMContext *context = NULL;
+
+    pthread_mutex_lock (&queue->lock);
+    if (queue->count > 0)
+    {
+        queue->count--;
+
+        if (owner)
+            context = queue->items[(queue->head + queue->count) % queue->capacity];
+        else
+        {
+            context = queue->items[queue->head];
+            queue->head = (queue->head + 1) % queue->capacity;
+        }
+    }
+    pthread_mutex_unlock (&queue->lock);
+
+    return context;
+}
+
+/***********************************************************************************************************/
+
+/* Look for a context to steal from the other workers, starting at a random one so that the workers don't
+ * all go after the same queue. Returns NULL if there was nothing to steal. */
+static VMContext *sched_steal (SchedulerWorker *worker)
+{
+    Scheduler *scheduler = worker->scheduler;
+    int start, i;
+
+    worker->seed = worker->seed * 1103515245 + 12345;
+    start = (int) ((worker->seed >> 16) % (unsigned int) scheduler->workerCount);
+
+    for (i = 0 ; i < scheduler->workerCount ; i++)
+    {
+        SchedulerWorker *victim = &scheduler->workers[(start + i) % scheduler->workerCount];
+        VMContext *context;
+
+        if (victim == worker)
+            continue;
+
+        context = queue_take (&victim->queue, 0);
+        if (context != NULL)
+            return context;
+    }
+
+    return NULL;
+}
+
+/***********************************************************************************************************/
+
+/* Let the workers that are waiting for something to do know that there might be something now. */
+static void sched_wake (Scheduler *scheduler)
+{
+    pthread_mutex_lock (&scheduler->idleLock);
+    scheduler->wakeups++;
+    if (scheduler->idle > 0)
+        pthread_cond_broadcast (&scheduler->idleWake);
+    pthread_mutex_unlock (&scheduler->idleLock);
+}
+
+/***********************************************************************************************************/
+
+/* Wait until there might be something for the provided worker to steal, which there might already be if
+ * anything woke the workers since the wakeup count given was read, or until the batch is done. */
+static void sched_idle (SchedulerWorker *worker, unsigned int wakeups)
+{
+    Scheduler *scheduler = worker->scheduler;
+
+    pthread_mutex_lock (&scheduler->idleLock);
+    scheduler->idle++;
+    while (scheduler->wakeups == wakeups && atomic_load (&scheduler->remaining) > 0)
+        pthread_cond_wait (&scheduler->idleWake, &scheduler->idleLock);
+    scheduler->idle--;
+    pthread_mutex_unlock (&scheduler->idleLock);
+}
+
+/***********************************************************************************************************/
+
+/* Read the number of times that the workers have been woken so far. */
+static unsigned int sched_wakeups (Scheduler *scheduler)
+{
+    unsigned int wakeups;
+
+    pthread_mutex_lock (&scheduler->idleLock);
+    wakeups = scheduler->wakeups;
+    pthread_mutex_unlock (&scheduler->idleLock);
+
+    return wakeups;
+}
+
+/***********************************************************************************************************/
+
+/* The body of a worker thread, which runs contexts until they have all halted (or been suspended). Each
+ * context only runs for a slice at a time, so that a program that runs for a long time (or forever) doesn't
+ * keep the contexts queued up behind it from running. */
+static void *sched_worker (void *data)
+{
+    SchedulerWorker *worker = data;
+    Scheduler *scheduler = worker->scheduler;
+
+    while (atomic_load (&scheduler->remaining) > 0)
+    {
+        VMContext *context = queue_take (&worker->queue, 1);
+
+        if (context == NULL)
+        {
+            unsigned int wakeups = sched_wakeups (scheduler);
+
+            context = sched_steal (worker);
+            if (context == NULL)
+            {
+                /* Everything left is being run by someone else, so there's nothing to do until one of them
+                 * has a context to spare or the batch is done. */
+                worker->stats.failedSteals++;
+                sched_idle (worker, wakeups);
+                continue;
+            }
+
+            worker->stats.stolen++;
+        }
+
+        /* A context that isn't done yet goes to the front of the queue, so that it only comes up again once
+         * everything else in the queue has had a turn. If there is anything else, the workers that are waiting
+         * can steal it; if not, this worker is just going to carry on with the same context. */
+        if (vm_run_for (context, SCHED_SLICE) == VM_STATUS_BUDGET_EXHAUSTED)
+        {
+            if (queue_push (&worker->queue, context, 1) > 1)
+                sched_wake (scheduler);
+
+            worker->stats.preempted++;
+            continue;
+        }
+
+        worker->stats.completed++;
+
+        if (scheduler->callback != NULL)
+            scheduler->callback (context, worker->index, scheduler->userData);
+
+        /* The workers that are waiting for something to do stop once there isn't anything left. */
+        if (atomic_fetch_sub (&scheduler->remaining, 1) == 1)
+            sched_wake (scheduler);
+    }
+
+    return NULL;
+}
+
+/***********************************************************************************************************/
+
+/* Get the number of workers that sched_run() would use for the requested number of workers. */
+int sched_workers (int workers)
+{
+    if (workers <= 0)
+    {
+        long online = sysconf (_SC_NPROCESSORS_ONLN);
+        workers = online > 0 ? (int) online : 1;
+    }
+
+    return workers;
+}
+
+/***********************************************************************************************************/
+
+/* Run every one of the contexts provided until it halts, using the number of worker threads given. */
+int sched_run (VMContext **contexts, int count, int workers, SchedulerCallback callback, void *userData,
+               SchedulerStats *stats)
+{
+    Scheduler scheduler;
+    int i, started, result = 0;
+
+    scheduler.workerCount = sched_workers (workers);
+    scheduler.callback = callback;
+    scheduler.userData = userData;
+    atomic_init (&scheduler.remaining, count);
+    pthread_mutex_init (&scheduler.idleLock, NULL);
+    pthread_cond_init (&scheduler.idleWake, NULL);
+    scheduler.idle = 0;
+    scheduler.wakeups = 0;
+
+    scheduler.workers = calloc (scheduler.workerCount, sizeof (SchedulerWorker));
+    if (scheduler.workers == NULL)
+    {
+        pthread_mutex_destroy (&scheduler.idleLock);
+        pthread_cond_destroy (&scheduler.idleWake);
+        return 0;
+    }
+
+    for (i = 0 ; i < scheduler.workerCount ; i++)
+    {
+        SchedulerWorker *worker = &scheduler.workers[i];
+
+        worker->scheduler = &scheduler;
+        worker->index = i;
+        worker->seed = (unsigned int) i + 1;
+        worker->queue.capacity = count > 0 ? count : 1;
+        worker->queue.items = malloc (sizeof (VMContext *) * worker->queue.capacity);
+        pthread_mutex_init (&worker->queue.lock, NULL);
+
+        if (worker->queue.items == NULL)
+        {
+            scheduler.workerCount = i + 1;
+            goto done;
+        }
+    }
+
+    /* Deal out the contexts in contiguous runs, so that each worker starts on its own part of the batch. */
+    for (i = 0 ; i < count ; i++)
+        queue_push (&scheduler.workers[(int) ((long long) i * scheduler.workerCount / count)].queue,
+                    contexts[i], 0);
+
+    /* This thread is the first worker. If some of the others can't be started, the workers that are running
+     * steal their contexts, so the batch still gets run. */
+    started = 1;
+    for (i = 1 ; i < scheduler.workerCount ; i++)
+    {
+        if (pthread_create (&scheduler.workers[i].thread, NULL, sched_worker, &scheduler.workers[i]) != 0)
+            break;
+
+        started++;
+    }
+
+    sched_worker (&scheduler.workers[0]);
+
+    for (i = 1 ; i < started ; i++)
+        pthread_join (scheduler.workers[i].thread, NULL);
+
+    if (stats != NULL)
+    {
+        for (i = 0 ; i < scheduler.workerCount ; i++)
+            stats[i] = scheduler.workers[i].stats;
+    }
+
+    result = scheduler.workerCount;
+
+done:
+    for (i = 0 ; i < scheduler.workerCount ; i++)
+    {
+        free (scheduler.workers[i].queue.items);
+        pthread_mutex_destroy (&scheduler.workers[i].queue.lock);
+    }
+    free (scheduler.workers);
+
+    pthread_mutex_destroy (&scheduler.idleLock);
+    pthread_cond_destroy (&scheduler.idleWake);
+
+    return result;
+}
+
+/***********************************************************************************************************/
@@ -0,0 +1,68 @@
+#ifndef __SCHEDULERdotH__
+#define __SCHEDULERdotH__
+
+/***********************************************************************************************************/
+
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* This is called by the scheduler every time that one of the contexts it is running halts, or is suspended by
+ * a host function (which the callback can tell from context->suspended). It is passed the context, the index
+ * of the worker that ran it and the user data that was given to sched_run().
+ *
+ * It's called from whichever worker thread finished the context, so it needs to be safe to call from several
+ * threads at once. */
+typedef void (*SchedulerCallback) (VMContext *context, int worker, void *userData);
+
+/* The statistics that the scheduler keeps for each of its workers while it runs a batch. */
+typedef struct
+{
+    /* The number of contexts that this worker ran until they halted or were suspended, and how many of those
+     * it stole from the queue of some other worker. */
+    int completed;
+    int stolen;
+
+    /* The number of times that a context used up its time slice on this worker and was put back in the
+     * queue to give the others a turn. */
+    int preempted;
+
+    /* The number of times this worker looked through the queues of all of the other workers for something to
+     * steal, came up empty handed and had to wait for something to do. */
+    int failedSteals;
+} SchedulerStats;
+
+/***********************************************************************************************************/
+
+/* Run every one of the contexts provided until it halts, using the number of worker threads given; if this
+ * is 0 or less, one worker is used for every processor that is online. The calling thread is one of the
+ * workers, and this doesn't return until every context has halted.
+ *
+ * The contexts are shared out evenly between the queues of the workers to start with. Each worker runs the
+ * contexts from its own queue, and when that runs out it steals from the queues of the other workers, which
+ * keeps all of them busy even when some programs take much longer than others. Contexts are run a time
+ * slice at a time (see vm_run_for()), so a program that never halts holds up the rest of the batch from
+ * finishing but not from running.
+ *
+ * The contexts must all be initialized and must all be different; they are run with whatever engine and
+ * trace level they are set up with. Output from contexts that trace anything is interleaved however the
+ * threads happen to run. When callback is not NULL it is called for each context as it halts.
+ *
+ * A context that a host function suspends is done as far as this is concerned, the same as if it had halted,
+ * so this returns once every context has either halted or is waiting on its host. This is what a host with
+ * an event loop builds on: it runs all of its contexts, waits for the work that the suspended ones started
+ * all at once, resumes the ones whose work is done (see ctx_resume()) and runs those again.
+ *
+ * If stats is not NULL, it needs room for the stats of every worker, and is filled out with them. The
+ * return value is the number of workers used, or 0 if the memory to run the batch could not be allocated,
+ * in which case none of the contexts have been run. Linking with pthreads is required to use this. */
+int sched_run (VMContext **contexts, int count, int workers, SchedulerCallback callback, void *userData,
+               SchedulerStats *stats);
+
+/* Get the number of workers that sched_run() would use for the requested number of workers. This is useful
+ * for knowing how big the stats array needs to be. */
+int sched_workers (int workers);
+
+/***********************************************************************************************************/
+
+#endif
@@ -0,0 +1,27 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include "snapshot.h"
+#include "decode.h"
+
+/***********************************************************************************************************/
+
+/* Create a snapshot with room for a stack with the given number of entries in use. */
+VMSnapshot *snapshot_create (int depth)
+{
+    return calloc (1, sizeof (VMSnapshot) + sizeof (int) * (depth > 0 ? depth : 0));
+}
+
+/***********************************************************************************************************/
+
+/* Release a snapshot created with snapshot_create() or ctx_snapshot(). */
+void snapshot_release (VMSnapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return;
+
+    decode_release (snapshot->decoded);
+    free (snapshot);
+}
+
+/***********************************************************************************************************/
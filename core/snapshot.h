@@ -0,0 +1,64 @@
+#ifndef __SNAPSHOTdotH__
+#define __SNAPSHOTdotH__
+
+/***********************************************************************************************************/
+
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* The state of a context at some point in its program, which it or any number of other contexts running the
+ * same program can be put back into later to carry on from there; see ctx_snapshot(), ctx_restore() and
+ * ctx_fork(). This lets a host run a common prefix of a program once and then branch off into variants of
+ * it, instead of running the prefix again for every one of them.
+ *
+ * A snapshot is never changed once it's taken, so it can be shared between contexts on different threads.
+ * It only keeps the part of the stack that is in use, which is usually a handful of entries no matter how
+ * large the stack is, and that is all that is copied back out of it; the rest of the stack of a context
+ * holds nothing that the program can see. */
+typedef struct VMSnapshot
+{
+    /* The program that the snapshot was taken of, in whichever form the context was running it. A snapshot
+     * can only be restored into a context running the same one. */
+    int *program;
+    int pSize;
+    const unsigned char *compact;
+    int compactSize;
+
+    /* The engine and trace level of the context, which are what a fork gets, and the decoded program of the
+     * context if it had been decoded, which a fork shares; the snapshot holds a reference to it. */
+    VMEngine engine;
+    VMTraceLevel traceLevel;
+    struct DecodedProgram *decoded;
+
+    /* Whether the program was halted, and by an error, and if so why, and whether it was suspended. */
+    int halted;
+    int suspended;
+    int error;
+    int errorReason;
+    int errorOpcode;
+
+    /* The IP and the stack pointer. */
+    int ip;
+    int sp;
+
+    /* The registers. */
+    int registers[REGISTER_COUNT];
+
+    /* The entries of the stack that are in use, of which there are sp + 1. */
+    int stack[];
+} VMSnapshot;
+
+/***********************************************************************************************************/
+
+/* Create a snapshot with room for a stack with the given number of entries in use. Everything else in it is
+ * zero. Returns NULL if the memory could not be allocated. Release it with snapshot_release(). */
+VMSnapshot *snapshot_create (int depth);
+
+/* Release a snapshot created with snapshot_create() or ctx_snapshot(), along with its reference to a decoded
+ * program. NULL is allowed. */
+void snapshot_release (VMSnapshot *snapshot);
+
+/***********************************************************************************************************/
+
+#endif
@@ -0,0 +1,153 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "verify.h"
+#include "decode.h"
+
+/***********************************************************************************************************/
+
+/* Fill out the error provided (if there is one) and return 0 to indicate that verification failed. */
+static int verify_fail (VerifyError *error, IHALT_Reason reason, int ip, Opcode opcode)
+{
+    if (error != NULL)
+    {
+        error->reason = reason;
+        error->ip = ip;
+        error->opcode = opcode;
+    }
+
+    return 0;
+}
+
+/***********************************************************************************************************/
+
+/* Check the decoded instructions one at a time. Everything in the program is checked, whether it can be
+ * reached or not. Returns 1 if everything is valid or 0 (after filling out the error) if not. */
+static int verify_instructions (const Instruction *code, int codeEnd, VerifyError *error)
+{
+    int i;
+
+    for (i = 0 ; i < codeEnd ; i++)
+    {
+        const Instruction *instruction = &code[i];
+
+        /* The decoder turns an explicit IHALT, a missing operand and a bad register into an IHALT at that
+         * position; the ones that are about a specific opcode carry it in their second parameter. */
+        if (instruction->opcode == IHALT)
+            return verify_fail (error, (IHALT_Reason) instruction->parameters[0], instruction->ip,
+                                instruction->pCount > 1 ? (Opcode) instruction->parameters[1] : IHALT);
+
+        /* Opcodes that don't exist. */
+        if ((unsigned int) instruction->opcode >= OPCODE_COUNT)
+            return verify_fail (error, IHALT_INVALID_OPCODE, instruction->ip, instruction->opcode);
+
+        /* The decoder resolves jumps that don't land on an instruction to IHALTs after the end of the
+         * program. */
+        if (opcode_is_jump (instruction->opcode) && instruction->target > codeEnd)
+            return verify_fail (error, IHALT_INVALID_IP, instruction->ip, instruction->opcode);
+    }
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Follow every path through the program from the start, making sure that none of them can run off the end of
+ * the program and that at least one of them reaches a HALT. The instructions are known to be valid by the
+ * time this is called. Returns 1 if everything is valid or 0 (after filling out the error) if not. */
+static int verify_flow (const Instruction *code, int codeEnd, int programLength, VerifyError *error)
+{
+    char *reached;
+    int *pending;
+    int count = 0, halts = 0;
+
+    /* An empty program runs off the end right away. */
+    if (codeEnd == 0)
+        return verify_fail (error, IHALT_MISSING_OPCODE, 0, NOP);
+
+    reached = calloc (codeEnd, sizeof (char));
+    pending = malloc (sizeof (int) * codeEnd);
+    if (reached == NULL || pending == NULL)
+    {
+        free (reached);
+        free (pending);
+        return verify_fail (error, IHALT_UNKNOWN, 0, NOP);
+    }
+
+    /* Start at the first instruction and visit everything that can be reached from it. */
+    reached[0] = 1;
+    pending[count++] = 0;
+
+    while (count > 0)
+    {
+        int i = pending[--count];
+        int next[2], nextCount = 0, n;
+
+        /* Work out where execution can go from here. */
+        switch (code[i].opcode)
+        {
+            case HALT:
+                halts++;
+                break;
+
+            /* The only jump that never carries on to the next instruction. */
+            case JMP:
+                next[nextCount++] = code[i].target;
+                break;
+
+            default:
+                if (opcode_is_jump (code[i].opcode))
+                    next[nextCount++] = code[i].target;
+                next[nextCount++] = i + 1;
+                break;
+        }
+
+        for (n = 0 ; n < nextCount ; n++)
+        {
+            /* Going anywhere past the last instruction is running off the end of the program. */
+            if (next[n] >= codeEnd)
+            {
+                free (reached);
+                free (pending);
+                return verify_fail (error, IHALT_MISSING_OPCODE, code[i].ip, code[i].opcode);
+            }
+
+            if (reached[next[n]] == 0)
+            {
+                reached[next[n]] = 1;
+                pending[count++] = next[n];
+            }
+        }
+    }
+
+    free (reached);
+    free (pending);
+
+    /* Every path loops forever if there's no way to get to a HALT. */
+    if (halts == 0)
+        return verify_fail (error, IHALT_MISSING_OPCODE, programLength, NOP);
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Check that the bytecode program provided is valid, all at once, before it is run. */
+int verify_program (const int *program, int programLength, VerifyError *error)
+{
+    Instruction *code;
+    int codeSize, codeEnd, result;
+
+    /* Decoding the program does most of the work of finding problems. */
+    code = decode_program (program, programLength, &codeSize, &codeEnd);
+    if (code == NULL)
+        return verify_fail (error, IHALT_UNKNOWN, 0, NOP);
+
+    result = verify_instructions (code, codeEnd, error) && verify_flow (code, codeEnd, programLength, error);
+
+    free (code);
+    return result;
+}
+
+/***********************************************************************************************************/
@@ -0,0 +1,40 @@
+#ifndef __VERIFYdotH__
+#define __VERIFYdotH__
+
+/***********************************************************************************************************/
+
+#include "vm.h"
+
+/***********************************************************************************************************/
+
+/* This structure describes why a program failed verification. */
+typedef struct
+{
+    /* The reason that the program is not valid. This is the reason that the interpreter would give in the
+     * IHALT that it issues if it ran into the problem while running the program. */
+    IHALT_Reason reason;
+
+    /* The IP of the instruction at fault and its opcode. When a program has no way to reach a HALT at all,
+     * the IP is the end of the program. */
+    int ip;
+    Opcode opcode;
+} VerifyError;
+
+/***********************************************************************************************************/
+
+/* Check that the bytecode program provided is valid, all at once, before it is run. A valid program:
+ *    - only contains opcodes that exist, and never contains an IHALT
+ *    - has all of the operands for every opcode in it, and every register operand is a valid register
+ *    - only has jumps that land on the start of an instruction in the program
+ *    - can reach a HALT, and can never run off of the end of the program
+ *
+ * A valid program will never IHALT for anything except a problem with the stack, and it never names a
+ * register that doesn't exist.
+ *
+ * The return value is 1 if the program is valid. Otherwise it is 0, and if error is not NULL it is filled out
+ * with the first problem found. */
+int verify_program (const int *program, int programLength, VerifyError *error);
+
+/***********************************************************************************************************/
+
+#endif
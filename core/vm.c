@@ -2,73 +2,43 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <stdarg.h>
 #include "vm.h"
 #include "context.h"
+#include "decode.h"
+#include "analyze.h"
+#include "jit.h"
+#include "aot.h"
+#include "compact.h"
+#include "profile.h"
+#include "recorder.h"
+#include "output.h"
 
 /***********************************************************************************************************/
 
-/* Convert an opcode into a textual name. */
-static const char *opcode_name (Opcode opcode)
-{
-    switch (opcode)
-    {
-        case NOP:   return "NOP";
-        case PUSH:  return "PUSH";
-        case POP:   return "POP";
-        case SET:   return "SET";
-        case ADD:   return "ADD";
-        case RADD:  return "RADD";
-        case RDEC:  return "RDEC";
-        case RJNE:  return "RJNE";
-        case HALT:  return "HALT";
-        case IHALT: return "IHALT";
-    }
-
-    /* This isn't a default case so that we can determine when we forgot to modify this switch. */
-    return "???";
-}
-
-/***********************************************************************************************************/
-
-/* Convert a register into a textual name. */
-static const char *register_name (Register reg)
-{
-    switch (reg)
-    {
-        case REG_A: return "REG_A";
-        case REG_B: return "REG_B";
-        case REG_C: return "REG_C";
-        case REG_D: return "REG_D";
-        case REG_E: return "REG_E";
-        case REG_F: return "REG_F";
-
-        /* Do nothing here, so we fall through and trigger on the default below. */
-        case REGISTER_COUNT:
-                    break;
-    }
-
-    /* This isn't a default case so that we can determine when we forgot to modify this switch. */
-    return "???";
-}
+/* Code that is only ever run on the way out of a program that has failed is kept out of line. */
+#if defined (__GNUC__)
+#  define VM_COLD __attribute__ ((cold, noinline))
+#else
+#  define VM_COLD
+#endif
 
 /***********************************************************************************************************/
 
 /* Convert the error reason from an IHALT instruction into a human readable string. The opcode parameter
- * provided is only valid in cases where decode_instruction() detected an error that requires the offending
+ * provided is only valid in cases where decode_program() detected an error that requires the offending
  * opcode to be used in the error and for which it remembers to set it. Otherwise it's probably NOP. 
  *
- * This *might* use static storage, so make a copy of the return value if you want it to remain valid between
- * calls. */
-static char ihalt_error_buffer[256];
-static const char *ihalt_error_reason (IHALT_Reason errorReason, Opcode opcode)
+ * This *might* use storage that belongs to the calling thread, so make a copy of the return value if you want
+ * it to remain valid between calls. */
+static _Thread_local char ihalt_error_buffer[256];
+const char *ihalt_error_reason (IHALT_Reason errorReason, Opcode opcode)
 {
     /* Handle the different IHalt reasons. */
     switch (errorReason)
     {
         /* We don't know the reason for the error. */
         case IHALT_UNKNOWN: 
-            return "Unknown error (maybe fix decode_instruction() so this doesn't happen?)";
+            return "Unknown error (maybe fix decode_program() so this doesn't happen?)";
 
         /* An IHALT instruction was explicitly found in the bytecode, which is not allowed because they are
          * our error mechanism. */
@@ -89,385 +59,916 @@ static const char *ihalt_error_reason (IHALT_Reason errorReason, Opcode opcode)
 
         case IHALT_STACK_UNDERFLOW:
             return "Stack underflow";
-    }
-
-    return "So broken I don't even know that the error is an unknown error!";
-}
 
-/***********************************************************************************************************/
+        case IHALT_INVALID_IP:
+            return "Execution continued at an IP that is not the start of an instruction";
 
-/* Obtain the number of operands an opcode expects. */
-static int opcode_operand_count (Opcode opcode)
-{
-    switch (opcode)
-    {
-        /* Need a value to push. */
-        case PUSH: 
-            return 1;
+        case IHALT_INVALID_OPCODE:
+            return "Bytecode contains an opcode that does not exist";
 
-        /* Need the register to set. */
-        case SET:  
-            return 1;
+        /* An opcode in the bytecode stream names a register that does not exist. */
+        case IHALT_INVALID_REGISTER:
+            snprintf (ihalt_error_buffer, sizeof (ihalt_error_buffer), "Opcode (%s) uses a register that does not exist", opcode_name (opcode));
+            return ihalt_error_buffer;
 
-        /* Need two registers to add. */
-        case RADD:
-            return 2;
-              
-        /* Needs the register to decrement. */
-        case RDEC:
-            return 1;
+        /* A CALL asked for a host function that isn't there. */
+        case IHALT_INVALID_HOST_CALL:
+            return "CALL to a host function that does not exist";
 
-        /* Requires a register and a jump offset. */
-        case RJNE:
-            return 2;
-
-        /* These operate on the stack or otherwise do not require parameters. */
-        case NOP:
-        case POP:  
-        case ADD:  
-        case HALT: 
-            return 0;
-
-        /* The IHALT instruction actually takes 1 or more arguments, but it's not allowed to appear in user
-         * programs, so as far as this is concerned, it takes none. This allows for us to detect that it
-         * exists in the program stream and flag it as an error without having to fiddle with worrying if it
-         * has enough parameters. */
-        case IHALT:
-            return 0;
+        case IHALT_HOST_CALL_FAILED:
+            return "Host function called by CALL failed";
     }
 
-    /* Because the compiler is kind of stupid. */
-    return 0;
+    return "So broken I don't even know that the error is an unknown error!";
 }
 
 /***********************************************************************************************************/
 
-/* Obtain the operand mask for an opcode. This is a simple string that contains one character for each of the
- * operands, where each character is laid out as follows:
- *     i: an integer number
- *     r: a register
- *
- * This is used by the trace functionality to display operands properly. */
-static const char *opcode_operand_mask (Opcode opcode)
+#if VM_TRACE_ENABLED
+
+/* Get the output sink that the provided context displays things with, creating the default one if it doesn't
+ * have one yet. Returns NULL if there isn't the memory for it, in which case the output is lost. */
+static VMOutput *vm_output (VMContext *context)
 {
-    switch (opcode)
-    {
-        /* Need a value to push. */
-        case PUSH: 
-            return "i";
+    if (context->output == NULL)
+        ctx_output_fd (context, STDERR_FILENO, VM_OUTPUT_FLUSH_RUN);
 
-        /* Need the register to set. */
-        case SET:  
-            return "r";
+    return context->output;
+}
 
-        /* Need two registers to add. */
-        case RADD:
-            return "rr";
+#endif
 
-        /* Needs the register to decrement. */
-        case RDEC:
-            return "r";
+/***********************************************************************************************************/
 
-        /* Requires a register and a jump offset. */
-        case RJNE:
-            return "ri";
-
-        /* These operate on the stack or otherwise do not require parameters. */
-        case NOP:
-        case POP:  
-        case ADD:  
-        case HALT: 
-            return "";
-
-        /* The IHALT instruction actually takes 1 or more arguments, but it's not allowed to appear in user
-         * programs, so as far as this is concerned, it takes none. This allows for us to detect that it
-         * exists in the program stream and flag it as an error without having to fiddle with worrying if it
-         * has enough parameters. */
-        case IHALT:
-            return "";
-    }
+/* Display an error message that isn't the fault of the program, if the context wants errors traced. */
+static void vm_error (VMContext *context, const char *message)
+{
+#if VM_TRACE_ENABLED
+    VMOutput *output;
 
-    /* Because the compiler is kind of stupid. */
-    return "";
+    if (context->traceLevel >= VM_TRACE_ERRORS && (output = vm_output (context)) != NULL)
+    {
+        output_string (output, ">> *** << ");
+        output_string (output, message);
+        output_end_line (output);
+    }
+#endif
 }
 
 /***********************************************************************************************************/
 
-/* Initialize an IHALT instruction. The reason for the halt will be the one provided. All other parameters
- * are the parameters that are required for the specific error reason. It's up to the caller to pass in the
- * required values in the required order. */
-static void init_ihalt_instruction (Instruction *instruction, IHALT_Reason reason, int params, ...)
+/* Halt the program in the provided context because of an error, keeping the reason for it and the opcode
+ * that it's about (NOP if it isn't about one) for vm_run_result(). Every error in a program leaves the engines
+ * through here, and only once, so this is kept out of line where it doesn't take up room in them. The reason
+ * is only displayed if the context wants errors traced. */
+static VM_COLD void vm_trap (VMContext *context, IHALT_Reason errorReason, Opcode opcode)
 {
-    va_list args;
-
-    /* Minimum used parameters is 1, for the reason. */
-    int usedParams = 1;
+    /* Display the message now. */
+    vm_error (context, "Invalid program detected");
+    vm_error (context, ihalt_error_reason (errorReason, opcode));
 
-    /* Set up the opcode and the single known parameter, which is the reason for the halt. */
-    instruction->opcode = IHALT;
-    instruction->parameters[0] = reason;
+    /* The recording ends with why. */
+    if (context->recorder != NULL)
+        recorder_halt (context->recorder, context, errorReason, opcode);
 
-    /* Based on the reason, add in the extra parameters. */
-    va_start(args, params);
-    switch (reason)
-    {
-        /* The extra parameter is the first parameter, which we don't need special gymnastics to get. */
-        case IHALT_MISSING_OPCODE_PARAMETER:
-            instruction->parameters[1] = params;
-            usedParams++;
-            break;
+    /* No more operations on this context now. */
+    context->halted = 1;
+    context->error = 1;
+    context->errorReason = errorReason;
+    context->errorOpcode = opcode;
+}
 
-        /* va_arg(args, int); */
+/***********************************************************************************************************/
 
-        /* All other reasons require no parameters. */
-        default:
-            break;
-    }
-    va_end(args);
+/* Halt the program in the provided context because there isn't the memory for something that running it
+ * needs, which isn't the fault of the program, displaying the message given if the context wants errors
+ * traced. */
+static VM_COLD void vm_no_memory (VMContext *context, const char *message)
+{
+    vm_error (context, message);
 
-    instruction->pCount = usedParams;
+    context->halted = 1;
+    context->error = 1;
+    context->errorReason = IHALT_UNKNOWN;
+    context->errorOpcode = NOP;
 }
 
 /***********************************************************************************************************/
 
-/* Decode the next instruction in the program stream of the given context into the buffer provided. 
- *
- * The instruction comes out as an internal halt (IHALT) if there is an error fetching the opcode or its
- * parameters. */
-static void decode_instruction (VMContext *context, Instruction *instruction)
+/* Make sure that the decoded program of the provided context is one that it can change, by taking a copy of
+ * its own if it's shared (see ctx_fork()). Returns 0 if there isn't the memory for the copy, which halts the
+ * program with an error. */
+static int vm_unshare (VMContext *context)
 {
-    Opcode opcode;
-    int i, count;
-
-    /* Default the instruction to being an unknown error halt. */
-    init_ihalt_instruction (instruction, IHALT_UNKNOWN, 0);
+    DecodedProgram *decoded = decode_unshare (context->decoded);
 
-    /* Leave if there is not an opcode left. */
-    if (context->ip >= context->pSize)
+    if (decoded == NULL)
     {
-        /* Swap the error reason. */
-        instruction->parameters[0] = IHALT_MISSING_OPCODE;
-        return;
+        vm_no_memory (context, "Unable to allocate memory to copy the decoded program");
+        return 0;
     }
 
-    /* Fetch this opcode and determine how many operands it requires. */
-    opcode = (Opcode) context->program[context->ip];
-    count = opcode_operand_count (opcode);
+    context->decoded = decoded;
+    return 1;
+}
 
-    /* If this is an IHALT instruction, that's bad. */
-    if (opcode == IHALT)
-    {
-        instruction->parameters[0] = IHALT_IHALT_EXPLICIT;
-        return;
-    }
+/***********************************************************************************************************/
+
+/* Call the host function with the index provided for a CALL in the provided context, whose stack pointer
+ * (and stack) must be up to date, since the function sees the stack through the context. A function that
+ * suspends the program leaves it suspended; one that fails, or isn't there, traps. Returns what the function
+ * asked for. */
+static VMHostResult vm_call (VMContext *context, int function)
+{
+    VMHostResult result;
 
-    /* Leave if there are not enough extra slots in the program to fulfill all of the arguments of this
-     * particular opcode. */
-    if (context->ip + opcode_operand_count (opcode) >= context->pSize)
+    if (function < 0 || function >= context->hostCount || context->host[function] == NULL)
     {
-        /* In this case, we need to change the error message and also add in the offending opcode, which
-         * requires altering the parameter count. */
-        instruction->parameters[0] = IHALT_MISSING_OPCODE_PARAMETER;
-        instruction->parameters[1] = opcode;
-        instruction->pCount++;
-        return;
+        vm_trap (context, IHALT_INVALID_HOST_CALL, NOP);
+        return VM_HOST_FAIL;
     }
 
-    /* We're all good, so copy over. */
-    instruction->opcode = opcode;
-    instruction->pCount = count;
+    result = context->host[function] (context, context->hostData);
+    if (result == VM_HOST_FAIL)
+        vm_trap (context, IHALT_HOST_CALL_FAILED, NOP);
+    else if (result == VM_HOST_SUSPEND)
+        context->suspended = 1;
 
-    /* Copy the required parameters over. We need to add 1 to the ip to skip over the instruction. */
-    for (i = 0 ; i < count ; i++)
-        instruction->parameters[i] = context->program[context->ip + i + 1];
+    return result;
 }
 
 /***********************************************************************************************************/
 
-/* Assume that the instruction passed in is an IHALT instruction and display the reason that the halt is
- * happening. Once this is done, the VM context is marked as being halted. */
-static void vm_ihalt (VMContext *context, Instruction *instruction)
+/* Work out why the engines stopped running the program in the provided context. */
+static VMStatus vm_status (const VMContext *context)
 {
-    /* The first parameter is always the error reason. */
-    IHALT_Reason errorReason = (IHALT_Reason) instruction->parameters[0];
+    if (context->suspended)
+        return VM_STATUS_SUSPENDED;
 
-    /* Currently the only thing that uses the second parameter is the error about a missing opcode. */
-    Opcode missingOpcode = (Opcode) instruction->parameters[1];
-
-    /* Display the message now. */
-    fprintf (stderr, ">> *** << Invalid program detected\n");
-    fprintf (stderr, ">> *** << %s\n", ihalt_error_reason (errorReason, missingOpcode));
+    if (context->halted == 0)
+        return VM_STATUS_BUDGET_EXHAUSTED;
 
-    /* No more operations on this context now. */
-    context->halted = 1;
+    return context->error ? VM_STATUS_ERROR : VM_STATUS_HALTED;
 }
 
 /***********************************************************************************************************/
 
-/* Output a trace of the instruction that the VM is currently sitting at. */
+#if VM_TRACE_ENABLED
+
+/* Output a trace of the instruction that the VM is currently sitting at. This is only called by the traced
+ * engines, which are only used when the context is tracing at VM_TRACE_FULL. */
 static void vm_trace (VMContext *context, Instruction *instruction)
 {
     int i;
     const char *mask;
+    VMOutput *output;
 
-    /* Detect errors in the user program. These are developer errors because they indicate that the bytecode
-     * stream is observably broken. */
-    if (instruction->opcode == IHALT)
-    {
-        vm_ihalt (context, instruction);
+    /* Errors in the user program are not traced; executing the IHALT displays the reason for it instead. */
+    if (instruction->opcode == IHALT || (output = vm_output (context)) == NULL)
         return;
-    }
 
     /* This string mask tells us what each of the operands is, so that we can display it properly. */
     mask = opcode_operand_mask (instruction->opcode);
 
-    fprintf (stderr, ">>> %s", opcode_name (instruction->opcode));
+    output_string (output, ">>> ");
+    output_string (output, opcode_name (instruction->opcode));
     for (i = 0 ; i < instruction->pCount ; i++)
     {
+        output_string (output, " ");
         if (mask[i] == 'r')
         {
             int reg = instruction->parameters[i];
-            fprintf (stderr, " %s (%d) ", register_name ((Register) reg), context->registers[reg]);
+
+            output_string (output, register_name ((Register) reg));
+            output_string (output, " (");
+            output_int (output, context->registers[reg]);
+            output_string (output, ")");
         }
         else
-            fprintf (stderr, " %d ", instruction->parameters[i]);
+            output_int (output, instruction->parameters[i]);
+        output_string (output, " ");
+    }
+    output_end_line (output);
+}
+
+#endif
+
+/***********************************************************************************************************/
+
+/* Display the value that a POP removed from the stack, if the context is tracing operations. */
+void vm_output_pop (VMContext *context, int value)
+{
+#if VM_TRACE_ENABLED
+    VMOutput *output;
+
+    if (context->traceLevel >= VM_TRACE_OPS && (output = vm_output (context)) != NULL)
+    {
+        output_string (output, "<<POP>> ");
+        output_int (output, value);
+        output_end_line (output);
+    }
+#endif
+}
+
+/***********************************************************************************************************/
+
+/* Display the value that a SET stored in a register, if the context is tracing operations. */
+void vm_output_set (VMContext *context, int reg, int value)
+{
+#if VM_TRACE_ENABLED
+    VMOutput *output;
+
+    if (context->traceLevel >= VM_TRACE_OPS && (output = vm_output (context)) != NULL)
+    {
+        output_string (output, "<<SET ");
+        output_string (output, register_name ((Register) reg));
+        output_string (output, ">> ");
+        output_int (output, value);
+        output_end_line (output);
+    }
+#endif
+}
+
+/***********************************************************************************************************/
+
+/* Profile and record an instruction that is about to be executed, for a context that is being profiled or
+ * recorded (or both). The recorder leaves IHALTs to vm_trap(), the same way tracing does. This is too big to
+ * inline into every operation of the instrumented engines, which are slow anyway. */
+static void vm_instrument (VMContext *context, Instruction *instruction)
+{
+    if (context->profile != NULL)
+        profile_record (context->profile, instruction->opcode, instruction->ip);
+
+    if (context->recorder != NULL && instruction->opcode != IHALT)
+        recorder_write (context->recorder, context, instruction);
+}
+
+/***********************************************************************************************************/
+
+/* Check if the compare and branch instruction provided jumps, with the top of the stack given. */
+static inline int vm_jump_taken (const VMContext *context, const Instruction *instruction, int tos)
+{
+    const int *p = instruction->parameters;
+    int left = context->registers[p[0]];
+
+    switch (instruction->opcode)
+    {
+        case RJNE:  return left != tos;
+        case RJNEI: return left != p[1];
+        case RJEQI: return left == p[1];
+        case RJLTI: return left < p[1];
+        case RJNER: return left != context->registers[p[1]];
+        case RJEQR: return left == context->registers[p[1]];
+        case RJLTR: return left < context->registers[p[1]];
+        default:    return instruction->opcode == JMP;
     }
-    fprintf (stderr, "\n");
 }
 
 /***********************************************************************************************************/
 
-/* Check the stack overflow/undeflow bits in the provided context. If either is set, the appropriate error
- * message is displayed, the VM is halted, and 1 is returned.
+/* The number of trips around a loop that never ends. */
+#define LOOP_FOREVER ULLONG_MAX
+
+/* The comparisons that the jump at the end of a counted loop makes between its counter and what it's
+ * compared with (the bound), jumping back if it's true. LOOP_GT is RJLTR with the counter on the right. */
+typedef enum
+{
+    LOOP_NE,
+    LOOP_EQ,
+    LOOP_LT,
+    LOOP_GT,
+} LoopTest;
+
+/***********************************************************************************************************/
+
+/* Find the smallest number of steps (from 0) that takes a value that starts at 0, and goes up by step on every
+ * one modulo size, to somewhere from low to high, where 0 <= low <= high < size. Returns LOOP_FOREVER if it
+ * never gets there.
  *
- * If all is OK, 0 is returned instead. */
-static int check_stack (VMContext *context)
+ * If the value doesn't get there before it first wraps around, it has to on a later time around, and how far
+ * short of a multiple of step each time around starts goes up by size modulo step. Finding the first time
+ * around that starts close enough is the same problem again, with step as the size and size % step as the
+ * step, which gets smaller the way that it does in Euclid's algorithm until there's an answer or a step of 0
+ * that never gets anywhere. */
+static unsigned long long vm_loop_first (unsigned long long step, unsigned long long size,
+                                         unsigned long long low, unsigned long long high)
 {
-    Instruction iHalt;
+    unsigned long long steps, around;
 
-    if (context->vmFlags.stackOverflow)
-        init_ihalt_instruction (&iHalt, IHALT_STACK_OVERFLOW, 0);
-    else if (context->vmFlags.stackUnderflow)
-        init_ihalt_instruction (&iHalt, IHALT_STACK_UNDERFLOW, 0);
-    else
+    if (low == 0)
         return 0;
 
-    vm_ihalt (context, &iHalt);
-    return 1;
+    if (step == 0)
+        return LOOP_FOREVER;
+
+    steps = (low + step - 1) / step;
+    if (steps * step <= high)
+        return steps;
+
+    /* There's no multiple of step from low to high, so the range doesn't wrap around modulo step. */
+    around = vm_loop_first (size % step, step, step - high % step, step - low % step);
+    if (around == LOOP_FOREVER)
+        return LOOP_FOREVER;
+
+    return (low + size * around - 1) / step + 1;
 }
 
 /***********************************************************************************************************/
 
-/* Evaluate (execute) a single VM instruction in the provided context. */
-static void evaluate (VMContext *context, Instruction *instruction)
+/* Work out how many more times the jump at the end of a counted loop is taken, starting with now, when it's
+ * taken, and with the counter going up by step (with wraparound) on every trip around the loop. Returns
+ * LOOP_FOREVER if the loop never ends. */
+static unsigned long long vm_loop_trips (LoopTest test, int counter, int bound, unsigned int step)
 {
-    /* Used to halt the VM if we encounter an error. */
-    Instruction ihalt;
+    if (step == 0)
+        return LOOP_FOREVER;
 
-    /* The new IP is going to be the current IP, plus 1 to skip over this instruction, plus however many
-     * parameters this instruction took. */
-    int new_ip = context->ip + instruction->pCount + 1;
+    switch (test)
+    {
+        /* This is solving counter + trips * step == bound, modulo 2^32. The power of two in step has to
+         * divide the distance to the bound for there to be an answer; what's left of step is odd, which
+         * gives it an inverse (found with Newton's method, where every step doubles the bits that are
+         * right). */
+        case LOOP_NE:
+        {
+            unsigned int distance = (unsigned int) bound - (unsigned int) counter, odd = step, inverse;
+            int shift = 0, i;
 
-    /* Handle based on opcode. */
-    switch (instruction->opcode)
+            while ((odd & 1) == 0)
+            {
+                odd >>= 1;
+                shift++;
+            }
+
+            if ((distance & ((1u << shift) - 1)) != 0)
+                return LOOP_FOREVER;
+
+            inverse = odd;
+            for (i = 0 ; i < 4 ; i++)
+                inverse *= 2 - odd * inverse;
+
+            return ((distance >> shift) * inverse) & (0xFFFFFFFFu >> shift);
+        }
+
+        /* The counter is equal to the bound now, so the next trip changes that. */
+        case LOOP_EQ:
+            return 1;
+
+        /* The loop ends on the first trip that leaves the counter from the bound up to INT_MAX (or from
+         * INT_MIN up to the bound), which the counter can step over and carry on from the other end,
+         * maybe many times, or forever. Adding 2^31 to everything makes the order of the values the same
+         * unsigned, and taking off where the counter is after the next trip starts it from 0. */
+        case LOOP_LT:
+        case LOOP_GT:
+        default:
+        {
+            unsigned int next = (unsigned int) counter + step + 0x80000000u;
+            unsigned int low = test == LOOP_LT ? (unsigned int) bound + 0x80000000u : 0;
+            unsigned int high = test == LOOP_LT ? 0xFFFFFFFFu : (unsigned int) bound + 0x80000000u;
+            unsigned long long later;
+
+            low -= next;
+            high -= next;
+
+            /* The next trip ends it if it's in the range, which is when the range now wraps around 0. */
+            if (low == 0 || low > high)
+                return 1;
+
+            later = vm_loop_first (step, 4294967296ULL, low, high);
+            return later == LOOP_FOREVER ? LOOP_FOREVER : later + 1;
+        }
+    }
+}
+
+/***********************************************************************************************************/
+
+/* Run the rest of the counted loop that the jump provided closes, when it's about to be executed with the top
+ * of the stack given (see analyze_loops()). The registers end up the way that running the trips around the
+ * loop one at a time would leave them, and the budget is charged the same.
+ *
+ * Returns 0 if the loop has ended, which leaves the instruction after the jump to run next, or 1 if the
+ * budget ran out, which stops the program at the top of the loop. */
+static int vm_loop (VMContext *context, const Instruction *jump, int tos, long long *fuel)
+{
+    const Instruction *body = context->decoded->code + jump->target;
+    const int *p = jump->parameters;
+    int *registers = context->registers;
+    long long length = jump - body + 1;
+    unsigned int amounts[REGISTER_COUNT], step = 0;
+    int targets[REGISTER_COUNT], adds[REGISTER_COUNT], count = 0, counter = p[0], bound, value, stopped, i;
+    unsigned long long trips, affordable;
+    LoopTest test;
+
+    /* What each instruction in the body does on every trip; nothing that it reads from changes. */
+    for (i = 0 ; body + i < jump ; i++)
     {
-        /* Do nothing. */
-        case NOP:
-            break;
+        const int *q = body[i].parameters;
 
-        /* Push the next byte onto the stack. We pre-increment the instruction pointer since it's currently
-         * sitting on the push instruction. */
-        case PUSH:
-            ctx_stack_push (context, instruction->parameters[0]);
-            if (check_stack (context))
-                break;
+        adds[count] = 1;
+        switch (body[i].opcode)
+        {
+            case RDEC:  amounts[count] = (unsigned int) -1; break;
+            case RINC:  amounts[count] = 1; break;
+            case RADDI: amounts[count] = (unsigned int) q[2]; break;
+            case RSUBI: amounts[count] = -(unsigned int) q[2]; break;
+            case RADDR: amounts[count] = (unsigned int) registers[q[1] == q[0] ? q[2] : q[1]]; break;
+            case RSUBR: amounts[count] = -(unsigned int) registers[q[2]]; break;
+            case RMOVI: amounts[count] = (unsigned int) q[1]; adds[count] = 0; break;
+            case RMOV:  amounts[count] = (unsigned int) registers[q[1]]; adds[count] = 0; break;
+            default:    continue;
+        }
+
+        targets[count++] = q[0];
+    }
+
+    switch (jump->opcode)
+    {
+        case RJNE:
+            bound = tos;
+            test = LOOP_NE;
             break;
 
-        /* Pop the top value from the stack. This will also display the value that was popped. */
-        case POP:
-            {
-                int result = ctx_stack_pop (context);
-                if (check_stack (context))
-                    break;
+        case RJNEI:
+        case RJEQI:
+        case RJLTI:
+            bound = p[1];
+            test = jump->opcode == RJNEI ? LOOP_NE : jump->opcode == RJEQI ? LOOP_EQ : LOOP_LT;
+            break;
 
-                fprintf (stderr, "<<POP>> %d\n", result);
-                break;
-            }
+        /* The counter is whichever of the registers the body changes. */
+        default:
+            for (i = 0 ; i < count && targets[i] != counter ; i++)
+                ;
 
-        /* Set a register from the stack. */
-        case SET:
-            {
-                int dReg = instruction->parameters[0];
-                int value = ctx_stack_pop (context);
-                if (check_stack (context))
-                    break;
+            if (i == count)
+                counter = p[1];
 
-                context->registers[dReg] = value;
-                fprintf (stderr, "<<SET %s>> %d\n", register_name ((Register) dReg), value);
-            }
+            bound = registers[counter == p[0] ? p[1] : p[0]];
+            test = jump->opcode == RJNER ? LOOP_NE : jump->opcode == RJEQR ? LOOP_EQ :
+                   counter == p[0] ? LOOP_LT : LOOP_GT;
             break;
+    }
 
-        /* Pop two values from the stack, add them together, and then push the result back. */
-        case ADD:
+    for (i = 0 ; i < count ; i++)
+    {
+        if (targets[i] == counter)
+            step = amounts[i];
+    }
+
+    value = registers[counter];
+    if (test == LOOP_NE ? value == bound : test == LOOP_EQ ? value != bound :
+        test == LOOP_LT ? value >= bound : value <= bound)
+        return 0;
+
+    trips = vm_loop_trips (test, value, bound, step);
+
+    /* The budget runs out on the jump that takes it to zero or below, which leaves the body of the loop one
+     * trip short of the number of jumps. */
+    affordable = *fuel / length + (*fuel % length != 0);
+    stopped = trips >= affordable;
+    if (stopped)
+        trips = affordable - 1;
+
+    for (i = 0 ; i < count ; i++)
+    {
+        unsigned int before = (unsigned int) registers[targets[i]];
+
+        if (adds[i])
+            registers[targets[i]] = (int) (before + amounts[i] * (unsigned int) trips);
+        else if (trips > 0)
+            registers[targets[i]] = (int) amounts[i];
+    }
+
+    *fuel -= trips * length;
+    if (stopped)
+    {
+        *fuel -= length;
+        return 1;
+    }
+
+    return 0;
+}
+
+/***********************************************************************************************************/
+
+/* Generate the interpreter engines. Each engine comes in three versions; one that traces every instruction,
+ * one that instruments them (see vm_instrument()) and one that does neither, so that the engine that runs
+ * when we're not tracing, profiling or recording doesn't pay anything for it. The traced versions are left
+ * out entirely when tracing is compiled out, and the threaded engines need compiler support for computed
+ * gotos. */
+#define ENGINE_NAME       run_switch
+#define ENGINE_THREADED   0
+#define ENGINE_TRACE      0
+#define ENGINE_INSTRUMENT 0
+#include "engine.inc"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_TRACE
+#undef ENGINE_INSTRUMENT
+
+#if VM_TRACE_ENABLED
+#define ENGINE_NAME       run_switch_traced
+#define ENGINE_THREADED   0
+#define ENGINE_TRACE      1
+#define ENGINE_INSTRUMENT 0
+#include "engine.inc"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_TRACE
+#undef ENGINE_INSTRUMENT
+#endif
+
+#define ENGINE_NAME       run_switch_instrumented
+#define ENGINE_THREADED   0
+#define ENGINE_TRACE      0
+#define ENGINE_INSTRUMENT 1
+#include "engine.inc"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_TRACE
+#undef ENGINE_INSTRUMENT
+
+#if VM_HAVE_COMPUTED_GOTO
+#define ENGINE_NAME       run_threaded
+#define ENGINE_THREADED   1
+#define ENGINE_TRACE      0
+#define ENGINE_INSTRUMENT 0
+#include "engine.inc"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_TRACE
+#undef ENGINE_INSTRUMENT
+
+#if VM_TRACE_ENABLED
+#define ENGINE_NAME       run_threaded_traced
+#define ENGINE_THREADED   1
+#define ENGINE_TRACE      1
+#define ENGINE_INSTRUMENT 0
+#include "engine.inc"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_TRACE
+#undef ENGINE_INSTRUMENT
+#endif
+
+#define ENGINE_NAME       run_threaded_instrumented
+#define ENGINE_THREADED   1
+#define ENGINE_TRACE      0
+#define ENGINE_INSTRUMENT 1
+#include "engine.inc"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_TRACE
+#undef ENGINE_INSTRUMENT
+#endif
+
+/***********************************************************************************************************/
+
+/* Run a program in the compact encoding straight out of its bytes, decoding each instruction as it gets to
+ * it. This does what the other engines do, one instruction at a time and without any of the tricks, since
+ * there is no decoded program to hang them off of. Without one, the size of a loop isn't known either, so
+ * this charges the budget for every instruction that it executes instead of for every loop. */
+static void run_compact (VMContext *context, long long *budget)
+{
+    Instruction instruction;
+    int ip = context->ip, next, value, p1, p2;
+
+    for ( ; *budget > 0 ; (*budget)--)
+    {
+        next = ip + compact_fetch (context->compact, context->compactSize, ip, &instruction);
+
+        if (context->profile != NULL || context->recorder != NULL)
+            vm_instrument (context, &instruction);
+
+#if VM_TRACE_ENABLED
+        if (context->traceLevel == VM_TRACE_FULL)
+            vm_trace (context, &instruction);
+#endif
+
+        switch (instruction.opcode)
         {
-            int p1, p2;
-            p1 = ctx_stack_pop (context);
-            if (check_stack (context))
+            case PUSH:
+                if (context->sp == context->stackSize - 1)
+                    goto overflow;
+                context->stack[++context->sp] = instruction.parameters[0];
+                break;
+
+            case POP:
+                if (context->sp < 0)
+                    goto underflow;
+                vm_output_pop (context, context->stack[context->sp--]);
+                break;
+
+            case SET:
+                if (context->sp < 0)
+                    goto underflow;
+                value = context->stack[context->sp--];
+                context->registers[instruction.parameters[0]] = value;
+                vm_output_set (context, instruction.parameters[0], value);
                 break;
 
-            p2 = ctx_stack_pop (context);
-            if (check_stack (context))
+            case ADD:
+                if (context->sp < 1)
+                    goto underflow;
+                p1 = context->stack[context->sp--];
+                context->stack[context->sp] = p1 + context->stack[context->sp];
                 break;
 
-            ctx_stack_push (context, p1 + p2);
+            case RADD:
+                if (context->sp == context->stackSize - 1)
+                    goto overflow;
+                context->stack[++context->sp] = context->registers[instruction.parameters[0]] +
+                                                context->registers[instruction.parameters[1]];
+                break;
+
+            case RDEC:
+                context->registers[instruction.parameters[0]]--;
+                break;
+
+            case RJNE:
+                if (context->sp < 0)
+                    goto underflow;
+                if (context->registers[instruction.parameters[0]] != context->stack[context->sp])
+                    next = instruction.target;
+                break;
+
+            case RMOV:
+                context->registers[instruction.parameters[0]] = context->registers[instruction.parameters[1]];
+                break;
+
+            case RMOVI:
+                context->registers[instruction.parameters[0]] = instruction.parameters[1];
+                break;
+
+            case RADDR:
+                context->registers[instruction.parameters[0]] = context->registers[instruction.parameters[1]] +
+                                                                context->registers[instruction.parameters[2]];
+                break;
+
+            case RSUBR:
+                context->registers[instruction.parameters[0]] = context->registers[instruction.parameters[1]] -
+                                                                context->registers[instruction.parameters[2]];
+                break;
+
+            case RADDI:
+                context->registers[instruction.parameters[0]] = context->registers[instruction.parameters[1]] +
+                                                                instruction.parameters[2];
+                break;
+
+            case RSUBI:
+                context->registers[instruction.parameters[0]] = context->registers[instruction.parameters[1]] -
+                                                                instruction.parameters[2];
+                break;
+
+            case RINC:
+                context->registers[instruction.parameters[0]]++;
+                break;
+
+            /* The compare and branch opcodes compare the register in the first operand with a value or the
+             * register in the second. */
+            case RJNEI:
+            case RJEQI:
+            case RJLTI:
+            case RJNER:
+            case RJEQR:
+            case RJLTR:
+                p1 = context->registers[instruction.parameters[0]];
+                p2 = instruction.opcode >= RJNER ? context->registers[instruction.parameters[1]] :
+                                                   instruction.parameters[1];
+
+                if (instruction.opcode == RJNEI || instruction.opcode == RJNER ? p1 != p2 :
+                    instruction.opcode == RJEQI || instruction.opcode == RJEQR ? p1 == p2 : p1 < p2)
+                    next = instruction.target;
+                break;
+
+            case JMP:
+                next = instruction.target;
+                break;
+
+            case HALT:
+                context->halted = 1;
+                break;
+
+            case IHALT:
+                vm_trap (context, (IHALT_Reason) instruction.parameters[0],
+                         instruction.pCount > 1 ? (Opcode) instruction.parameters[1] : NOP);
+                break;
+
+            case CALL:
+                vm_call (context, instruction.parameters[0]);
+                break;
+
+            /* Opcodes that don't exist do nothing, the same as they do when decoded. */
+            default:
+                break;
         }
-            break;
 
-        /* Get the value of the register provided in the first operand and subtract one from it. */
-        case RDEC:
-            {
-                int reg = instruction->parameters[0];
-                context->registers[reg]--;
-            }
+        if (context->halted)
+        {
+            ip = instruction.ip;
             break;
+        }
 
-        /* Get the values of the two registers used as operands and push the result of adding them. */
-        case RADD:
-            {
-                int reg1 = instruction->parameters[0];
-                int reg2 = instruction->parameters[1];
-                ctx_stack_push (context, context->registers[reg1] + context->registers[reg2]);
-                if (check_stack (context))
-                    break;
-            }
+        /* A suspended program carries on after the CALL once it's resumed. */
+        if (context->suspended)
+        {
+            ip = next;
             break;
+        }
 
-        /* If the register is not equal to the item at the top of the stack, jump the IP by the offset
-         * provided, which can be negative. */
-        case RJNE:
-            {
-                int reg = instruction->parameters[0];
-                int ofs = instruction->parameters[1];
-                int val = ctx_stack_peek (context);
-                if (check_stack (context))
-                    break;
-
-                if (context->registers[reg] != val)
-                    new_ip = context->ip + ofs;
-            }
-            break;
+        ip = next;
+        continue;
 
-        /* The HALT instruction sets the HALT flag on this context, telling the interpreter that all
-         * operations are now complete. */
-        case HALT:
-        case IHALT:
-            context->halted = 1;
-            break;
+        /* A stack error stops at the instruction, which is left undone. */
+    overflow:
+        vm_trap (context, IHALT_STACK_OVERFLOW, NOP);
+        ip = instruction.ip;
+        break;
+
+    underflow:
+        vm_trap (context, IHALT_STACK_UNDERFLOW, NOP);
+        ip = instruction.ip;
+        break;
     }
 
-    /* Update the IP on return, unless we're halted now. */
-    if (context->halted == 0)
-        context->ip = new_ip;
+    context->ip = ip;
+}
+
+/***********************************************************************************************************/
+
+/* Decode the program in the provided context into its internal form, if that has not already been done. */
+int vm_prepare (VMContext *context)
+{
+    if (context->decoded == NULL)
+        context->decoded = decode_create (context->program, context->pSize, context->stackSize);
+
+    return context->decoded != NULL;
+}
+
+/***********************************************************************************************************/
+
+/* Run the program in the provided context for at most budget instructions, leaving any output it produces
+ * in its output sink. */
+static VMStatus vm_run (VMContext *context, long long budget)
+{
+    int pc;
+
+    /* A program that has halted stays that way, and one that has been suspended stays that way until it's
+     * resumed. */
+    if (context->halted || context->suspended)
+        return vm_status (context);
+
+    if (budget <= 0)
+        return VM_STATUS_BUDGET_EXHAUSTED;
+
+    /* A compact program isn't decoded, so none of what follows applies to it. */
+    if (context->compact != NULL)
+    {
+        run_compact (context, &budget);
+
+        if (context->profile != NULL)
+            profile_stop (context->profile);
+
+        return vm_status (context);
+    }
+
+    /* The program is decoded once up front, so that the loop below only has to execute it. */
+    if (vm_prepare (context) == 0)
+    {
+        vm_no_memory (context, "Unable to allocate memory to decode the program");
+        return VM_STATUS_ERROR;
+    }
+
+    /* Find the instruction that the IP is sitting on, which is where we start. */
+    pc = decode_locate (context->decoded->code, context->decoded->codeEnd, context->ip);
+    if (pc == -1)
+    {
+        vm_trap (context, IHALT_INVALID_IP, NOP);
+        return VM_STATUS_ERROR;
+    }
+
+    /* Work out which instructions can skip checking the stack, which loops can be run in closed form and which
+     * of the instructions left can be combined into superinstructions, unless the analysis we already have
+     * covers starting here with the stack the way it is; it does when resuming a program that was started from
+     * a state that was analyzed, or a fork of one. Changing the operations means that the program needs to be
+     * threaded again, and that a decoded program that is shared can't be used for it. */
+    if (context->sp + 1 < context->decoded->code[pc].depthMin ||
+        context->sp + 1 > context->decoded->code[pc].depthMax)
+    {
+        DecodedProgram *decoded;
+
+        if (vm_unshare (context) == 0)
+            return VM_STATUS_ERROR;
+
+        decoded = context->decoded;
+        analyze_stack (decoded->code, decoded->codeSize, pc, context->sp + 1, context->stackSize);
+        analyze_loops (decoded->code, decoded->codeEnd);
+        decode_fuse (decoded->code, decoded->codeEnd, NULL);
+        decoded->stackSize = context->stackSize;
+        decoded->threadedWith = NULL;
+
+        jit_release (context->jit);
+        context->jit = NULL;
+    }
+
+    /* Native code (whether it was compiled ahead of time or by the JIT) doesn't trace, profile or record
+     * instructions, so it's only used when none of that is happening. It runs until it gets to something that
+     * it leaves to the interpreter, which then carries on from there, or until it uses up the budget. */
+    if (context->traceLevel < VM_TRACE_FULL && context->profile == NULL && context->recorder == NULL)
+    {
+        if (context->aot != NULL)
+            pc = aot_run (context->aot, context, pc, &budget);
+#if VM_HAVE_JIT
+        else if (context->engine == VM_ENGINE_JIT)
+        {
+            if (context->jit == NULL)
+                context->jit = jit_compile (context->decoded->code, context->decoded->codeSize);
+
+            if (context->jit != NULL)
+                pc = jit_run (context->jit, context, pc, &budget);
+        }
+#endif
+
+        if (budget <= 0)
+        {
+            context->ip = context->decoded->code[pc].ip;
+            return VM_STATUS_BUDGET_EXHAUSTED;
+        }
+    }
+
+    /* Run it with the engine that the context asked for, if we have it, using the instrumented version of it
+     * if the program is being profiled or recorded and the traced version of it only if every instruction is
+     * being traced.
+     * Whatever the JIT leaves over goes to the threaded engine, and whatever a program compiled ahead of time
+     * leaves over goes to the engine of the context. */
+#if VM_HAVE_COMPUTED_GOTO
+    if (context->engine != VM_ENGINE_SWITCH)
+    {
+        if (context->profile != NULL || context->recorder != NULL)
+            run_threaded_instrumented (context, pc, &budget);
+        else
+#if VM_TRACE_ENABLED
+        if (context->traceLevel == VM_TRACE_FULL)
+            run_threaded_traced (context, pc, &budget);
+        else
+#endif
+            run_threaded (context, pc, &budget);
+    }
+    else
+#endif
+    {
+        if (context->profile != NULL || context->recorder != NULL)
+            run_switch_instrumented (context, pc, &budget);
+        else
+#if VM_TRACE_ENABLED
+        if (context->traceLevel == VM_TRACE_FULL)
+            run_switch_traced (context, pc, &budget);
+        else
+#endif
+            run_switch (context, pc, &budget);
+    }
+
+    if (context->profile != NULL)
+        profile_stop (context->profile);
+
+    return vm_status (context);
+}
+
+/***********************************************************************************************************/
+
+/* Run the program in the provided context for at most budget instructions. */
+VMStatus vm_run_for (VMContext *context, long long budget)
+{
+    VMStatus status = vm_run (context, budget);
+
+    /* A budget that never runs out can still be used up all at once, by a counted loop that never ends being
+     * run in closed form (see vm_loop()). The program just carries on from the top of the loop, forever, the
+     * same as it would if every trip was run one at a time. */
+    while (budget == VM_BUDGET_UNLIMITED && status == VM_STATUS_BUDGET_EXHAUSTED)
+        status = vm_run (context, budget);
+
+    /* Hand the output over once the program stops, unless the host would rather it waited for more. */
+    if (context->output != NULL && context->output->flush != VM_OUTPUT_FLUSH_FULL)
+        output_flush (context->output);
+
+    return status;
+}
+
+/***********************************************************************************************************/
+
+/* Run the program in the provided context for at most budget instructions, and return everything about why it
+ * stopped. */
+VMResult vm_run_result (VMContext *context, long long budget)
+{
+    VMResult result;
+
+    result.status = vm_run_for (context, budget);
+    result.reason = result.status == VM_STATUS_ERROR ? (IHALT_Reason) context->errorReason : IHALT_UNKNOWN;
+    result.opcode = result.status == VM_STATUS_ERROR ? (Opcode) context->errorOpcode : NOP;
+    result.ip = context->ip;
+    result.sp = context->sp;
+
+    return result;
 }
 
 /***********************************************************************************************************/
@@ -475,19 +976,31 @@ static void evaluate (VMContext *context, Instruction *instruction)
 /* Run the program in the provided context.  */
 void vm_interpret (VMContext *context)
 {
-    Instruction instruction;
+    vm_run_for (context, VM_BUDGET_UNLIMITED);
+}
+
+/***********************************************************************************************************/
+
+/* Report on the superinstructions that the program in the provided context is currently using. */
+int vm_fusions (VMContext *context, int counts[OPERATION_COUNT])
+{
+    int i, total = 0;
 
-    /* Keep looping until we determine that we are done running. */
-    while (context->halted == 0)
+    /* Nothing is fused until the program has been decoded and analyzed. */
+    for (i = 0 ; context->decoded != NULL && i < context->decoded->codeEnd ; i++)
     {
-        /* Decode the next instruction and set what the new IP will be to execute the next instruction. */
-        decode_instruction (context, &instruction);
-        vm_trace (context, &instruction);
+        Operation operation = context->decoded->code[i].operation;
 
-        /* Execute the instruction now. */
-        evaluate (context, &instruction);
+        if (operation != OP_PUSH_SET && operation != OP_RDEC_RJNE && operation != OP_RADD_ADD)
+            continue;
+
+        if (counts != NULL)
+            counts[operation]++;
+
+        total++;
     }
+
+    return total;
 }
 
 /***********************************************************************************************************/
-
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include "registers.h"
 #include "opcodes.h"
 #include "context.h"
@@ -16,6 +17,9 @@
 /* This specifies the number of parameters (at maximum) an opcode can have. */
 #define MAX_OPCODE_PARAMS 5
 
+/* A budget for vm_run_for() that never runs out. */
+#define VM_BUDGET_UNLIMITED LLONG_MAX
+
 /***********************************************************************************************************/
 
 /* The IHALT instruction is a special internal HALT instruction that terminals the program but also has a
@@ -44,24 +48,201 @@ typedef enum
 
     /* A stack pop or peek operation has failed due to the stack being empty. */
     IHALT_STACK_UNDERFLOW,
+
+    /* Execution was asked to continue at an IP that is not the start of an instruction, such as a jump whose
+     * offset lands in the middle of another instruction's operands or before the start of the program. */
+    IHALT_INVALID_IP,
+
+    /* The program contains a value in an opcode position that is not an opcode. The interpreter treats these
+     * as a NOP, but a program containing one does not pass verification. */
+    IHALT_INVALID_OPCODE,
+
+    /* An opcode has a register operand that is not a valid register. The opcode in question is in the second
+     * parameter to the IHALT opcode. */
+    IHALT_INVALID_REGISTER,
+
+    /* A CALL asked for a host function that the host did not give the context (see ctx_host()). */
+    IHALT_INVALID_HOST_CALL,
+
+    /* A host function that a CALL called failed. */
+    IHALT_HOST_CALL_FAILED,
 } IHALT_Reason;
 
+/* The reason that vm_run_for() returned. */
+typedef enum
+{
+    /* The program executed a HALT. */
+    VM_STATUS_HALTED,
+
+    /* The program used up its budget before it halted. Running it again carries on from where it stopped. */
+    VM_STATUS_BUDGET_EXHAUSTED,
+
+    /* The program was halted because of an error (an IHALT). */
+    VM_STATUS_ERROR,
+
+    /* A host function that the program called suspended it. It stays that way until the host resumes it with
+     * ctx_resume(), after which running it again carries on from the instruction after the CALL. */
+    VM_STATUS_SUSPENDED,
+} VMStatus;
+
+/* Everything about why vm_run_result() returned, which is all that a host needs to report on a program that
+ * failed without the interpreter displaying anything; see vm_run_result(). */
+typedef struct VMResult
+{
+    /* Why the program stopped. */
+    VMStatus status;
+
+    /* When the status is VM_STATUS_ERROR, the reason for the error and the opcode that the reason is about
+     * (NOP if it isn't about one), as ihalt_error_reason() takes them. */
+    IHALT_Reason reason;
+    Opcode opcode;
+
+    /* The IP of the instruction that halted the program, or that it carries on from, and the stack pointer.
+     * An instruction that fails doesn't change anything, so the stack is the way it was before it. */
+    int ip;
+    int sp;
+} VMResult;
+
+/* The operations that the interpreter engines actually execute. The first set of these are the opcodes
+ * themselves; the rest are internal variations on them that the decoder and its analysis passes substitute
+ * for an opcode when they can prove that a faster version of it is safe to use. They never appear in a
+ * bytecode program. */
+typedef enum
+{
+    OP_NOP   = NOP,
+    OP_PUSH  = PUSH,
+    OP_POP   = POP,
+    OP_SET   = SET,
+    OP_ADD   = ADD,
+    OP_RADD  = RADD,
+    OP_RDEC  = RDEC,
+    OP_RJNE  = RJNE,
+    OP_HALT  = HALT,
+    OP_IHALT = IHALT,
+    OP_RMOV  = RMOV,
+    OP_RMOVI = RMOVI,
+    OP_RADDR = RADDR,
+    OP_RSUBR = RSUBR,
+    OP_RADDI = RADDI,
+    OP_RSUBI = RSUBI,
+    OP_RINC  = RINC,
+    OP_RJNEI = RJNEI,
+    OP_RJEQI = RJEQI,
+    OP_RJLTI = RJLTI,
+    OP_RJNER = RJNER,
+    OP_RJEQR = RJEQR,
+    OP_RJLTR = RJLTR,
+    OP_JMP   = JMP,
+    OP_CALL  = CALL,
+
+    /* Versions of the opcodes that use the stack that skip checking for stack overflow and underflow,
+     * because the stack is proven to always have the room or the values that they need. */
+    OP_PUSH_UNCHECKED,
+    OP_POP_UNCHECKED,
+    OP_SET_UNCHECKED,
+    OP_ADD_UNCHECKED,
+    OP_RADD_UNCHECKED,
+    OP_RJNE_UNCHECKED,
+
+    /* Superinstructions, which do the work of two instructions in a row with a single dispatch. These are
+     * only used in place of instructions that don't need to check the stack. See decode_fuse(). */
+    OP_PUSH_SET,
+    OP_RDEC_RJNE,
+    OP_RADD_ADD,
+
+    /* The jump that closes a counted loop, which works out where the loop ends and runs the rest of it in one
+     * go. This is only used in place of a jump whose loop has been proven to qualify. See analyze_loops(). */
+    OP_LOOP,
+
+    /* The total number of operations. */
+    OPERATION_COUNT,
+} Operation;
+
 /* This structure represents a decoded instruction from the program stream. */
-typedef struct
+typedef struct Instruction
 {
     /* The opcode that indicates what the instruction is supposed to do. */
     Opcode opcode;
 
+    /* The operation that the engines execute to carry out the opcode. This is usually the same as the
+     * opcode, but may be a faster variant of it. Opcodes that don't exist are decoded as OP_NOP. */
+    Operation operation;
+
     /* The parameters to the opcode, and a description of how many of the slots are used. */
     int parameters[MAX_OPCODE_PARAMS];
     int pCount;
+
+    /* The IP in the program stream that this instruction was decoded from. */
+    int ip;
+
+    /* For jump instructions, the index in the decoded program of the instruction that the jump lands on. This
+     * is resolved once when the program is decoded, so that taking a jump does not need to look anything up. */
+    int target;
+
+    /* The address of the code that executes this instruction, for the engines that use direct threading. */
+    const void *handler;
+
+    /* The smallest and largest number of items that can be on the stack when this instruction executes, as
+     * worked out by analyze_stack(). When depthMin is larger than depthMax, the analysis has not found any
+     * way to reach this instruction. */
+    int depthMin;
+    int depthMax;
 } Instruction;
 
 /***********************************************************************************************************/
 
-/* Run the program in the provided context.  */
+/* Convert the error reason from an IHALT instruction into a human readable string. The opcode is only used
+ * for the reasons that are about a specific opcode.
+ *
+ * This *might* use storage that belongs to the calling thread, so make a copy of the return value if you want
+ * it to remain valid between calls. It is safe to call from several threads at once. */
+const char *ihalt_error_reason (IHALT_Reason errorReason, Opcode opcode);
+
+/* Display the value that a POP removed from the stack or that a SET stored in a register, if the context
+ * is tracing operations, by adding it to the output sink of the context (see ctx_output_fd()). Every engine
+ * (including the JIT) uses these to produce the results of operations. */
+void vm_output_pop (VMContext *context, int value);
+void vm_output_set (VMContext *context, int reg, int value);
+
+/* Decode the program in the provided context into its internal form, if that has not already been done.
+ * vm_interpret() does this on its own if needed, but a host may want to pay the cost up front.
+ *
+ * Returns 1 if the context is ready to run or 0 if the decoded program could not be allocated. */
+int vm_prepare (VMContext *context);
+
+/* Run the program in the provided context until it halts. */
 void vm_interpret (VMContext *context);
 
+/* Run the program in the provided context for at most budget instructions, returning early if it halts. When
+ * the budget runs out, the context is left ready to carry on from the next instruction, so calling this
+ * again resumes the program. Running a program that has already halted does nothing.
+ *
+ * The budget is only checked when a jump goes backwards, which is charged for the number of instructions in
+ * the loop that it closes. This means that the count is approximate: straight line code between two loops
+ * is not charged for, and a loop with a jump that skips part of it is charged for all of it. A program can
+ * only run for so long without looping, so every program stops after a bounded amount of work.
+ *
+ * Unless the output sink of the context was set up to wait until it's full, the output that the program
+ * produced is handed over before this returns.
+ *
+ * The return value says why the program stopped. */
+VMStatus vm_run_for (VMContext *context, long long budget);
+
+/* Run the program in the provided context for at most budget instructions, the same way as vm_run_for(), and
+ * return everything about why it stopped. Errors in the program leave the interpreter through a single path
+ * that is kept out of the way of the engines, which records the reason for the error in the context; running
+ * a program that has already halted returns the same result again.
+ *
+ * The interpreter only displays the reason for an error itself if the context is tracing errors (see
+ * VMTraceLevel), so a host running many contexts at once can trace nothing and decide what to report from
+ * the result instead. */
+VMResult vm_run_result (VMContext *context, long long budget);
+
+/* Report on the superinstructions that the program in the provided context is currently using. The count
+ * of how many times each superinstruction is used is stored in counts (which is indexed by Operation), if it
+ * is not NULL. The return value is the total number of superinstructions. */
+int vm_fusions (VMContext *context, int counts[OPERATION_COUNT]);
+
 /***********************************************************************************************************/
 
 #endif
@@ -0,0 +1,87 @@
+/***********************************************************************************************************/
+
+#include <stdlib.h>
+#include <core/core.h>
+
+/***********************************************************************************************************/
+
+/* The names of the trace levels, as they're given on the command line. */
+static const char *level_names[] = { "none", "errors", "ops", "full" };
+
+/***********************************************************************************************************/
+
+/* Display how to use the program, and return the exit code for having been used wrong. */
+static int usage (const char *name)
+{
+    fprintf (stderr, "Usage: %s [-l level] [-n count] dump\n\n", name);
+    fprintf (stderr, "  dump    A recording written by a context that was being recorded (such as with vm -r)\n");
+    fprintf (stderr, "  -l      How much to display: none, errors, ops or full (the default)\n");
+    fprintf (stderr, "  -n      Only display the last count instructions in the recording\n\n");
+    fprintf (stderr, "The recording is displayed the same way that the interpreter traces a program.\n");
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
+/* Entry point. */
+int main (int argc, char **argv)
+{
+    VMTraceLevel level = VM_TRACE_FULL;
+    TraceRecord *records;
+    uint64_t total;
+    int count, last = -1, option, i;
+
+    while ((option = getopt (argc, argv, "l:n:")) != -1)
+    {
+        switch (option)
+        {
+            case 'l':
+                for (i = 0 ; i <= VM_TRACE_FULL ; i++)
+                {
+                    if (strcmp (optarg, level_names[i]) == 0)
+                        break;
+                }
+
+                if (i > VM_TRACE_FULL)
+                    return usage (argv[0]);
+
+                level = (VMTraceLevel) i;
+                break;
+
+            case 'n':
+                last = atoi (optarg);
+                if (last < 0)
+                    return usage (argv[0]);
+                break;
+
+            default:
+                return usage (argv[0]);
+        }
+    }
+
+    if (argc - optind != 1)
+        return usage (argv[0]);
+
+    records = recorder_load (argv[optind], &count, &total);
+    if (records == NULL)
+    {
+        fprintf (stderr, ">> *** << Unable to load %s\n", argv[optind]);
+        fprintf (stderr, ">> *** << File can't be read, or is not a recording\n");
+        return 1;
+    }
+
+    /* Say how much of the program is missing from the start of the recording, if any. */
+    i = last != -1 && last < count ? count - last : 0;
+    fprintf (stderr, "Recording of %llu instructions; displaying the last %d\n\n", (unsigned long long) total,
+             count - i);
+
+    for ( ; i < count ; i++)
+        recorder_print (&records[i], level, stdout);
+
+    free (records);
+
+    return 0;
+}
+
+/***********************************************************************************************************/
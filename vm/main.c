@@ -45,19 +45,162 @@ int program[] = {
 
 /***********************************************************************************************************/
 
+/* Display how to use the program, and return the exit code for having been used wrong. */
+static int usage (const char *name)
+{
+    fprintf (stderr, "Usage: %s [-a module] [-c] [-O] [-p] [-r dump] [image]\n", name);
+    fprintf (stderr, "       %s -w image\n\n", name);
+    fprintf (stderr, "  image   Run the program in the bytecode image file given instead of the built in one\n");
+    fprintf (stderr, "  -a      Run the program with the module compiled from it by aot instead of tracing it\n");
+    fprintf (stderr, "  -c      Check the program in the image against its checksum before running it\n");
+    fprintf (stderr, "  -O      Optimize the program before running it, which leaves less of it to trace\n");
+    fprintf (stderr, "  -p      Profile the program, and display the profile once it has finished\n");
+    fprintf (stderr, "  -r      Record the program instead of tracing it, and write the recording to dump\n");
+    fprintf (stderr, "  -w      Write the built in program out to a bytecode image file, and exit\n");
+
+    return 1;
+}
+
+/***********************************************************************************************************/
+
 /* Entry point. */
 int main (int argc, char **argv)
 {
     /* Our interpreter context. */
     VMContext context;
+    VerifyError error;
+    VMImage image;
+    ImageError imageError;
+    int *code = program, *optimized = NULL;
+    int programLength = sizeof (program) / sizeof (int);
+    const char *record = NULL, *compiled = NULL;
+    AotModule *module = NULL;
+    AotError aotError;
+    int check = 0, write = 0, optimize = 0, profile = 0, verified = 0, option;
 
     fprintf (stderr, "SimpleVM - %s (%s)\n\n", VERSION, REVISION);
 
+    while ((option = getopt (argc, argv, "a:cOpr:w")) != -1)
+    {
+        switch (option)
+        {
+            case 'a': compiled = optarg; break;
+            case 'c': check = 1; break;
+            case 'O': optimize = 1; break;
+            case 'p': profile = 1; break;
+            case 'r': record = optarg; break;
+            case 'w': write = 1; break;
+            default:  return usage (argv[0]);
+        }
+    }
+
+    if (argc - optind > 1 || (write && argc - optind != 1))
+        return usage (argv[0]);
+
+    /* Save the built in program as an image. */
+    if (write)
+    {
+        if (image_write (argv[optind], program, programLength, &imageError) == 0)
+        {
+            fprintf (stderr, ">> *** << Unable to write %s\n", argv[optind]);
+            fprintf (stderr, ">> *** << %s\n", image_error_reason (imageError));
+            return 1;
+        }
+
+        return 0;
+    }
+
+    /* Run the program from an image instead of the built in one. The program is run straight out of the
+     * mapped file, and doesn't need to be verified again if it was verified when the image was written. */
+    memset (&image, 0, sizeof (VMImage));
+    if (optind < argc)
+    {
+        if (image_open (argv[optind], &image, &imageError) == 0 ||
+            (check && image_check (&image, &imageError) == 0))
+        {
+            fprintf (stderr, ">> *** << Unable to load %s\n", argv[optind]);
+            fprintf (stderr, ">> *** << %s\n", image_error_reason (imageError));
+            image_close (&image);
+            return 1;
+        }
+
+        code = image.program;
+        programLength = image.programLength;
+        verified = image.verified;
+    }
+
+    /* Make sure that the program is sane before we try to run it. */
+    if (verified == 0 && verify_program (code, programLength, &error) == 0)
+    {
+        fprintf (stderr, ">> *** << Program failed verification at IP %d (%s)\n", error.ip, opcode_name (error.opcode));
+        fprintf (stderr, ">> *** << %s\n", ihalt_error_reason (error.reason, error.opcode));
+        image_close (&image);
+        return 1;
+    }
+
+    /* Run the optimized program in its place. A module compiled from the original won't match it. */
+    if (optimize)
+    {
+        int optimizedLength;
+
+        optimized = optimize_program (code, programLength, CONTEXT_STACK_SIZE, &optimizedLength, NULL);
+        if (optimized == NULL)
+            fprintf (stderr, ">> *** << Unable to allocate memory to optimize the program\n");
+        else
+        {
+            fprintf (stderr, "Optimized the program from %d ints to %d\n\n", programLength, optimizedLength);
+            code = optimized;
+            programLength = optimizedLength;
+        }
+    }
+
     /* Set up a program context and then run it. */
-    vm_interpret (ctx_init (&context, program, sizeof (program) / sizeof (int)));
+    ctx_init (&context, code, programLength);
+    if (profile && ctx_profile (&context, 1) == 0)
+        fprintf (stderr, ">> *** << Unable to allocate memory to profile the program\n");
+
+    /* A recording takes the place of the trace, apart from errors. */
+    if (record != NULL)
+    {
+        if (ctx_record (&context, RECORDER_DEFAULT_CAPACITY) == 0)
+            fprintf (stderr, ">> *** << Unable to allocate memory to record the program\n");
+        else
+            context.traceLevel = VM_TRACE_ERRORS;
+    }
+
+    /* So does running a compiled program, which only displays the results of operations, since it doesn't run
+     * at all when every instruction is being traced. */
+    if (compiled != NULL)
+    {
+        module = aot_load (compiled, &aotError);
+        if (module == NULL)
+        {
+            fprintf (stderr, ">> *** << Unable to load %s\n", compiled);
+            fprintf (stderr, ">> *** << %s\n", aot_error_reason (aotError));
+        }
+        else if (ctx_aot (&context, module) == 0)
+            fprintf (stderr, ">> *** << %s was not compiled from this program\n", compiled);
+        else if (context.traceLevel == VM_TRACE_FULL)
+            context.traceLevel = VM_TRACE_OPS;
+    }
+
+    vm_interpret (&context);
+
+    if (context.profile != NULL)
+    {
+        fprintf (stderr, "\n");
+        profile_dump_text (context.profile, stderr, 20);
+    }
+
+    if (context.recorder != NULL && recorder_dump (context.recorder, record) == 0)
+        fprintf (stderr, ">> *** << Unable to write the recording to %s\n", record);
+
+    ctx_release (&context);
+    aot_unload (module);
+    image_close (&image);
+    free (optimized);
 
     return 0;
 }
 
 /***********************************************************************************************************/
-